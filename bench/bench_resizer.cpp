@@ -0,0 +1,192 @@
+// Throughput and memory benchmark for the resize pipeline, run the way the
+// server runs it: JSON request parsing, base64 decode, resize, encode and
+// response assembly on a pool of concurrent threads.
+//
+// Usage: bench_resizer [threads] [requests_per_size_class]
+//
+// Peak heap per request is measured separately, one request at a time with
+// the pixel pool off, so that every buffer a request holds is a counted heap
+// allocation: peak_mb is the largest target's peak, and bytes_per_mp that
+// peak per source megapixel, the figure memory reductions should move.
+//
+// With RESIZER_PERF_COUNTERS=1 it also reports IPC and LLC and branch misses
+// per source megapixel for each pipeline stage and size class.
+
+#include <nlohmann/json.hpp>
+#include <opencv2/core.hpp>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "allocator_stats.hpp"
+#include "heap_tracker.hpp"
+#include "resizer.hpp"
+
+using json = nlohmann::json;
+
+namespace {
+
+struct SizeClass {
+    const char* name;
+    int width;
+    int height;
+};
+
+// Source sizes seen in production traffic, each resized to a spread of targets
+const SizeClass size_classes[] = {
+    {"small", 640, 480},
+    {"medium", 1920, 1080},
+    {"large", 4000, 3000},
+    {"xlarge", 8000, 6000},
+};
+
+const int target_widths[] = {64, 256, 1024};
+
+// Noise over a gradient so the encoder and decoder do realistic work
+std::string make_source_jpeg(int width, int height) {
+    cv::Mat image(height, width, CV_8UC3);
+    cv::randu(image, cv::Scalar(0, 0, 0), cv::Scalar(255, 255, 255));
+    for (int y = 0; y < height; y += 64) {
+        cv::rectangle(image, cv::Rect(0, y, width, 32), cv::Scalar(y % 256, 128, 255 - y % 256), -1);
+    }
+    
+    std::vector<uint8_t> buffer;
+    cv::imencode(".jpg", image, buffer, {cv::IMWRITE_JPEG_QUALITY, 85});
+    return resizer::base64_encode(buffer.data(), buffer.size());
+}
+
+size_t resident_bytes() {
+    std::ifstream statm("/proc/self/statm");
+    size_t pages = 0, resident = 0;
+    statm >> pages >> resident;
+    return resident * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+}
+
+bool env_flag(const char* name) {
+    const char* value = std::getenv(name);
+    return value && *value && std::string(value) != "0" && std::string(value) != "false";
+}
+
+// One request as the server handles it, from body parsing to response assembly
+size_t run_request(const std::string& body) {
+    auto data = json::parse(body);
+    std::string output = resizer::resize_jpeg(data["input_jpeg"], data["desired_width"], data["desired_height"]);
+    std::string response = "{\"code\": \"200\", \"message\": \"success\", \"output_jpeg\": \"" + output + "\"}";
+    return response.size();
+}
+
+// Highest heap use of any one of the bodies, each run alone. Heap counting
+// is on only inside the scope, never during the concurrent throughput runs.
+// Pooled frames are mmap'd outside the heap, so the pool is off meanwhile.
+int64_t peak_request_bytes(const std::vector<std::string>& bodies) {
+    auto pool = resizer::pixel_pool().options();
+    auto unpooled = pool;
+    unpooled.mode = resizer::HugePageMode::off;
+    resizer::pixel_pool().configure(unpooled);
+    
+    int64_t peak = 0;
+    for (const auto& body : bodies) {
+        resizer::HeapPeakScope scope;
+        run_request(body);
+        peak = std::max(peak, scope.peak_bytes());
+    }
+    resizer::pixel_pool().configure(pool);
+    return peak;
+}
+
+double percentile(std::vector<double> samples, double p) {
+    if (samples.empty()) return 0;
+    std::sort(samples.begin(), samples.end());
+    return samples[std::min(samples.size() - 1, static_cast<size_t>(p * samples.size()))];
+}
+
+}
+
+int main(int argc, char** argv) {
+    unsigned threads = argc > 1 ? std::atoi(argv[1]) : std::thread::hardware_concurrency();
+    int requests = argc > 2 ? std::atoi(argv[2]) : 48;
+    if (threads == 0) threads = 1;
+    
+    bool perf = false;
+    if (env_flag("RESIZER_PERF_COUNTERS")) {
+        std::string error = resizer::enable_perf_counters();
+        perf = error.empty();
+        if (!perf) std::fprintf(stderr, "hardware counters unavailable: %s\n", error.c_str());
+    }
+    std::vector<resizer::StageCounters::Totals> class_counters;
+    
+    std::printf("allocator=%s threads=%u requests_per_class=%d\n",
+                resizer::allocator_stats().name.c_str(), threads, requests);
+    std::printf("%-8s %10s %10s %10s %12s %12s %8s %10s %14s\n",
+                "class", "req/s", "p50_ms", "p99_ms", "rss_mb", "heap_res_mb", "frag", "peak_mb", "bytes_per_mp");
+    
+    for (const auto& size_class : size_classes) {
+        std::string source = make_source_jpeg(size_class.width, size_class.height);
+        
+        // Request bodies are built once; parsing them is part of the measured work
+        std::vector<std::string> bodies;
+        for (int width : target_widths) {
+            int height = std::max(1, width * size_class.height / size_class.width);
+            bodies.push_back(json{{"input_jpeg", source}, {"desired_width", width}, {"desired_height", height}}.dump());
+        }
+        
+        resizer::stage_counters().reset();
+        std::atomic<int> next{0};
+        std::vector<std::vector<double>> latencies(threads);
+        auto start = std::chrono::steady_clock::now();
+        
+        std::vector<std::thread> workers;
+        for (unsigned t = 0; t < threads; ++t) {
+            workers.emplace_back([&, t] {
+                for (int i = next++; i < requests; i = next++) {
+                    auto begin = std::chrono::steady_clock::now();
+                    run_request(bodies[i % bodies.size()]);
+                    latencies[t].push_back(std::chrono::duration<double, std::milli>(
+                        std::chrono::steady_clock::now() - begin).count());
+                }
+            });
+        }
+        for (auto& worker : workers) worker.join();
+        
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::vector<double> all;
+        for (const auto& samples : latencies) all.insert(all.end(), samples.begin(), samples.end());
+        auto heap = resizer::allocator_stats();
+        double rss_mb = resident_bytes() / 1048576.0;
+        class_counters.push_back(resizer::stage_counters().totals());
+        
+        int64_t peak = peak_request_bytes(bodies);
+        double megapixels = double(size_class.width) * size_class.height / 1e6;
+        
+        std::printf("%-8s %10.1f %10.2f %10.2f %12.1f %12.1f %8.3f %10.1f %14.0f\n",
+                    size_class.name, requests / seconds, percentile(all, 0.50), percentile(all, 0.99),
+                    rss_mb, heap.resident / 1048576.0, heap.fragmentation(), peak / 1048576.0, peak / megapixels);
+    }
+    
+    if (perf) {
+        std::printf("\n%-8s %-10s %8s %14s %14s\n", "class", "stage", "ipc", "llc_miss/mp", "branch_miss/mp");
+        for (size_t c = 0; c < class_counters.size(); ++c) {
+            const auto& totals = class_counters[c];
+            double megapixels = std::max(totals.megapixels(), 1e-9);
+            for (size_t i = 0; i < resizer::stage_count; ++i) {
+                const auto& counts = totals.stages[i];
+                if (counts.cycles == 0) continue;
+                std::printf("%-8s %-10s %8.2f %14.0f %14.0f\n", size_classes[c].name,
+                            resizer::stage_name(static_cast<resizer::Stage>(i)),
+                            static_cast<double>(counts.instructions) / counts.cycles,
+                            counts.llc_misses / megapixels, counts.branch_misses / megapixels);
+            }
+        }
+    }
+    
+    return 0;
+}
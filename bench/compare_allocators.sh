@@ -0,0 +1,18 @@
+#!/usr/bin/env bash
+# Build the benchmark once per allocator and run them back to back.
+# Usage: bench/compare_allocators.sh [threads] [requests_per_size_class]
+set -euo pipefail
+
+root="$(cd "$(dirname "$0")/.." && pwd)"
+
+for allocator in system jemalloc mimalloc; do
+    build="${root}/_bench_${allocator}"
+    if ! cmake -S "${root}" -B "${build}" -DCMAKE_BUILD_TYPE=Release \
+            -DBUILD_TESTS=OFF -DBUILD_BENCHMARKS=ON -DRESIZER_ALLOCATOR="${allocator}" > /dev/null; then
+        echo "skipping ${allocator}: not available" >&2
+        continue
+    fi
+    cmake --build "${build}" --target bench_resizer -j"$(nproc)" > /dev/null
+    "${build}/bench_resizer" "$@"
+    echo
+done
@@ -0,0 +1,170 @@
+// libFuzzer harness for the decode, resize and encode core, hunting for
+// inputs that are slow or memory-hungry rather than only ones that crash:
+// many progressive scans, huge declared dimensions, odd subsampling.
+//
+// Each run's wall time and peak heap are fed back to the fuzzer as extra
+// coverage, one counter per power-of-two bucket, so an input that reaches a
+// new cost bucket is kept and mutated further, climbing towards the worst
+// case. Inputs over budget are written to RESIZER_FUZZ_SAVE_DIR (default
+// fuzz/regressions) to be checked in:
+//
+//   slow-<hash>.jpg  took longer than RESIZER_FUZZ_TIME_BUDGET_MS (default
+//                    1000), whether it was rendered or rejected in the end
+//   heap-<hash>.jpg  peaked above the memory budget's estimate for it, so
+//                    the server would under-reserve for such a request
+//
+// Build with -DBUILD_FUZZERS=ON and clang, then
+//
+//   fuzz_resize -max_len=262144 -timeout=30 corpus/
+//   RESIZER_FUZZ_ENFORCE=1 fuzz_resize -runs=0 fuzz/regressions
+//
+// The second form, also run by ctest, aborts on any saved input that is
+// still over budget. Other compilers get a driver (RESIZER_FUZZ_STANDALONE)
+// that only replays the files and directories it is given.
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "heap_tracker.hpp"
+#include "resizer.hpp"
+
+namespace {
+
+// Extra coverage counters, cleared by libFuzzer before every run: [0, 32)
+// log2 of microseconds, [32, 64) log2 of peak heap KiB
+#if defined(__linux__)
+__attribute__((used, section("__libfuzzer_extra_counters")))
+#endif
+uint8_t cost_counters[64];
+
+struct Budgets {
+    std::chrono::milliseconds time{1000};
+    std::string save_dir = "fuzz/regressions";
+    bool enforce = false;
+};
+
+Budgets& budgets() {
+    static Budgets instance;
+    return instance;
+}
+
+size_t log2_bucket(uint64_t value) {
+    size_t bucket = 0;
+    while (value > 1 && bucket < 31) {
+        value >>= 1;
+        ++bucket;
+    }
+    return bucket;
+}
+
+uint64_t fnv1a(const uint8_t* data, size_t size) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < size; ++i) hash = (hash ^ data[i]) * 1099511628211ULL;
+    return hash;
+}
+
+void over_budget(const char* kind, const uint8_t* data, size_t size, const std::string& detail) {
+    if (budgets().enforce) {
+        std::fprintf(stderr, "%s input over budget: %s\n", kind, detail.c_str());
+        std::abort();
+    }
+    char name[64];
+    std::snprintf(name, sizeof(name), "%s-%016llx.jpg", kind, static_cast<unsigned long long>(fnv1a(data, size)));
+    std::error_code error;
+    std::filesystem::create_directories(budgets().save_dir, error);
+    auto path = std::filesystem::path(budgets().save_dir) / name;
+    if (std::filesystem::exists(path, error)) return;
+    std::ofstream(path, std::ios::binary).write(reinterpret_cast<const char*>(data), static_cast<std::streamsize>(size));
+    std::fprintf(stderr, "saved %s (%s)\n", path.c_str(), detail.c_str());
+}
+
+}
+
+extern "C" int LLVMFuzzerInitialize(int*, char***) {
+    if (const char* value = std::getenv("RESIZER_FUZZ_TIME_BUDGET_MS")) {
+        budgets().time = std::chrono::milliseconds(std::atoll(value));
+    }
+    if (const char* value = std::getenv("RESIZER_FUZZ_SAVE_DIR")) budgets().save_dir = value;
+    const char* enforce = std::getenv("RESIZER_FUZZ_ENFORCE");
+    budgets().enforce = enforce && *enforce && *enforce != '0';
+
+    // Frames from the huge-page pool are mmap'd and invisible to the heap
+    // tracker; with the pool off every frame is a heap allocation
+    resizer::PixelBufferPool::Options pool;
+    pool.mode = resizer::HugePageMode::off;
+    resizer::pixel_pool().configure(pool);
+    return 0;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    if (size == 0) return 0;
+    // Vary the target with the input, so scaled decodes are explored too
+    static const int target_widths[] = {64, 256, 1024};
+    int width = target_widths[size % 3];
+    resizer::TargetSize target{width, width * 3 / 4};
+
+    resizer::JpegHeader header;
+    bool probed = resizer::probe_jpeg(data, size, header);
+    // What the binary endpoint would reserve for this body
+    uint64_t estimate = resizer::estimate_binary_peak_bytes(size, probed ? &header : nullptr, {target});
+
+    bool rejected = false;
+    int64_t peak = 0;
+    auto start = std::chrono::steady_clock::now();
+    {
+        resizer::HeapPeakScope heap;
+        try {
+            resizer::resize_jpeg_to_sink(data, size, target, resizer::EncodeOptions{}, [](const uint8_t*, size_t) {});
+        } catch (const std::exception&) {
+            // Rejected by a limit or undecodable: the outcome a hostile input should get
+            rejected = true;
+        }
+        peak = heap.peak_bytes();
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+
+    auto micros = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+    cost_counters[log2_bucket(static_cast<uint64_t>(micros))]++;
+    cost_counters[32 + log2_bucket(static_cast<uint64_t>(peak) / 1024)]++;
+
+    if (elapsed > budgets().time) {
+        over_budget("slow", data, size,
+                    std::to_string(micros / 1000) + " ms" + (rejected ? ", then rejected" : ""));
+    }
+    if (peak > 0 && static_cast<uint64_t>(peak) > estimate) {
+        over_budget("heap", data, size, std::to_string(peak) + " bytes peak, " + std::to_string(estimate) + " estimated");
+    }
+    return 0;
+}
+
+#ifdef RESIZER_FUZZ_STANDALONE
+int main(int argc, char** argv) {
+    LLVMFuzzerInitialize(&argc, &argv);
+    std::vector<std::filesystem::path> inputs;
+    for (int i = 1; i < argc; ++i) {
+        if (argv[i][0] == '-') continue;
+        if (std::filesystem::is_directory(argv[i])) {
+            for (const auto& entry : std::filesystem::directory_iterator(argv[i])) {
+                if (entry.is_regular_file()) inputs.push_back(entry.path());
+            }
+        } else {
+            inputs.emplace_back(argv[i]);
+        }
+    }
+    for (const auto& path : inputs) {
+        std::ifstream in(path, std::ios::binary);
+        std::vector<uint8_t> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        LLVMFuzzerTestOneInput(data.data(), data.size());
+    }
+    std::printf("replayed %zu inputs\n", inputs.size());
+    return 0;
+}
+#endif
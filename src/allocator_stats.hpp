@@ -0,0 +1,112 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#if defined(RESIZER_USE_JEMALLOC)
+#include <jemalloc/jemalloc.h>
+#elif defined(RESIZER_USE_MIMALLOC)
+#include <mimalloc.h>
+#else
+#include <malloc.h>
+#endif
+
+namespace resizer {
+
+// Heap usage as reported by whichever allocator the binary was linked with
+struct AllocatorStats {
+    struct Arena {
+        unsigned index = 0;
+        size_t active = 0;
+        size_t dirty = 0;
+    };
+
+    std::string name;
+    size_t allocated = 0;  // bytes handed out to the application
+    size_t active = 0;     // bytes in pages holding live allocations
+    size_t resident = 0;   // bytes of physical memory held by the allocator
+    std::vector<Arena> arenas;
+
+    // Share of resident heap memory not backing live allocations
+    double fragmentation() const {
+        return resident == 0 || allocated >= resident ? 0.0 : 1.0 - double(allocated) / double(resident);
+    }
+};
+
+#if defined(RESIZER_USE_JEMALLOC)
+
+namespace detail {
+
+template <typename T>
+T jemalloc_stat(const std::string& name) {
+    T value{};
+    size_t size = sizeof(value);
+    mallctl(name.c_str(), &value, &size, nullptr, 0);
+    return value;
+}
+
+}
+
+inline AllocatorStats allocator_stats() {
+    // Stats are cached by jemalloc until the epoch is advanced
+    uint64_t epoch = 1;
+    size_t epoch_size = sizeof(epoch);
+    mallctl("epoch", &epoch, &epoch_size, &epoch, epoch_size);
+
+    AllocatorStats stats;
+    stats.name = "jemalloc";
+    stats.allocated = detail::jemalloc_stat<size_t>("stats.allocated");
+    stats.active = detail::jemalloc_stat<size_t>("stats.active");
+    stats.resident = detail::jemalloc_stat<size_t>("stats.resident");
+
+    size_t page = detail::jemalloc_stat<size_t>("arenas.page");
+    unsigned narenas = detail::jemalloc_stat<unsigned>("arenas.narenas");
+    for (unsigned i = 0; i < narenas; ++i) {
+        std::string prefix = "stats.arenas." + std::to_string(i) + ".";
+        AllocatorStats::Arena arena;
+        arena.index = i;
+        arena.active = detail::jemalloc_stat<size_t>(prefix + "pactive") * page;
+        arena.dirty = detail::jemalloc_stat<size_t>(prefix + "pdirty") * page;
+        // Arenas no thread was ever assigned to stay empty; skip the noise
+        if (arena.active > 0 || arena.dirty > 0) stats.arenas.push_back(arena);
+    }
+    return stats;
+}
+
+#elif defined(RESIZER_USE_MIMALLOC)
+
+inline AllocatorStats allocator_stats() {
+    size_t elapsed = 0, user = 0, system = 0, rss = 0, peak_rss = 0;
+    size_t commit = 0, peak_commit = 0, faults = 0;
+    mi_process_info(&elapsed, &user, &system, &rss, &peak_rss, &commit, &peak_commit, &faults);
+
+    // mimalloc exposes no per-heap byte counters through its public API;
+    // committed memory is the closest proxy for live allocations
+    AllocatorStats stats;
+    stats.name = "mimalloc";
+    stats.allocated = commit;
+    stats.active = commit;
+    stats.resident = rss;
+    return stats;
+}
+
+#else
+
+inline AllocatorStats allocator_stats() {
+    AllocatorStats stats;
+    stats.name = "glibc";
+#if __GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33)
+    struct mallinfo2 info = mallinfo2();
+#else
+    struct mallinfo info = mallinfo();
+#endif
+    stats.allocated = size_t(info.uordblks) + size_t(info.hblkhd);
+    stats.active = stats.allocated;
+    stats.resident = size_t(info.arena) + size_t(info.hblkhd);
+    return stats;
+}
+
+#endif
+
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <opencv2/core.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace resizer {
+
+namespace detail {
+
+inline void append_base83(std::string& out, int value, int digits) {
+    static const char alphabet[] =
+        "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz#$%*+,-.:;=?@[]^_{|}~";
+    int divisor = 1;
+    for (int i = 1; i < digits; ++i) divisor *= 83;
+    for (int i = 0; i < digits; ++i, divisor /= 83) out.push_back(alphabet[(value / divisor) % 83]);
+}
+
+inline float srgb_to_linear(int value) {
+    float v = value / 255.0f;
+    return v <= 0.04045f ? v / 12.92f : std::pow((v + 0.055f) / 1.055f, 2.4f);
+}
+
+inline int linear_to_srgb(float value) {
+    float v = std::clamp(value, 0.0f, 1.0f);
+    return v <= 0.0031308f ? static_cast<int>(v * 12.92f * 255 + 0.5f)
+                           : static_cast<int>((1.055f * std::pow(v, 1 / 2.4f) - 0.055f) * 255 + 0.5f);
+}
+
+inline float sign_pow(float value, float exponent) {
+    return std::copysign(std::pow(std::fabs(value), exponent), value);
+}
+
+}
+
+// BlurHash (https://blurha.sh) of an 8-bit BGR image. Meant for the tiny
+// frames of the placeholder path: cost is O(pixels * components).
+inline std::string blurhash_encode(const cv::Mat& bgr, int components_x = 4, int components_y = 3) {
+    if (components_x < 1 || components_x > 9 || components_y < 1 || components_y > 9) {
+        throw std::invalid_argument("BlurHash components must be between 1 and 9");
+    }
+    if (bgr.empty() || bgr.type() != CV_8UC3) {
+        throw std::invalid_argument("BlurHash needs a non-empty 8-bit BGR image");
+    }
+
+    const int width = bgr.cols;
+    const int height = bgr.rows;
+    std::vector<float> linear(size_t(width) * height * 3);
+    for (int y = 0; y < height; ++y) {
+        const uint8_t* row = bgr.ptr(y);
+        for (int x = 0; x < width * 3; ++x) linear[size_t(y) * width * 3 + x] = detail::srgb_to_linear(row[x]);
+    }
+
+    // factors[k] = {r, g, b} for basis function (i, j)
+    std::vector<std::array<float, 3>> factors;
+    for (int j = 0; j < components_y; ++j) {
+        for (int i = 0; i < components_x; ++i) {
+            float normalisation = (i == 0 && j == 0) ? 1.0f : 2.0f;
+            std::array<float, 3> sum = {0, 0, 0};
+            for (int y = 0; y < height; ++y) {
+                float basis_y = std::cos(float(M_PI) * j * y / height);
+                const float* row = &linear[size_t(y) * width * 3];
+                for (int x = 0; x < width; ++x) {
+                    float basis = basis_y * std::cos(float(M_PI) * i * x / width);
+                    sum[0] += basis * row[x * 3 + 2];
+                    sum[1] += basis * row[x * 3 + 1];
+                    sum[2] += basis * row[x * 3 + 0];
+                }
+            }
+            float scale = normalisation / (float(width) * height);
+            factors.push_back({sum[0] * scale, sum[1] * scale, sum[2] * scale});
+        }
+    }
+
+    std::string hash;
+    detail::append_base83(hash, (components_x - 1) + (components_y - 1) * 9, 1);
+
+    float maximum = 1;
+    if (factors.size() > 1) {
+        float actual = 0;
+        for (size_t k = 1; k < factors.size(); ++k) {
+            for (float v : factors[k]) actual = std::max(actual, std::fabs(v));
+        }
+        int quantised = std::clamp(static_cast<int>(std::floor(actual * 166 - 0.5f)), 0, 82);
+        maximum = (quantised + 1) / 166.0f;
+        detail::append_base83(hash, quantised, 1);
+    } else {
+        detail::append_base83(hash, 0, 1);
+    }
+
+    const auto& dc = factors[0];
+    detail::append_base83(hash, (detail::linear_to_srgb(dc[0]) << 16) + (detail::linear_to_srgb(dc[1]) << 8) +
+                                    detail::linear_to_srgb(dc[2]), 4);
+
+    for (size_t k = 1; k < factors.size(); ++k) {
+        int q[3];
+        for (int c = 0; c < 3; ++c) {
+            q[c] = std::clamp(static_cast<int>(std::floor(detail::sign_pow(factors[k][c] / maximum, 0.5f) * 9 + 9.5f)), 0, 18);
+        }
+        detail::append_base83(hash, q[0] * 19 * 19 + q[1] * 19 + q[2], 2);
+    }
+    return hash;
+}
+
+}
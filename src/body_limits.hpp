@@ -0,0 +1,62 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#include "errors.hpp"
+
+namespace resizer {
+
+// Maximum request body size, with optional per-endpoint overrides
+struct BodyLimits {
+    uint64_t default_limit = 64 * 1024 * 1024;
+    std::map<std::string, uint64_t> endpoints;
+
+    uint64_t limit_for(const std::string& endpoint) const {
+        auto it = endpoints.find(endpoint);
+        return it == endpoints.end() ? default_limit : it->second;
+    }
+
+    // What the HTTP parser must accept so that every endpoint can be reached
+    uint64_t largest() const {
+        uint64_t largest = default_limit;
+        for (const auto& entry : endpoints) largest = std::max(largest, entry.second);
+        return largest;
+    }
+
+    // Parse "/resize_image=32M,/image_info=1M" on top of the default limit;
+    // parse_size turns each value into bytes
+    template <typename ParseSize>
+    void parse_overrides(const std::string& list, ParseSize parse_size) {
+        std::stringstream stream(list);
+        std::string entry;
+        while (std::getline(stream, entry, ',')) {
+            size_t eq = entry.find('=');
+            if (eq == std::string::npos || eq == 0) {
+                throw std::invalid_argument("body limit override must look like /path=SIZE, got '" + entry + "'");
+            }
+            endpoints[entry.substr(0, eq)] = parse_size(entry.substr(eq + 1));
+        }
+    }
+};
+
+// Reject on the declared Content-Length first, then on what actually
+// arrived (chunked bodies carry no length up front)
+inline void enforce_body_limit(std::string_view content_length, size_t received, uint64_t limit) {
+    uint64_t declared = 0;
+    for (char c : content_length) {
+        if (c < '0' || c > '9') break;
+        declared = declared * 10 + static_cast<uint64_t>(c - '0');
+        if (declared > limit) break;
+    }
+    if (declared > limit || received > limit) {
+        throw http_error(413, "Request body exceeds the limit of " + std::to_string(limit) + " bytes");
+    }
+}
+
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include "result_cache.hpp"
+
+namespace resizer {
+
+// Result cache contents saved on shutdown and loaded on start-up, so a
+// restarted process serves its predecessor's hot set instead of rendering
+// it all again. Layout: "RSZSNAP1", then per entry the key, content type and
+// value lengths (u32, little endian as written), the frequency byte and the
+// three strings.
+namespace detail {
+
+constexpr char snapshot_magic[8] = {'R', 'S', 'Z', 'S', 'N', 'A', 'P', '1'};
+// Sanity bound on a single record, well above any thumbnail
+constexpr uint32_t snapshot_max_field = 64u << 20;
+
+}
+
+// Write atomically through a temporary file and rename, so a crash while
+// saving leaves the previous snapshot in place
+inline void write_cache_snapshot(const std::string& path, const std::vector<CacheEntry>& entries) {
+    std::string temp = path + ".tmp";
+    {
+        std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+        out.write(detail::snapshot_magic, sizeof(detail::snapshot_magic));
+        for (const auto& entry : entries) {
+            uint32_t lengths[3] = {static_cast<uint32_t>(entry.key.size()),
+                                   static_cast<uint32_t>(entry.value->content_type.size()),
+                                   static_cast<uint32_t>(entry.value->bytes.size())};
+            out.write(reinterpret_cast<const char*>(lengths), sizeof(lengths));
+            out.put(static_cast<char>(entry.frequency));
+            out.write(entry.key.data(), static_cast<std::streamsize>(entry.key.size()));
+            out.write(entry.value->content_type.data(), static_cast<std::streamsize>(entry.value->content_type.size()));
+            out.write(entry.value->bytes.data(), static_cast<std::streamsize>(entry.value->bytes.size()));
+        }
+        out.flush();
+        if (!out) {
+            std::remove(temp.c_str());
+            throw std::runtime_error("Cannot write cache snapshot " + path);
+        }
+    }
+    if (std::rename(temp.c_str(), path.c_str()) != 0) {
+        std::remove(temp.c_str());
+        throw std::system_error(errno, std::generic_category(), "Cannot save cache snapshot " + path);
+    }
+}
+
+// Entries of a snapshot, hottest first. A missing file is an empty snapshot;
+// a truncated one yields the entries before the damage.
+inline std::vector<CacheEntry> read_cache_snapshot(const std::string& path) {
+    std::vector<CacheEntry> entries;
+    std::ifstream in(path, std::ios::binary);
+    if (!in) return entries;
+
+    char magic[sizeof(detail::snapshot_magic)] = {};
+    in.read(magic, sizeof(magic));
+    if (!in || std::memcmp(magic, detail::snapshot_magic, sizeof(magic)) != 0) {
+        throw std::runtime_error("Cache snapshot " + path + " has an unknown format");
+    }
+
+    for (;;) {
+        uint32_t lengths[3];
+        if (!in.read(reinterpret_cast<char*>(lengths), sizeof(lengths))) break;
+        if (lengths[0] > detail::snapshot_max_field || lengths[1] > detail::snapshot_max_field ||
+            lengths[2] > detail::snapshot_max_field) {
+            break;
+        }
+        int frequency = in.get();
+        if (frequency == EOF) break;
+
+        CacheEntry entry;
+        auto value = std::make_shared<CachedResult>();
+        entry.key.resize(lengths[0]);
+        value->content_type.resize(lengths[1]);
+        value->bytes.resize(lengths[2]);
+        in.read(entry.key.data(), lengths[0]);
+        in.read(value->content_type.data(), lengths[1]);
+        in.read(value->bytes.data(), lengths[2]);
+        if (!in) break;
+
+        entry.frequency = static_cast<uint8_t>(frequency);
+        entry.value = std::move(value);
+        entries.push_back(std::move(entry));
+    }
+    return entries;
+}
+
+}
@@ -0,0 +1,271 @@
+#pragma once
+
+#include <sched.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace resizer {
+
+// CPU and memory limits of the cgroup this process runs in. Thread counts
+// and memory defaults derived from the host instead oversubscribe a
+// container: CFS throttles the whole cgroup for the rest of each period
+// once its quota is used, which shows up as tail latency.
+struct CgroupLimits {
+    // 1 or 2; 0 when no cgroup hierarchy was found
+    int version = 0;
+    // CPU quota in CPUs (quota / period); 0 when unlimited
+    double cpus = 0;
+    // Memory limit in bytes; 0 when unlimited
+    uint64_t memory_bytes = 0;
+    // Directory holding the CPU controller's cpu.stat
+    std::string cpu_dir;
+};
+
+// CFS bandwidth statistics from cpu.stat, cumulative since the cgroup was created
+struct CpuThrottling {
+    uint64_t periods = 0;
+    uint64_t throttled_periods = 0;
+    double throttled_seconds = 0;
+};
+
+namespace detail {
+
+struct CgroupMount {
+    std::string root;
+    std::string mount_point;
+    bool unified = false;
+    std::vector<std::string> controllers;
+};
+
+inline std::vector<std::string> split(const std::string& text, char separator) {
+    std::vector<std::string> parts;
+    std::stringstream stream(text);
+    std::string part;
+    while (std::getline(stream, part, separator)) parts.push_back(part);
+    return parts;
+}
+
+inline bool read_first_line(const std::string& path, std::string& line) {
+    std::ifstream in(path);
+    return static_cast<bool>(std::getline(in, line));
+}
+
+// A whole line as a number, ignoring surrounding whitespace. False on an
+// empty or malformed value, which callers treat as no limit.
+inline bool parse_number(const std::string& text, double& value) {
+    const char* begin = text.c_str();
+    char* end = nullptr;
+    value = std::strtod(begin, &end);
+    if (end == begin) return false;
+    while (*end == ' ' || *end == '\t' || *end == '\n' || *end == '\r') ++end;
+    return *end == '\0' && std::isfinite(value);
+}
+
+inline bool is_directory(const std::string& path) {
+    struct stat info;
+    return ::stat(path.c_str(), &info) == 0 && S_ISDIR(info.st_mode);
+}
+
+// cgroup and cgroup2 mounts from /proc/self/mountinfo: "id parent dev root
+// mount-point options [optional...] - fstype source super-options"
+inline std::vector<CgroupMount> cgroup_mounts(const std::string& mountinfo) {
+    std::vector<CgroupMount> mounts;
+    std::ifstream in(mountinfo);
+    std::string line;
+    while (std::getline(in, line)) {
+        auto fields = split(line, ' ');
+        auto separator = std::find(fields.begin(), fields.end(), "-");
+        if (fields.size() < 5 || std::distance(separator, fields.end()) < 3) continue;
+
+        CgroupMount mount;
+        mount.root = fields[3];
+        mount.mount_point = fields[4];
+        const std::string& type = *(separator + 1);
+        if (type == "cgroup2") {
+            mount.unified = true;
+        } else if (type == "cgroup" && std::distance(separator, fields.end()) >= 4) {
+            mount.controllers = split(*(separator + 3), ',');
+        } else {
+            continue;
+        }
+        mounts.push_back(std::move(mount));
+    }
+    return mounts;
+}
+
+// Directory of the cgroup at path (as listed in /proc/self/cgroup) under a
+// mount. Inside a container with its own cgroup namespace the mount point is
+// already the container's cgroup, so the mount point is used when the
+// path does not exist beneath it.
+inline std::string cgroup_directory(const CgroupMount& mount, const std::string& path, const std::string& sysroot) {
+    std::string relative = path;
+    if (mount.root != "/") {
+        relative = path.rfind(mount.root, 0) == 0 ? path.substr(mount.root.size()) : "";
+    }
+    std::string base = sysroot + (mount.mount_point == "/" ? "" : mount.mount_point);
+    std::string dir = base + (relative == "/" ? "" : relative);
+    return is_directory(dir) ? dir : base;
+}
+
+// Smallest limit found in dir and each parent up to the mount point, since
+// an ancestor's limit caps every cgroup below it; 0 when none is set
+template <typename Read>
+double lowest_limit(std::string dir, const std::string& mount, Read read) {
+    double lowest = 0;
+    for (;;) {
+        double limit = read(dir);
+        if (limit > 0 && (lowest == 0 || limit < lowest)) lowest = limit;
+        if (dir.size() <= mount.size()) break;
+        size_t slash = dir.find_last_of('/');
+        if (slash == std::string::npos || slash < mount.size()) break;
+        dir.erase(slash);
+    }
+    return lowest;
+}
+
+// Limits at or above this are the kernel's "no limit" sentinels
+constexpr double unlimited_bytes = static_cast<double>(1ULL << 60);
+
+inline double read_v2_cpus(const std::string& dir) {
+    std::string line;
+    if (!read_first_line(dir + "/cpu.max", line)) return 0;
+    std::istringstream in(line);
+    std::string quota;
+    double period = 0;
+    if (!(in >> quota >> period) || quota == "max" || period <= 0) return 0;
+    double limit = 0;
+    return parse_number(quota, limit) && limit > 0 ? limit / period : 0;
+}
+
+inline double read_v2_memory(const std::string& dir) {
+    std::string line;
+    double limit = 0;
+    if (!read_first_line(dir + "/memory.max", line) || !parse_number(line, limit)) return 0;
+    return limit >= unlimited_bytes ? 0 : limit;
+}
+
+inline double read_v1_cpus(const std::string& dir) {
+    std::string quota, period;
+    if (!read_first_line(dir + "/cpu.cfs_quota_us", quota) || !read_first_line(dir + "/cpu.cfs_period_us", period)) {
+        return 0;
+    }
+    double q = 0, p = 0;
+    if (!parse_number(quota, q) || !parse_number(period, p)) return 0;
+    return q > 0 && p > 0 ? q / p : 0;
+}
+
+inline double read_v1_memory(const std::string& dir) {
+    std::string line;
+    double limit = 0;
+    if (!read_first_line(dir + "/memory.limit_in_bytes", line) || !parse_number(line, limit)) return 0;
+    return limit >= unlimited_bytes ? 0 : limit;
+}
+
+}
+
+// Read the limits of this process's cgroup. Controllers mounted through the
+// v1 hierarchy take precedence over the unified one, which is how hybrid
+// hosts split them. proc and sysroot are parameters for tests.
+inline CgroupLimits detect_cgroup_limits(const std::string& proc = "/proc/self", const std::string& sysroot = "") {
+    CgroupLimits limits;
+    auto mounts = detail::cgroup_mounts(proc + "/mountinfo");
+
+    std::string unified_path;
+    std::vector<std::pair<std::vector<std::string>, std::string>> v1_paths;
+    std::ifstream in(proc + "/cgroup");
+    std::string line;
+    while (std::getline(in, line)) {
+        size_t first = line.find(':');
+        size_t second = line.find(':', first + 1);
+        if (first == std::string::npos || second == std::string::npos) continue;
+        std::string controllers = line.substr(first + 1, second - first - 1);
+        std::string path = line.substr(second + 1);
+        if (controllers.empty()) {
+            unified_path = path;
+        } else {
+            v1_paths.emplace_back(detail::split(controllers, ','), path);
+        }
+    }
+
+    auto v1_mount = [&](const std::string& controller, std::string& dir) {
+        for (const auto& [controllers, path] : v1_paths) {
+            if (std::find(controllers.begin(), controllers.end(), controller) == controllers.end()) continue;
+            for (const auto& mount : mounts) {
+                if (mount.unified ||
+                    std::find(mount.controllers.begin(), mount.controllers.end(), controller) == mount.controllers.end()) {
+                    continue;
+                }
+                dir = detail::cgroup_directory(mount, path, sysroot);
+                return &mount;
+            }
+        }
+        return static_cast<const detail::CgroupMount*>(nullptr);
+    };
+    auto mount_dir = [&](const detail::CgroupMount& mount) {
+        return sysroot + (mount.mount_point == "/" ? "" : mount.mount_point);
+    };
+
+    std::string dir;
+    if (const auto* mount = v1_mount("cpu", dir)) {
+        limits.version = 1;
+        limits.cpu_dir = dir;
+        limits.cpus = detail::lowest_limit(dir, mount_dir(*mount), detail::read_v1_cpus);
+    }
+    if (const auto* mount = v1_mount("memory", dir)) {
+        limits.version = 1;
+        limits.memory_bytes = static_cast<uint64_t>(detail::lowest_limit(dir, mount_dir(*mount), detail::read_v1_memory));
+    }
+
+    auto unified = std::find_if(mounts.begin(), mounts.end(), [](const detail::CgroupMount& m) { return m.unified; });
+    if (limits.version == 0 && unified != mounts.end()) {
+        limits.version = 2;
+        dir = detail::cgroup_directory(*unified, unified_path.empty() ? "/" : unified_path, sysroot);
+        limits.cpu_dir = dir;
+        limits.cpus = detail::lowest_limit(dir, mount_dir(*unified), detail::read_v2_cpus);
+        limits.memory_bytes = static_cast<uint64_t>(detail::lowest_limit(dir, mount_dir(*unified), detail::read_v2_memory));
+    }
+    return limits;
+}
+
+// CPUs this process may be scheduled on (its affinity mask)
+inline size_t available_cpus() {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (::sched_getaffinity(0, sizeof(set), &set) == 0) return static_cast<size_t>(CPU_COUNT(&set));
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// CPUs worth running threads on: the available ones, capped by the quota
+// rounded down, so steady full load stays under the quota instead of being
+// throttled at the end of each period
+inline size_t container_cpus(const CgroupLimits& limits, size_t available) {
+    if (limits.cpus <= 0) return available;
+    size_t quota = std::max<size_t>(1, static_cast<size_t>(std::floor(limits.cpus)));
+    return std::min(available, quota);
+}
+
+inline CpuThrottling cpu_throttling(const CgroupLimits& limits) {
+    CpuThrottling stats;
+    if (limits.cpu_dir.empty()) return stats;
+    std::ifstream in(limits.cpu_dir + "/cpu.stat");
+    std::string key;
+    uint64_t value = 0;
+    while (in >> key >> value) {
+        if (key == "nr_periods") stats.periods = value;
+        else if (key == "nr_throttled") stats.throttled_periods = value;
+        else if (key == "throttled_usec") stats.throttled_seconds = value / 1e6;
+        else if (key == "throttled_time") stats.throttled_seconds = value / 1e9;
+    }
+    return stats;
+}
+
+}
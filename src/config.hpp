@@ -0,0 +1,234 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <stdexcept>
+
+#include "body_limits.hpp"
+#include "cgroup.hpp"
+#include "jpeg_decoder.hpp"
+#include "pixel_pool.hpp"
+#include "pregen.hpp"
+#include "shm_cache.hpp"
+#include "tenants.hpp"
+
+namespace resizer {
+
+// Read an environment variable, falling back to a default when unset or empty
+inline std::string env_string(const char* name, const std::string& fallback = "") {
+    const char* value = std::getenv(name);
+    if (value == nullptr || *value == '\0') return fallback;
+    return value;
+}
+
+inline long long env_int(const char* name, long long fallback) {
+    std::string value = env_string(name);
+    if (value.empty()) return fallback;
+
+    try {
+        size_t consumed = 0;
+        long long parsed = std::stoll(value, &consumed);
+        if (consumed != value.size()) throw std::invalid_argument(value);
+        return parsed;
+    } catch (const std::exception&) {
+        throw std::invalid_argument(std::string(name) + " must be an integer, got '" + value + "'");
+    }
+}
+
+inline bool env_bool(const char* name, bool fallback) {
+    std::string value = env_string(name);
+    if (value.empty()) return fallback;
+    if (value == "1" || value == "true" || value == "on" || value == "yes") return true;
+    if (value == "0" || value == "false" || value == "off" || value == "no") return false;
+    throw std::invalid_argument(std::string(name) + " must be a boolean, got '" + value + "'");
+}
+
+// Byte sizes accept an optional K/M/G suffix (powers of 1024), e.g. "512M"
+inline uint64_t parse_bytes(const std::string& value) {
+    if (value.empty()) throw std::invalid_argument("empty byte size");
+
+    uint64_t multiplier = 1;
+    switch (value.back()) {
+        case 'k': case 'K': multiplier = 1ULL << 10; break;
+        case 'm': case 'M': multiplier = 1ULL << 20; break;
+        case 'g': case 'G': multiplier = 1ULL << 30; break;
+        default: break;
+    }
+    std::string digits = multiplier == 1 ? value : value.substr(0, value.size() - 1);
+
+    size_t consumed = 0;
+    unsigned long long parsed = std::stoull(digits, &consumed);
+    if (consumed != digits.size()) throw std::invalid_argument("invalid byte size '" + value + "'");
+    return parsed * multiplier;
+}
+
+inline uint64_t env_bytes(const char* name, uint64_t fallback) {
+    std::string value = env_string(name);
+    if (value.empty()) return fallback;
+
+    try {
+        return parse_bytes(value);
+    } catch (const std::exception&) {
+        throw std::invalid_argument(std::string(name) + " must be a byte size, got '" + value + "'");
+    }
+}
+
+// Runtime settings, read once at startup from RESIZER_* environment variables
+struct ServerConfig {
+    std::string address = "0.0.0.0";
+    uint16_t port = 8080;
+
+    // Threads running the decode/resize/encode pipeline; 0 means one per usable CPU
+    size_t worker_threads = 0;
+    // Tenant identity, worker shares, concurrency caps and rate limits
+    TenantOptions tenants;
+
+    // Threads OpenCV may use within one call; 0 means usable CPUs per worker
+    size_t opencv_threads = 0;
+    // Limits of the cgroup the server runs in; "usable CPUs" is capped by its
+    // CPU quota, and memory defaults below are derived from its memory limit
+    CgroupLimits container;
+
+    // Count cycles, instructions, LLC misses and branch misses around each
+    // pipeline stage (see perf_counters.hpp)
+    bool perf_counters = false;
+
+    // NUMA node the whole process is confined to; -1 leaves placement to the kernel
+    int numa_node = -1;
+
+    // Huge-page backed pool for large decoded and resized frames
+    PixelBufferPool::Options pixel_pool;
+    // Buffers mapped and touched at start-up, before the first request
+    size_t prefault_buffers = 0;
+    size_t prefault_buffer_bytes = 64 * 1024 * 1024;
+
+    // Memory all in-flight requests may reserve together; 0 means unlimited
+    uint64_t memory_budget_bytes = 0;
+    // How long a request waits for budget before it is rejected with 503
+    std::chrono::milliseconds memory_wait{2000};
+
+    // Declared pixels, progressive scans and decode time allowed per image
+    DecodeLimits decode_limits;
+
+    // Request body size limits, default and per endpoint
+    BodyLimits body_limits;
+
+    // Items accepted in one /resize_batch request
+    size_t batch_max_items = 256;
+
+    // Directory of the content-addressed source store; empty disables
+    // POST /sources and GET /img
+    std::string source_dir;
+    // HMAC key GET /img URLs must be signed with; empty accepts unsigned URLs
+    std::string url_signing_key;
+
+    // Encoded GET /img results kept in memory; 0 disables the result cache
+    uint64_t result_cache_bytes = 256ULL << 20;
+    // File the result cache is saved to on shutdown and preloaded from on
+    // start-up; empty disables. At most cache_snapshot_bytes are saved (0: all).
+    std::string cache_snapshot;
+    uint64_t cache_snapshot_bytes = 0;
+
+    // On SIGTERM: time for load balancers to see /ready fail, then the
+    // longest wait for in-flight requests before stopping anyway, and how
+    // long no request may have finished before stopping, so the responses
+    // written after their handlers return are sent
+    std::chrono::milliseconds drain_delay{0};
+    std::chrono::milliseconds drain_timeout{30000};
+    std::chrono::milliseconds drain_grace{500};
+
+    // Unix socket a replacement process connects to for a binary upgrade
+    // (see socket_handover.hpp); empty disables. handover_timeout bounds each
+    // step of the exchange.
+    std::string handover_socket;
+    std::chrono::milliseconds handover_timeout{30000};
+
+    // Result cache in shared memory, used by every process on the host
+    // instead of the per-process one when a name is set
+    SharedResultCache::Options shm_cache;
+
+    // Thumbnails rendered in the background when a source is uploaded or
+    // first requested, so later requests hit the result cache
+    PregenPlanner::Options pregen;
+    // Workers that may run pre-generation at once, and jobs allowed to queue
+    size_t pregen_workers = 1;
+    size_t pregen_max_pending = 256;
+
+    static ServerConfig from_env() {
+        ServerConfig config;
+        config.address = env_string("RESIZER_ADDRESS", config.address);
+        config.port = static_cast<uint16_t>(env_int("RESIZER_PORT", config.port));
+        config.worker_threads = static_cast<size_t>(env_int("RESIZER_WORKER_THREADS", 0));
+        config.opencv_threads = static_cast<size_t>(env_int("RESIZER_OPENCV_THREADS", 0));
+        try {
+            config.tenants.header = env_string("RESIZER_TENANT_HEADER", config.tenants.header);
+            config.tenants.defaults = parse_tenant_policy(env_string("RESIZER_TENANT_DEFAULT"));
+            config.tenants.policies = parse_tenant_policies(env_string("RESIZER_TENANTS"), config.tenants.defaults);
+            config.tenants.api_keys = parse_tenant_api_keys(env_string("RESIZER_TENANT_API_KEYS"));
+        } catch (const std::exception& e) {
+            throw std::invalid_argument(std::string("Tenant settings: ") + e.what());
+        }
+        config.tenants.max_tenants = static_cast<size_t>(env_int("RESIZER_TENANT_MAX", config.tenants.max_tenants));
+        config.perf_counters = env_bool("RESIZER_PERF_COUNTERS", false);
+        config.numa_node = static_cast<int>(env_int("RESIZER_NUMA_NODE", -1));
+        config.pixel_pool.mode = parse_huge_page_mode(env_string("RESIZER_HUGE_PAGES", "thp"));
+        config.pixel_pool.min_buffer_bytes = env_bytes("RESIZER_POOL_MIN_BUFFER", config.pixel_pool.min_buffer_bytes);
+        config.pixel_pool.max_cached_bytes = env_bytes("RESIZER_POOL_MAX_CACHED", config.pixel_pool.max_cached_bytes);
+        config.prefault_buffers = static_cast<size_t>(env_int("RESIZER_POOL_PREFAULT_BUFFERS", 0));
+        config.prefault_buffer_bytes = env_bytes("RESIZER_POOL_PREFAULT_SIZE", config.prefault_buffer_bytes);
+        config.memory_budget_bytes = env_bytes("RESIZER_MEMORY_BUDGET", 0);
+        config.memory_wait = std::chrono::milliseconds(env_int("RESIZER_MEMORY_WAIT_MS", config.memory_wait.count()));
+        config.decode_limits.max_pixels = static_cast<uint64_t>(
+            env_int("RESIZER_MAX_PIXELS", static_cast<long long>(config.decode_limits.max_pixels)));
+        config.decode_limits.max_scans = static_cast<int>(env_int("RESIZER_MAX_SCANS", config.decode_limits.max_scans));
+        config.decode_limits.time_budget = std::chrono::milliseconds(
+            env_int("RESIZER_DECODE_TIME_BUDGET_MS", config.decode_limits.time_budget.count()));
+        config.body_limits.default_limit = env_bytes("RESIZER_MAX_BODY", config.body_limits.default_limit);
+        try {
+            config.body_limits.parse_overrides(env_string("RESIZER_ENDPOINT_MAX_BODY"), parse_bytes);
+        } catch (const std::exception& e) {
+            throw std::invalid_argument(std::string("RESIZER_ENDPOINT_MAX_BODY: ") + e.what());
+        }
+        config.batch_max_items = static_cast<size_t>(env_int("RESIZER_BATCH_MAX_ITEMS", 256));
+        config.source_dir = env_string("RESIZER_SOURCE_DIR");
+        config.url_signing_key = env_string("RESIZER_URL_SIGNING_KEY");
+        config.result_cache_bytes = env_bytes("RESIZER_RESULT_CACHE_BYTES", config.result_cache_bytes);
+        config.cache_snapshot = env_string("RESIZER_CACHE_SNAPSHOT");
+        config.cache_snapshot_bytes = env_bytes("RESIZER_CACHE_SNAPSHOT_BYTES", 0);
+        config.drain_delay = std::chrono::milliseconds(env_int("RESIZER_DRAIN_DELAY_MS", config.drain_delay.count()));
+        config.drain_timeout = std::chrono::milliseconds(env_int("RESIZER_DRAIN_TIMEOUT_MS", config.drain_timeout.count()));
+        config.drain_grace = std::chrono::milliseconds(env_int("RESIZER_DRAIN_GRACE_MS", config.drain_grace.count()));
+        config.handover_socket = env_string("RESIZER_HANDOVER_SOCKET");
+        config.handover_timeout =
+            std::chrono::milliseconds(env_int("RESIZER_HANDOVER_TIMEOUT_MS", config.handover_timeout.count()));
+        config.shm_cache.name = env_string("RESIZER_SHM_CACHE_NAME");
+        config.shm_cache.size_bytes = env_bytes("RESIZER_SHM_CACHE_BYTES", config.shm_cache.size_bytes);
+        config.shm_cache.stripes = static_cast<size_t>(env_int("RESIZER_SHM_CACHE_STRIPES", 16));
+        try {
+            config.pregen.configured = parse_thumbnail_specs(env_string("RESIZER_PREGEN_SIZES"));
+        } catch (const std::exception& e) {
+            throw std::invalid_argument(std::string("RESIZER_PREGEN_SIZES: ") + e.what());
+        }
+        config.pregen.learned_top_k = static_cast<size_t>(env_int("RESIZER_PREGEN_LEARNED", 0));
+        config.pregen_workers = static_cast<size_t>(env_int("RESIZER_PREGEN_WORKERS", 1));
+        config.pregen_max_pending = static_cast<size_t>(env_int("RESIZER_PREGEN_MAX_PENDING", 256));
+
+        // Under a memory limit, size what was not set explicitly from the
+        // limit rather than leaving it unbounded or host-sized
+        config.container = detect_cgroup_limits();
+        if (config.container.memory_bytes > 0) {
+            if (env_string("RESIZER_MEMORY_BUDGET").empty()) {
+                config.memory_budget_bytes = config.container.memory_bytes / 2;
+            }
+            if (env_string("RESIZER_RESULT_CACHE_BYTES").empty()) {
+                config.result_cache_bytes = std::min(config.result_cache_bytes, config.container.memory_bytes / 8);
+            }
+        }
+        return config;
+    }
+};
+
+}
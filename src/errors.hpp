@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdexcept>
+#include <string>
+
+namespace resizer {
+
+// Failure that maps to a specific HTTP status. Plain std::invalid_argument
+// stays the generic 400 and any other exception a 500.
+class http_error : public std::runtime_error {
+public:
+    http_error(int status, const std::string& message)
+        : std::runtime_error(message), status_(status) {}
+
+    int status() const { return status_; }
+
+private:
+    int status_;
+};
+
+}
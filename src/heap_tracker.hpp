@@ -0,0 +1,299 @@
+#pragma once
+
+#include <dlfcn.h>
+#include <malloc.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+// Live and peak heap bytes of the whole process, for the benchmark and the
+// fuzzer to see how much memory one operation holds at its worst, which
+// allocator statistics (sampled, and per arena) cannot tell. malloc and
+// friends are replaced here, so include this from exactly one translation
+// unit of a binary, and never from the server. Counting is off until
+// enabled: every counted allocation updates one shared cache line, which
+// would serialise multi-threaded allocation (and hide what thread-caching
+// allocators are for), so enable it only while measuring, one operation at
+// a time. Off, each call pays a relaxed load of a flag nobody writes. Under a
+// sanitizer, which owns malloc, its allocation hooks are used instead.
+// Frames taken from the pixel pool are mmap'd and not seen; turn the pool off
+// where they should count.
+#if defined(__SANITIZE_ADDRESS__)
+#define RESIZER_HEAP_TRACKER_HOOKS 1
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer) || __has_feature(memory_sanitizer) || __has_feature(thread_sanitizer)
+#define RESIZER_HEAP_TRACKER_HOOKS 1
+#endif
+#endif
+
+#ifdef RESIZER_HEAP_TRACKER_HOOKS
+// From <sanitizer/allocator_interface.h>, which not every toolchain installs
+extern "C" {
+int __sanitizer_install_malloc_and_free_hooks(void (*malloc_hook)(const volatile void*, size_t),
+                                              void (*free_hook)(const volatile void*));
+size_t __sanitizer_get_allocated_size(const volatile void* ptr);
+}
+#endif
+
+namespace resizer {
+
+struct HeapUsage {
+    int64_t live_bytes = 0;
+    int64_t peak_bytes = 0;
+    uint64_t allocations = 0;
+};
+
+namespace detail {
+
+struct HeapCounters {
+    std::atomic<int64_t> live{0};
+    std::atomic<int64_t> peak{0};
+    std::atomic<uint64_t> allocations{0};
+};
+
+// Constant-initialised, so usable by allocations made before main
+inline HeapCounters& heap_counters() {
+    static HeapCounters counters;
+    return counters;
+}
+
+inline std::atomic<bool>& heap_tracking_flag() {
+    static std::atomic<bool> enabled{false};
+    return enabled;
+}
+
+inline bool heap_tracking() { return heap_tracking_flag().load(std::memory_order_relaxed); }
+
+inline void heap_allocated(size_t bytes) {
+    auto& counters = heap_counters();
+    int64_t live = counters.live.fetch_add(static_cast<int64_t>(bytes), std::memory_order_relaxed) +
+                   static_cast<int64_t>(bytes);
+    counters.allocations.fetch_add(1, std::memory_order_relaxed);
+    int64_t peak = counters.peak.load(std::memory_order_relaxed);
+    while (live > peak && !counters.peak.compare_exchange_weak(peak, live, std::memory_order_relaxed)) {
+    }
+}
+
+inline void heap_freed(size_t bytes) {
+    heap_counters().live.fetch_sub(static_cast<int64_t>(bytes), std::memory_order_relaxed);
+}
+
+}
+
+inline HeapUsage heap_usage() {
+    auto& counters = detail::heap_counters();
+    HeapUsage usage;
+    usage.live_bytes = counters.live.load(std::memory_order_relaxed);
+    usage.peak_bytes = counters.peak.load(std::memory_order_relaxed);
+    usage.allocations = counters.allocations.load(std::memory_order_relaxed);
+    return usage;
+}
+
+// Blocks allocated while counting is off and freed while it is on are
+// subtracted, and the reverse never is, so live bytes are only meaningful as
+// differences within one counted period
+inline void enable_heap_tracking() { detail::heap_tracking_flag().store(true, std::memory_order_relaxed); }
+inline void disable_heap_tracking() { detail::heap_tracking_flag().store(false, std::memory_order_relaxed); }
+
+// Start peak tracking over from the bytes live now
+inline void reset_heap_peak() {
+    auto& counters = detail::heap_counters();
+    counters.peak.store(counters.live.load(std::memory_order_relaxed), std::memory_order_relaxed);
+}
+
+// Highest heap use above the level at construction, counting enabled for
+// the scope's lifetime. The peak is process wide, so only meaningful while
+// one operation runs at a time, and scopes must not nest.
+class HeapPeakScope {
+public:
+    HeapPeakScope() {
+        enable_heap_tracking();
+        reset_heap_peak();
+        start_ = heap_usage();
+    }
+    ~HeapPeakScope() { disable_heap_tracking(); }
+    HeapPeakScope(const HeapPeakScope&) = delete;
+    HeapPeakScope& operator=(const HeapPeakScope&) = delete;
+
+    int64_t peak_bytes() const { return heap_usage().peak_bytes - start_.live_bytes; }
+    uint64_t allocations() const { return heap_usage().allocations - start_.allocations; }
+
+private:
+    HeapUsage start_;
+};
+
+#ifdef RESIZER_HEAP_TRACKER_HOOKS
+
+namespace detail {
+
+inline void heap_malloc_hook(const volatile void* ptr, size_t size) {
+    if (ptr && heap_tracking()) heap_allocated(size);
+}
+
+inline void heap_free_hook(const volatile void* ptr) {
+    if (ptr && heap_tracking()) heap_freed(__sanitizer_get_allocated_size(ptr));
+}
+
+inline const bool heap_hooks_installed = __sanitizer_install_malloc_and_free_hooks(heap_malloc_hook, heap_free_hook);
+
+}
+
+#else
+
+namespace detail {
+
+// The allocator behind this one: the C library's, or jemalloc's or
+// mimalloc's when linked in, found with dlsym(RTLD_NEXT)
+struct NextHeap {
+    void* (*malloc)(size_t) = nullptr;
+    void (*free)(void*) = nullptr;
+    void* (*calloc)(size_t, size_t) = nullptr;
+    void* (*realloc)(void*, size_t) = nullptr;
+    void* (*memalign)(size_t, size_t) = nullptr;
+    int (*posix_memalign)(void**, size_t, size_t) = nullptr;
+    void* (*aligned_alloc)(size_t, size_t) = nullptr;
+    size_t (*usable_size)(void*) = nullptr;
+};
+
+inline NextHeap& next_heap() {
+    static NextHeap heap;
+    return heap;
+}
+
+// dlsym allocates (calloc, for its error state) before the allocator it is
+// looking up is known; those few requests are served from here and never freed
+struct BootstrapHeap {
+    alignas(16) char buffer[16384];
+    size_t used;
+};
+
+inline BootstrapHeap& bootstrap_heap() {
+    static BootstrapHeap heap;
+    return heap;
+}
+
+inline void* bootstrap_alloc(size_t size) {
+    auto& heap = bootstrap_heap();
+    size = (size + 15) & ~size_t(15);
+    if (size > sizeof(heap.buffer) - heap.used) return nullptr;
+    void* ptr = heap.buffer + heap.used;
+    heap.used += size;
+    return ptr;
+}
+
+inline bool is_bootstrap(const void* ptr) {
+    auto& heap = bootstrap_heap();
+    return ptr >= heap.buffer && ptr < heap.buffer + sizeof(heap.buffer);
+}
+
+// False while the lookup itself is allocating. The first allocation happens
+// while the process is still single-threaded, so no locking is needed.
+inline bool resolve_next_heap() {
+    NextHeap& heap = next_heap();
+    if (heap.malloc) return true;
+    static bool resolving = false;
+    if (resolving) return false;
+    resolving = true;
+    NextHeap found;
+    found.free = reinterpret_cast<void (*)(void*)>(::dlsym(RTLD_NEXT, "free"));
+    found.calloc = reinterpret_cast<void* (*)(size_t, size_t)>(::dlsym(RTLD_NEXT, "calloc"));
+    found.realloc = reinterpret_cast<void* (*)(void*, size_t)>(::dlsym(RTLD_NEXT, "realloc"));
+    found.memalign = reinterpret_cast<void* (*)(size_t, size_t)>(::dlsym(RTLD_NEXT, "memalign"));
+    found.posix_memalign = reinterpret_cast<int (*)(void**, size_t, size_t)>(::dlsym(RTLD_NEXT, "posix_memalign"));
+    found.aligned_alloc = reinterpret_cast<void* (*)(size_t, size_t)>(::dlsym(RTLD_NEXT, "aligned_alloc"));
+    found.usable_size = reinterpret_cast<size_t (*)(void*)>(::dlsym(RTLD_NEXT, "malloc_usable_size"));
+    found.malloc = reinterpret_cast<void* (*)(size_t)>(::dlsym(RTLD_NEXT, "malloc"));
+    heap = found;
+    resolving = false;
+    return heap.malloc != nullptr;
+}
+
+// Usable rather than requested sizes, since only those are known at free
+inline void* track_allocation(void* ptr) {
+    if (ptr && heap_tracking()) heap_allocated(next_heap().usable_size(ptr));
+    return ptr;
+}
+
+}
+
+#endif
+
+}
+
+#ifndef RESIZER_HEAP_TRACKER_HOOKS
+
+// Declared __THROW (noexcept in C++) by glibc, and must match
+extern "C" {
+
+void* malloc(size_t size) __THROW {
+    using namespace resizer::detail;
+    if (!resolve_next_heap()) return bootstrap_alloc(size);
+    return track_allocation(next_heap().malloc(size));
+}
+
+void free(void* ptr) __THROW {
+    using namespace resizer::detail;
+    if (!ptr || is_bootstrap(ptr)) return;
+    if (heap_tracking()) heap_freed(next_heap().usable_size(ptr));
+    next_heap().free(ptr);
+}
+
+void* calloc(size_t count, size_t size) __THROW {
+    using namespace resizer::detail;
+    if (size != 0 && count > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    if (!resolve_next_heap()) return bootstrap_alloc(count * size);
+    return track_allocation(next_heap().calloc(count, size));
+}
+
+void* realloc(void* ptr, size_t size) __THROW {
+    using namespace resizer::detail;
+    if (!resolve_next_heap()) return bootstrap_alloc(size);
+    if (is_bootstrap(ptr)) {
+        // Its size is unknown; copy what the bootstrap buffer can hold
+        void* moved = malloc(size);
+        size_t available = static_cast<size_t>(bootstrap_heap().buffer + sizeof(bootstrap_heap().buffer) -
+                                               static_cast<char*>(ptr));
+        if (moved) std::memcpy(moved, ptr, size < available ? size : available);
+        return moved;
+    }
+    bool tracking = heap_tracking();
+    size_t old_size = ptr && tracking ? next_heap().usable_size(ptr) : 0;
+    void* moved = next_heap().realloc(ptr, size);
+    // A failed realloc leaves the old block allocated, unless it was a free
+    if (tracking && (moved || size == 0)) heap_freed(old_size);
+    return track_allocation(moved);
+}
+
+void* memalign(size_t alignment, size_t size) __THROW {
+    using namespace resizer::detail;
+    if (!resolve_next_heap()) return nullptr;
+    return track_allocation(next_heap().memalign(alignment, size));
+}
+
+int posix_memalign(void** out, size_t alignment, size_t size) __THROW {
+    using namespace resizer::detail;
+    if (!resolve_next_heap()) return ENOMEM;
+    int error = next_heap().posix_memalign(out, alignment, size);
+    if (error == 0) track_allocation(*out);
+    return error;
+}
+
+void* aligned_alloc(size_t alignment, size_t size) __THROW {
+    using namespace resizer::detail;
+    if (!resolve_next_heap()) return nullptr;
+    return track_allocation(next_heap().aligned_alloc(alignment, size));
+}
+
+void* valloc(size_t size) __THROW { return memalign(static_cast<size_t>(::sysconf(_SC_PAGESIZE)), size); }
+
+}
+
+#endif
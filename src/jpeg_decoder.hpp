@@ -0,0 +1,246 @@
+#pragma once
+
+#include <opencv2/core.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <csetjmp>
+#include <cstdio>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <jpeglib.h>
+
+#include "errors.hpp"
+#include "jpeg_probe.hpp"
+
+namespace resizer {
+
+// Cost limits applied to every JPEG before and while it is decoded. A small
+// file can declare a huge frame, and a progressive file can carry thousands
+// of scans that each re-walk the whole coefficient buffer.
+struct DecodeLimits {
+    uint64_t max_pixels = 100000000;
+    int max_scans = 100;
+    std::chrono::milliseconds time_budget{5000};
+};
+
+inline DecodeLimits& decode_limits() {
+    static DecodeLimits limits;
+    return limits;
+}
+
+// Reject frames whose declared size alone exceeds the limits; 413
+inline void enforce_declared_size(int width, int height, const DecodeLimits& limits) {
+    if (uint64_t(width) * uint64_t(height) > limits.max_pixels) {
+        throw http_error(413, "Image declares " + std::to_string(width) + "x" + std::to_string(height) +
+                              " pixels, more than the limit of " + std::to_string(limits.max_pixels));
+    }
+}
+
+namespace detail {
+
+// libjpeg reports fatal errors through error_exit, which must not return.
+// We longjmp back into decode_jpeg and turn the failure into an exception
+// there, after jpeg_destroy_decompress has run.
+struct GuardedErrorManager {
+    jpeg_error_mgr pub;
+    jmp_buf jump;
+    int status = 0;  // HTTP status for limit violations, 0 for corrupt data
+    char message[JMSG_LENGTH_MAX] = {};
+};
+
+struct GuardedProgressManager {
+    jpeg_progress_mgr pub;
+    const DecodeLimits* limits = nullptr;
+    std::chrono::steady_clock::time_point deadline;
+};
+
+inline void guarded_error_exit(j_common_ptr cinfo) {
+    auto* errors = reinterpret_cast<GuardedErrorManager*>(cinfo->err);
+    (*cinfo->err->format_message)(cinfo, errors->message);
+    longjmp(errors->jump, 1);
+}
+
+// Takes a printf-style format because std::string temporaries would be
+// skipped, not destroyed, by the longjmp
+inline void abort_decode(j_common_ptr cinfo, int status, const char* format, long long limit) {
+    auto* errors = reinterpret_cast<GuardedErrorManager*>(cinfo->err);
+    errors->status = status;
+    std::snprintf(errors->message, sizeof(errors->message), format, limit);
+    longjmp(errors->jump, 1);
+}
+
+// Abort once the scan count or the time budget is exceeded
+inline void enforce_decode_limits(j_decompress_ptr cinfo, const GuardedProgressManager& progress) {
+    auto* common = reinterpret_cast<j_common_ptr>(cinfo);
+    if (cinfo->input_scan_number > progress.limits->max_scans) {
+        abort_decode(common, 422, "Image has more than %lld scans", static_cast<long long>(progress.limits->max_scans));
+    }
+    if (std::chrono::steady_clock::now() > progress.deadline) {
+        abort_decode(common, 422, "Image exceeded the decode time budget of %lld ms",
+                     static_cast<long long>(progress.limits->time_budget.count()));
+    }
+}
+
+// libjpeg calls this once per iMCU row, including while jpeg_start_decompress
+// absorbs every scan of a progressive file, so runaway inputs stop promptly.
+// In buffered-image mode scans are absorbed by jpeg_consume_input instead,
+// which never calls it; that loop checks the limits itself.
+inline void guarded_progress(j_common_ptr cinfo) {
+    enforce_decode_limits(reinterpret_cast<j_decompress_ptr>(cinfo),
+                          *reinterpret_cast<GuardedProgressManager*>(cinfo->progress));
+}
+
+// Adobe CMYK/YCCK JPEGs store inverted ink values
+inline void inverted_cmyk_to_bgr(const uint8_t* cmyk, uint8_t* bgr, int width) {
+    for (int x = 0; x < width; ++x, cmyk += 4, bgr += 3) {
+        int k = cmyk[3];
+        bgr[0] = static_cast<uint8_t>(cmyk[2] * k / 255);
+        bgr[1] = static_cast<uint8_t>(cmyk[1] * k / 255);
+        bgr[2] = static_cast<uint8_t>(cmyk[0] * k / 255);
+    }
+}
+
+// Progressive files send the DC coefficients of every component first. Once
+// that scan is complete a 1/8-scale frame is fully determined, so the AC
+// scans never need to be entropy-decoded at all.
+inline bool dc_scan_complete(const jpeg_decompress_struct& cinfo) {
+    for (int c = 0; c < cinfo.num_components; ++c) {
+        if (cinfo.coef_bits[c][0] < 0) return false;
+    }
+    return true;
+}
+
+// Everything between setjmp and the last libjpeg call lives in this function,
+// which holds no objects with destructors so that longjmp cannot skip one.
+inline bool run_guarded_decode(jpeg_decompress_struct& cinfo, GuardedErrorManager& errors,
+                               GuardedProgressManager& progress, const uint8_t* data, size_t size,
+                               int scale_denom, cv::Mat& dst, std::vector<uint8_t>& row_buffer) {
+    if (setjmp(errors.jump)) return false;
+
+    jpeg_create_decompress(&cinfo);
+    cinfo.progress = &progress.pub;
+    jpeg_mem_src(&cinfo, data, static_cast<unsigned long>(size));
+    jpeg_read_header(&cinfo, TRUE);
+
+    if (uint64_t(cinfo.image_width) * cinfo.image_height > progress.limits->max_pixels) {
+        abort_decode(reinterpret_cast<j_common_ptr>(&cinfo), 413, "Image declares more than %lld pixels",
+                     static_cast<long long>(progress.limits->max_pixels));
+    }
+
+    bool cmyk = cinfo.jpeg_color_space == JCS_CMYK || cinfo.jpeg_color_space == JCS_YCCK;
+    cinfo.out_color_space = cmyk ? JCS_CMYK : JCS_EXT_BGR;
+
+    // At 1/8 scale libjpeg reduces each block's IDCT to its DC term
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = static_cast<unsigned>(scale_denom);
+    bool dc_only = scale_denom == 8 && cinfo.progressive_mode;
+    if (dc_only) {
+        cinfo.buffered_image = TRUE;
+        cinfo.do_block_smoothing = FALSE;
+    }
+    jpeg_start_decompress(&cinfo);
+
+    if (dc_only) {
+        // A hostile file can put thousands of AC scans ahead of the last DC one
+        for (;;) {
+            enforce_decode_limits(&cinfo, progress);
+            int status = jpeg_consume_input(&cinfo);
+            if (status == JPEG_REACHED_EOI || status == JPEG_SUSPENDED) break;
+            if (status == JPEG_SCAN_COMPLETED && dc_scan_complete(cinfo)) break;
+        }
+        jpeg_start_output(&cinfo, cinfo.input_scan_number);
+    }
+
+    int width = static_cast<int>(cinfo.output_width);
+    int height = static_cast<int>(cinfo.output_height);
+    if (dst.rows != height || dst.cols != width || dst.type() != CV_8UC3) dst.create(height, width, CV_8UC3);
+    if (cmyk) row_buffer.resize(size_t(width) * 4);
+
+    while (cinfo.output_scanline < cinfo.output_height) {
+        uint8_t* row = dst.ptr(static_cast<int>(cinfo.output_scanline));
+        JSAMPROW target = cmyk ? row_buffer.data() : row;
+        jpeg_read_scanlines(&cinfo, &target, 1);
+        if (cmyk) inverted_cmyk_to_bgr(row_buffer.data(), row, width);
+    }
+
+    if (dc_only) {
+        // The remaining AC scans are deliberately left unread
+        jpeg_finish_output(&cinfo);
+        jpeg_abort_decompress(&cinfo);
+    } else {
+        jpeg_finish_decompress(&cinfo);
+    }
+    return true;
+}
+
+}
+
+// Largest DCT scale-down (1/8, 1/4, 1/2) that still yields at least the
+// target size. Targets refer to the upright image, the decoder works before
+// EXIF rotation.
+inline int choose_scale_denom(const JpegHeader& header, int target_width, int target_height) {
+    if (header.orientation >= 5) std::swap(target_width, target_height);
+    for (int denom : {8, 4, 2}) {
+        if ((header.width + denom - 1) / denom >= target_width &&
+            (header.height + denom - 1) / denom >= target_height) {
+            return denom;
+        }
+    }
+    return 1;
+}
+
+// Decode a JPEG to 8-bit BGR under the given cost limits, scaled down by
+// 1/scale_denom (1, 2, 4 or 8) inside the IDCT. A preallocated dst with
+// matching size and type is filled in place (pooled memory stays in use).
+// Limit violations throw http_error (413 for declared size, 422 for scans or
+// time); corrupt data throws std::runtime_error.
+inline void decode_jpeg(const uint8_t* data, size_t size, const DecodeLimits& limits, cv::Mat& dst,
+                        int scale_denom = 1) {
+    jpeg_decompress_struct cinfo;
+    detail::GuardedErrorManager errors;
+    detail::GuardedProgressManager progress;
+    std::vector<uint8_t> row_buffer;
+
+    cinfo.err = jpeg_std_error(&errors.pub);
+    errors.pub.error_exit = detail::guarded_error_exit;
+    // Recoverable warnings (e.g. truncated data) decode anyway; keep stderr quiet
+    errors.pub.output_message = [](j_common_ptr) {};
+    progress.pub.progress_monitor = detail::guarded_progress;
+    progress.limits = &limits;
+    progress.deadline = std::chrono::steady_clock::now() + limits.time_budget;
+
+    bool ok = false;
+    try {
+        ok = detail::run_guarded_decode(cinfo, errors, progress, data, size, scale_denom, dst, row_buffer);
+    } catch (...) {
+        // cv::Mat::create failing to allocate
+        jpeg_destroy_decompress(&cinfo);
+        throw;
+    }
+    jpeg_destroy_decompress(&cinfo);
+
+    if (!ok) {
+        if (errors.status != 0) throw http_error(errors.status, errors.message);
+        throw std::runtime_error(std::string("Failed to decode JPEG image - ") + errors.message);
+    }
+}
+
+// Rotate/flip a decoded frame upright, matching what cv::imdecode does
+inline void apply_exif_orientation(cv::Mat& image, int orientation) {
+    switch (orientation) {
+        case 2: cv::flip(image, image, 1); break;
+        case 3: cv::flip(image, image, -1); break;
+        case 4: cv::flip(image, image, 0); break;
+        case 5: cv::transpose(image, image); break;
+        case 6: cv::transpose(image, image); cv::flip(image, image, 1); break;
+        case 7: cv::transpose(image, image); cv::flip(image, image, -1); break;
+        case 8: cv::transpose(image, image); cv::flip(image, image, 0); break;
+        default: break;
+    }
+}
+
+}
@@ -0,0 +1,195 @@
+#pragma once
+
+#include <opencv2/core.hpp>
+
+#include <algorithm>
+#include <csetjmp>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <jpeglib.h>
+
+namespace resizer {
+
+// Receives encoded bytes as the encoder produces them
+using ByteSink = std::function<void(const uint8_t* data, size_t size)>;
+
+struct EncodeOptions {
+    int quality = 85;
+    // Progressive files are only complete once every scan is written, so
+    // libjpeg emits nothing until the whole frame has been compressed
+    bool progressive = false;
+    // Optimised Huffman tables need a pass over the whole frame first and
+    // also delay all output to the end; off keeps output flowing per stripe
+    bool optimize = false;
+    // Encoded bytes buffered before each hand-off to the sink
+    size_t flush_bytes = 16 * 1024;
+    // Rows passed to libjpeg per call, one MCU row at 4:2:0
+    int stripe_rows = 16;
+};
+
+namespace detail {
+
+struct SinkDestination {
+    jpeg_destination_mgr pub;
+    const ByteSink* sink = nullptr;
+    std::vector<uint8_t> buffer;
+    // Set when the sink threw; rethrown once libjpeg has been unwound
+    std::exception_ptr error;
+};
+
+struct EncodeErrorManager {
+    jpeg_error_mgr pub;
+    jmp_buf jump;
+    char message[JMSG_LENGTH_MAX] = {};
+};
+
+inline void encode_error_exit(j_common_ptr cinfo) {
+    auto* errors = reinterpret_cast<EncodeErrorManager*>(cinfo->err);
+    (*cinfo->err->format_message)(cinfo, errors->message);
+    longjmp(errors->jump, 1);
+}
+
+inline void sink_init_destination(j_compress_ptr cinfo) {
+    auto* dest = reinterpret_cast<SinkDestination*>(cinfo->dest);
+    dest->pub.next_output_byte = dest->buffer.data();
+    dest->pub.free_in_buffer = dest->buffer.size();
+}
+
+// Hand `size` buffered bytes to the sink. Returns false when it threw; the
+// exception must not unwind through libjpeg's C frames.
+inline bool sink_flush(SinkDestination* dest, size_t size) {
+    try {
+        (*dest->sink)(dest->buffer.data(), size);
+        return true;
+    } catch (...) {
+        dest->error = std::current_exception();
+        return false;
+    }
+}
+
+inline boolean sink_empty_output_buffer(j_compress_ptr cinfo) {
+    auto* dest = reinterpret_cast<SinkDestination*>(cinfo->dest);
+    // libjpeg calls this with the buffer full, ignoring free_in_buffer
+    if (!sink_flush(dest, dest->buffer.size())) {
+        longjmp(reinterpret_cast<EncodeErrorManager*>(cinfo->err)->jump, 1);
+    }
+    dest->pub.next_output_byte = dest->buffer.data();
+    dest->pub.free_in_buffer = dest->buffer.size();
+    return TRUE;
+}
+
+inline void sink_term_destination(j_compress_ptr cinfo) {
+    auto* dest = reinterpret_cast<SinkDestination*>(cinfo->dest);
+    size_t used = dest->buffer.size() - dest->pub.free_in_buffer;
+    if (used > 0 && !sink_flush(dest, used)) {
+        longjmp(reinterpret_cast<EncodeErrorManager*>(cinfo->err)->jump, 1);
+    }
+}
+
+// Everything between setjmp and the last libjpeg call lives here; like the
+// decoder, no objects with destructors so a longjmp cannot skip one
+inline bool run_guarded_encode(jpeg_compress_struct& cinfo, EncodeErrorManager& errors, SinkDestination& dest,
+                               const cv::Mat& image, const EncodeOptions& options) {
+    if (setjmp(errors.jump)) return false;
+
+    jpeg_create_compress(&cinfo);
+    cinfo.dest = &dest.pub;
+    cinfo.image_width = static_cast<JDIMENSION>(image.cols);
+    cinfo.image_height = static_cast<JDIMENSION>(image.rows);
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_EXT_BGR;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, options.quality, TRUE);
+    cinfo.optimize_coding = options.optimize ? TRUE : FALSE;
+    if (options.progressive) jpeg_simple_progression(&cinfo);
+
+    jpeg_start_compress(&cinfo, TRUE);
+    JSAMPROW rows[64];
+    int stripe = std::max(1, std::min(options.stripe_rows, 64));
+    while (cinfo.next_scanline < cinfo.image_height) {
+        int count = std::min<int>(stripe, static_cast<int>(cinfo.image_height - cinfo.next_scanline));
+        for (int i = 0; i < count; ++i) {
+            rows[i] = const_cast<JSAMPROW>(image.ptr(static_cast<int>(cinfo.next_scanline) + i));
+        }
+        jpeg_write_scanlines(&cinfo, rows, static_cast<JDIMENSION>(count));
+    }
+    jpeg_finish_compress(&cinfo);
+    return true;
+}
+
+}
+
+// Encode an 8-bit BGR frame to JPEG, passing output to the sink in chunks of
+// about options.flush_bytes as each stripe of MCU rows is compressed.
+// Exceptions thrown by the sink propagate once the encoder is torn down.
+inline void encode_jpeg(const cv::Mat& image, const EncodeOptions& options, const ByteSink& sink) {
+    if (image.empty() || image.type() != CV_8UC3) {
+        throw std::invalid_argument("JPEG encoding needs a non-empty 8-bit BGR image");
+    }
+
+    jpeg_compress_struct cinfo;
+    detail::EncodeErrorManager errors;
+    detail::SinkDestination dest;
+    dest.sink = &sink;
+    dest.buffer.resize(std::max<size_t>(options.flush_bytes, 1024));
+    dest.pub.init_destination = detail::sink_init_destination;
+    dest.pub.empty_output_buffer = detail::sink_empty_output_buffer;
+    dest.pub.term_destination = detail::sink_term_destination;
+
+    cinfo.err = jpeg_std_error(&errors.pub);
+    errors.pub.error_exit = detail::encode_error_exit;
+
+    bool ok = detail::run_guarded_encode(cinfo, errors, dest, image, options);
+    jpeg_destroy_compress(&cinfo);
+
+    if (dest.error) std::rethrow_exception(dest.error);
+    if (!ok) throw std::runtime_error(std::string("Failed to encode JPEG image - ") + errors.message);
+}
+
+// Base64 encoder fed in arbitrary pieces; output matches base64_encode of
+// the concatenated input
+class Base64Writer {
+public:
+    explicit Base64Writer(std::string& out) : out_(out) {}
+
+    void write(const uint8_t* data, size_t size) {
+        size_t i = 0;
+        while (pending_size_ > 0 && pending_size_ < 3 && i < size) pending_[pending_size_++] = data[i++];
+        if (pending_size_ == 3) {
+            emit(pending_[0], pending_[1], pending_[2]);
+            pending_size_ = 0;
+        }
+        for (; i + 3 <= size; i += 3) emit(data[i], data[i + 1], data[i + 2]);
+        while (i < size) pending_[pending_size_++] = data[i++];
+    }
+
+    // Flush the last partial group with '=' padding
+    void finish() {
+        if (pending_size_ == 0) return;
+        uint8_t b1 = pending_size_ > 1 ? pending_[1] : 0;
+        emit(pending_[0], b1, 0);
+        out_[out_.size() - 1] = '=';
+        if (pending_size_ == 1) out_[out_.size() - 2] = '=';
+        pending_size_ = 0;
+    }
+
+private:
+    void emit(uint8_t b0, uint8_t b1, uint8_t b2) {
+        static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        out_.push_back(alphabet[b0 >> 2]);
+        out_.push_back(alphabet[((b0 & 0x03) << 4) | (b1 >> 4)]);
+        out_.push_back(alphabet[((b1 & 0x0F) << 2) | (b2 >> 6)]);
+        out_.push_back(alphabet[b2 & 0x3F]);
+    }
+
+    std::string& out_;
+    uint8_t pending_[3] = {};
+    size_t pending_size_ = 0;
+};
+
+}
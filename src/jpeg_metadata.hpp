@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace resizer {
+
+// Copy a JPEG without its descriptive metadata: EXIF/XMP (APP1), APP3-APP13,
+// APP15 and comments. JFIF (APP0), ICC profiles (APP2) and the Adobe
+// transform flag (APP14) change how pixels render, so they are kept.
+// Entropy-coded data is copied untouched; nothing is decoded.
+inline std::vector<uint8_t> strip_jpeg_metadata(const uint8_t* data, size_t size) {
+    if (size < 4 || data[0] != 0xFF || data[1] != 0xD8) return std::vector<uint8_t>(data, data + size);
+
+    std::vector<uint8_t> out;
+    out.reserve(size);
+    out.push_back(0xFF);
+    out.push_back(0xD8);
+
+    size_t pos = 2;
+    while (pos + 4 <= size && data[pos] == 0xFF) {
+        uint8_t marker = data[pos + 1];
+        if (marker == 0xFF) {  // fill byte
+            ++pos;
+            continue;
+        }
+        // From the first scan on the rest of the file is copied verbatim
+        if (marker == 0xDA) break;
+
+        size_t length = (size_t(data[pos + 2]) << 8) | data[pos + 3];
+        if (length < 2 || pos + 2 + length > size) break;
+
+        bool metadata = marker == 0xFE || marker == 0xE1 ||
+                        (marker >= 0xE3 && marker <= 0xED) || marker == 0xEF;
+        if (!metadata) out.insert(out.end(), data + pos, data + pos + 2 + length);
+        pos += 2 + length;
+    }
+
+    out.insert(out.end(), data + pos, data + size);
+    return out;
+}
+
+}
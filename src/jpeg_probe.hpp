@@ -0,0 +1,193 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+namespace resizer {
+
+// Frame parameters read from the JPEG marker stream without decoding any pixels
+struct JpegHeader {
+    int width = 0;
+    int height = 0;
+    int components = 0;
+    bool progressive = false;
+    // EXIF orientation (1-8); 1 when absent
+    int orientation = 1;
+    // SOF sampling byte per component: horizontal factor in the high
+    // nibble, vertical in the low one
+    uint8_t sampling[4] = {};
+    // An APP2 ICC_PROFILE segment precedes the frame header
+    bool icc_profile = false;
+    // IJG quality (1-100) estimated from the luma quantisation table; 0 when
+    // no table precedes the frame header
+    int quality = 0;
+};
+
+namespace detail {
+
+inline uint16_t read_be16(const uint8_t* p) {
+    return static_cast<uint16_t>((p[0] << 8) | p[1]);
+}
+
+// SOF0..SOF15, excluding DHT (C4), JPG (C8) and DAC (CC) which share the range
+inline bool is_sof_marker(uint8_t marker) {
+    return marker >= 0xC0 && marker <= 0xCF &&
+           marker != 0xC4 && marker != 0xC8 && marker != 0xCC;
+}
+
+// APP1 is shared with XMP and others; only "Exif\0\0" payloads carry a TIFF header
+inline bool is_exif_payload(const uint8_t* payload, size_t size) {
+    return size >= 6 && std::memcmp(payload, "Exif\0\0", 6) == 0;
+}
+
+// Read the orientation tag from IFD0 of an APP1 Exif payload
+inline int exif_orientation(const uint8_t* payload, size_t size) {
+    if (size < 6 + 8 || !is_exif_payload(payload, size)) return 1;
+
+    const uint8_t* tiff = payload + 6;
+    size_t tiff_size = size - 6;
+    bool little_endian = tiff[0] == 'I' && tiff[1] == 'I';
+    if (!little_endian && !(tiff[0] == 'M' && tiff[1] == 'M')) return 1;
+
+    auto read16 = [&](size_t at) -> uint32_t {
+        return little_endian ? tiff[at] | (tiff[at + 1] << 8) : (tiff[at] << 8) | tiff[at + 1];
+    };
+    auto read32 = [&](size_t at) -> uint32_t {
+        return little_endian ? read16(at) | (read16(at + 2) << 16) : (read16(at) << 16) | read16(at + 2);
+    };
+
+    uint32_t ifd = read32(4);
+    if (ifd > tiff_size - 2) return 1;
+    uint32_t entries = read16(ifd);
+    for (uint32_t i = 0; i < entries; ++i) {
+        size_t entry = ifd + 2 + size_t(i) * 12;
+        if (entry + 12 > tiff_size) return 1;
+        if (read16(entry) == 0x0112) {
+            uint32_t value = read16(entry + 8);
+            return value >= 1 && value <= 8 ? static_cast<int>(value) : 1;
+        }
+    }
+    return 1;
+}
+
+// Quality the IJG encoder would have used to produce this luma table, given
+// in natural order. Each entry is the standard table scaled by a common
+// factor; entries clamped to 1 or 255 say nothing about it and are skipped.
+inline int estimate_quality(const uint16_t* table) {
+    static const uint16_t standard_luma[64] = {
+        16, 11, 10, 16, 24, 40, 51, 61,      12, 12, 14, 19, 26, 58, 60, 55,
+        14, 13, 16, 24, 40, 57, 69, 56,      14, 17, 22, 29, 51, 87, 80, 62,
+        18, 22, 37, 56, 68, 109, 103, 77,    24, 35, 55, 64, 81, 104, 113, 92,
+        49, 64, 78, 87, 103, 121, 120, 101,  72, 92, 95, 98, 112, 100, 103, 99,
+    };
+    uint32_t scaled = 0, standard = 0;
+    for (int i = 0; i < 64; ++i) {
+        if (table[i] > 1 && table[i] < 255) {
+            scaled += table[i];
+            standard += standard_luma[i];
+        }
+    }
+    if (standard == 0) return table[0] <= 1 ? 100 : 1;
+    double factor = scaled * 100.0 / standard;
+    double quality = factor <= 100 ? (200 - factor) / 2 : 5000 / factor;
+    return std::clamp(static_cast<int>(quality + 0.5), 1, 100);
+}
+
+// Record the luma table's quality from a DQT payload (one or more tables)
+inline void read_quant_tables(const uint8_t* payload, size_t size, JpegHeader& header) {
+    size_t pos = 0;
+    while (pos < size) {
+        int precision = payload[pos] >> 4;
+        int id = payload[pos] & 0x0F;
+        size_t entry_size = precision ? 2 : 1;
+        if (pos + 1 + 64 * entry_size > size) return;
+        if (id == 0) {
+            // DQT stores entries in zigzag order
+            static const uint8_t natural_order[64] = {
+                0,  1,  8,  16, 9,  2,  3,  10, 17, 24, 32, 25, 18, 11, 4,  5,
+                12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6,  7,  14, 21, 28,
+                35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+                58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63,
+            };
+            uint16_t table[64];
+            for (int i = 0; i < 64; ++i) {
+                const uint8_t* p = payload + pos + 1 + i * entry_size;
+                table[natural_order[i]] = precision ? read_be16(p) : *p;
+            }
+            header.quality = estimate_quality(table);
+        }
+        pos += 1 + 64 * entry_size;
+    }
+}
+
+}
+
+// Chroma subsampling in J:a:b notation, "gray" for single-component frames
+inline std::string subsampling_name(const JpegHeader& header) {
+    if (header.components == 1) return "gray";
+    int luma_h = header.sampling[0] >> 4, luma_v = header.sampling[0] & 0x0F;
+    int chroma_h = header.sampling[1] >> 4, chroma_v = header.sampling[1] & 0x0F;
+    if (chroma_h == 0 || chroma_v == 0) return "unknown";
+    if (luma_h % chroma_h != 0 || luma_v % chroma_v != 0) return "unknown";
+    int h = luma_h / chroma_h, v = luma_v / chroma_v;
+    if (h == 1 && v == 1) return "4:4:4";
+    if (h == 2 && v == 1) return "4:2:2";
+    if (h == 2 && v == 2) return "4:2:0";
+    if (h == 1 && v == 2) return "4:4:0";
+    if (h == 4 && v == 1) return "4:1:1";
+    return "unknown";
+}
+
+// Walk the markers up to the first SOF segment. Returns false for anything
+// that is not a well-formed JPEG header; never reads past size.
+inline bool probe_jpeg(const uint8_t* data, size_t size, JpegHeader& header) {
+    if (data == nullptr || size < 4 || data[0] != 0xFF || data[1] != 0xD8) return false;
+
+    size_t pos = 2;
+    bool exif_seen = false;
+    while (pos + 4 <= size) {
+        if (data[pos] != 0xFF) return false;
+        while (pos < size && data[pos] == 0xFF) ++pos;  // fill bytes
+        if (pos >= size) return false;
+
+        uint8_t marker = data[pos++];
+        if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) continue;  // no payload
+        if (marker == 0xD9 || marker == 0xDA) return false;  // EOI/SOS before any frame header
+
+        if (pos + 2 > size) return false;
+        uint16_t length = detail::read_be16(data + pos);
+        if (length < 2 || pos + length > size) return false;
+
+        if (detail::is_sof_marker(marker)) {
+            if (length < 8) return false;
+            const uint8_t* sof = data + pos + 2;
+            header.height = detail::read_be16(sof + 1);
+            header.width = detail::read_be16(sof + 3);
+            header.components = sof[5];
+            header.progressive = marker == 0xC2 || marker == 0xC6 || marker == 0xCA || marker == 0xCE;
+            for (int c = 0; c < header.components && c < 4 && 7 + c * 3 < length - 2; ++c) {
+                header.sampling[c] = sof[6 + c * 3 + 1];
+            }
+            return header.width > 0 && header.height > 0 && header.components > 0;
+        }
+        // The first Exif segment wins, as in libjpeg-based decoders; an XMP
+        // APP1 after it must not reset the orientation
+        if (marker == 0xE1 && !exif_seen && detail::is_exif_payload(data + pos + 2, length - 2)) {
+            exif_seen = true;
+            header.orientation = detail::exif_orientation(data + pos + 2, length - 2);
+        }
+        if (marker == 0xE2 && length >= 2 + 12 && std::memcmp(data + pos + 2, "ICC_PROFILE", 12) == 0) {
+            header.icc_profile = true;
+        }
+        if (marker == 0xDB) {
+            detail::read_quant_tables(data + pos + 2, length - 2, header);
+        }
+        pos += length;
+    }
+    return false;
+}
+
+}
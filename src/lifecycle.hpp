@@ -0,0 +1,92 @@
+#pragma once
+
+#include <pthread.h>
+#include <signal.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <system_error>
+#include <thread>
+
+namespace resizer {
+
+// Readiness and in-flight request tracking for graceful shutdown. On
+// SIGTERM the server reports not-ready so load balancers stop sending new
+// requests, waits for the ones it has to finish, then stops.
+class Lifecycle {
+public:
+    bool ready() const { return ready_.load(std::memory_order_acquire); }
+    void set_ready(bool ready) { ready_.store(ready, std::memory_order_release); }
+
+    void request_started() { in_flight_.fetch_add(1, std::memory_order_relaxed); }
+    void request_finished() {
+        last_finished_.store(std::chrono::steady_clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+        in_flight_.fetch_sub(1, std::memory_order_relaxed);
+    }
+    int64_t in_flight() const { return in_flight_.load(std::memory_order_relaxed); }
+
+    // Block the calling thread until no request is in flight and none has
+    // finished for settle; false on timeout. Requests count as finished when
+    // their handler returns, but the HTTP server writes the response after
+    // that, so settle leaves time for the last responses to go out.
+    bool wait_idle(std::chrono::milliseconds timeout,
+                   std::chrono::milliseconds settle = std::chrono::milliseconds(0)) const {
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+        for (;;) {
+            auto now = std::chrono::steady_clock::now();
+            auto last = std::chrono::steady_clock::time_point(
+                std::chrono::steady_clock::duration(last_finished_.load(std::memory_order_relaxed)));
+            if (in_flight() == 0 && now - last >= settle) return true;
+            if (now >= deadline) return false;
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+
+private:
+    std::atomic<bool> ready_{false};
+    std::atomic<int64_t> in_flight_{0};
+    std::atomic<std::chrono::steady_clock::rep> last_finished_{0};
+};
+
+inline Lifecycle& lifecycle() {
+    static Lifecycle instance;
+    return instance;
+}
+
+// Counts one request as in flight for the lifetime of the guard
+class InFlightGuard {
+public:
+    InFlightGuard() { lifecycle().request_started(); }
+    ~InFlightGuard() { lifecycle().request_finished(); }
+    InFlightGuard(const InFlightGuard&) = delete;
+    InFlightGuard& operator=(const InFlightGuard&) = delete;
+};
+
+inline sigset_t termination_signals() {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGINT);
+    return set;
+}
+
+// Block SIGTERM and SIGINT in the calling thread and every thread it starts
+// afterwards, so they are only ever received by wait_for_termination. Call
+// before any other thread exists.
+inline void block_termination_signals() {
+    sigset_t set = termination_signals();
+    int rc = ::pthread_sigmask(SIG_BLOCK, &set, nullptr);
+    if (rc != 0) throw std::system_error(rc, std::generic_category(), "pthread_sigmask");
+}
+
+// Wait for SIGTERM or SIGINT and return which one arrived
+inline int wait_for_termination() {
+    sigset_t set = termination_signals();
+    int signal = 0;
+    while (::sigwait(&set, &signal) != 0) {
+    }
+    return signal;
+}
+
+}
@@ -1,155 +1,1194 @@
 #include <libasyik/service.hpp>
 #include <libasyik/http.hpp>
-#include <boost/algorithm/string.hpp>
-#include <opencv2/opencv.hpp>
-#include <opencv2/imgcodecs.hpp>
-#include <opencv2/imgproc.hpp>
 #include <nlohmann/json.hpp>
+#include <boost/fiber/buffered_channel.hpp>
+#include <boost/fiber/fiber.hpp>
+#include <atomic>
 #include <memory>
+#include <mutex>
 #include <vector>
 #include <stdexcept>
 #include <cstring>
+#include <chrono>
+#include <iostream>
+#include <thread>
 
-// Base64 encoding/decoding utilities using Boost
-#include <boost/archive/iterators/base64_from_binary.hpp>
-#include <boost/archive/iterators/binary_from_base64.hpp>
-#include <boost/archive/iterators/transform_width.hpp>
+#include "allocator_stats.hpp"
+#include "body_limits.hpp"
+#include "cache_snapshot.hpp"
+#include "cgroup.hpp"
+#include "config.hpp"
+#include "errors.hpp"
+#include "lifecycle.hpp"
+#include "memory_budget.hpp"
+#include "metrics.hpp"
+#include "numa.hpp"
+#include "perf_counters.hpp"
+#include "pipeline.hpp"
+#include "probes.hpp"
+#include "pregen.hpp"
+#include "resizer.hpp"
+#include "result_cache.hpp"
+#include "shm_cache.hpp"
+#include "socket_handover.hpp"
+#include "source_store.hpp"
+#include "tenants.hpp"
+#include "url_api.hpp"
+#include "worker_pool.hpp"
+
+using json = nlohmann::json;
 
 namespace {
 
-// Decode base64 string to binary data
-std::vector<uint8_t> base64_decode(const std::string& encoded) {
+// Export allocator and pixel pool state on every /metrics scrape
+void register_metrics() {
+    using Type = resizer::MetricsRegistry::Type;
+    auto& registry = resizer::metrics();
+    
+    registry.describe("resizer_requests_total", Type::counter, "Requests by endpoint and status code");
+    registry.describe("resizer_request_duration_seconds", Type::summary, "Request handling time by endpoint");
+    registry.describe("resizer_heap_allocated_bytes", Type::gauge, "Bytes allocated by the application");
+    registry.describe("resizer_heap_active_bytes", Type::gauge, "Bytes in allocator pages holding live allocations");
+    registry.describe("resizer_heap_resident_bytes", Type::gauge, "Physical memory held by the allocator");
+    registry.describe("resizer_heap_fragmentation_ratio", Type::gauge, "Share of resident heap not backing live allocations");
+    registry.describe("resizer_heap_arena_active_bytes", Type::gauge, "Active bytes per allocator arena");
+    registry.describe("resizer_heap_arena_dirty_bytes", Type::gauge, "Unused dirty bytes per allocator arena");
+    registry.describe("resizer_passthrough_total", Type::counter, "Resize requests answered with the source bytes");
+    registry.describe("resizer_batch_items_total", Type::counter, "Batch items by status code");
+    registry.describe("resizer_in_flight_requests", Type::gauge, "Requests being handled");
+    registry.describe("resizer_ready", Type::gauge, "1 while accepting traffic, 0 while starting or draining");
+    registry.describe("resizer_memory_budget_bytes", Type::gauge, "Memory budget for in-flight requests (0 = unlimited)");
+    registry.describe("resizer_memory_in_use_bytes", Type::gauge, "Memory reserved by in-flight requests");
+    registry.describe("resizer_memory_peak_bytes", Type::gauge, "Highest reserved memory since start-up");
+    registry.describe("resizer_memory_reservations_total", Type::counter, "Memory reservations requested");
+    registry.describe("resizer_memory_waits_total", Type::counter, "Reservations that had to wait for memory");
+    registry.describe("resizer_memory_rejections_total", Type::counter, "Reservations rejected with 413 or 503");
+    registry.describe("resizer_memory_estimated_bytes_total", Type::counter, "Sum of estimated request peaks");
+    registry.describe("resizer_memory_actual_bytes_total", Type::counter, "Sum of measured request peaks");
+    registry.describe("resizer_pixel_pool_mapped_bytes", Type::gauge, "Memory mapped by the pixel buffer pool");
+    registry.describe("resizer_pixel_pool_cached_bytes", Type::gauge, "Idle pixel buffers kept for reuse");
+    registry.describe("resizer_pixel_pool_hits_total", Type::counter, "Pixel buffer requests served from the pool");
+    registry.describe("resizer_pixel_pool_misses_total", Type::counter, "Pixel buffer requests that mapped new memory");
+    
+    registry.add_collector([](resizer::MetricsRegistry& r) {
+        auto heap = resizer::allocator_stats();
+        std::string allocator = "allocator=\"" + heap.name + "\"";
+        r.set("resizer_heap_allocated_bytes", heap.allocated, allocator);
+        r.set("resizer_heap_active_bytes", heap.active, allocator);
+        r.set("resizer_heap_resident_bytes", heap.resident, allocator);
+        r.set("resizer_heap_fragmentation_ratio", heap.fragmentation(), allocator);
+        for (const auto& arena : heap.arenas) {
+            std::string labels = allocator + ",arena=\"" + std::to_string(arena.index) + "\"";
+            r.set("resizer_heap_arena_active_bytes", arena.active, labels);
+            r.set("resizer_heap_arena_dirty_bytes", arena.dirty, labels);
+        }
+        
+        r.set("resizer_in_flight_requests", static_cast<double>(resizer::lifecycle().in_flight()));
+        r.set("resizer_ready", resizer::lifecycle().ready() ? 1 : 0);
+        
+        auto budget = resizer::memory_budget().stats();
+        r.set("resizer_memory_budget_bytes", budget.limit);
+        r.set("resizer_memory_in_use_bytes", budget.in_use);
+        r.set("resizer_memory_peak_bytes", budget.peak);
+        r.set("resizer_memory_reservations_total", budget.reservations);
+        r.set("resizer_memory_waits_total", budget.waits);
+        r.set("resizer_memory_rejections_total", budget.rejections);
+        r.set("resizer_memory_estimated_bytes_total", budget.estimated_bytes);
+        r.set("resizer_memory_actual_bytes_total", budget.actual_bytes);
+        
+        auto pool = resizer::pixel_pool().stats();
+        r.set("resizer_pixel_pool_mapped_bytes", pool.mapped_bytes);
+        r.set("resizer_pixel_pool_cached_bytes", pool.cached_bytes);
+        r.set("resizer_pixel_pool_hits_total", pool.hits);
+        r.set("resizer_pixel_pool_misses_total", pool.misses);
+    });
+}
 
-        try {
-            using namespace boost::archive::iterators;
-            using It = transform_width<binary_from_base64<std::string::const_iterator>, 8, 6>;
-            
-            // Remove padding characters for proper decoding
-            std::string clean = encoded;
-            boost::trim(clean);
-            clean.erase(std::remove(clean.begin(), clean.end(), '\n'), clean.end());
-            clean.erase(std::remove(clean.begin(), clean.end(), '\r'), clean.end());
-            
-            if (clean.empty()) return {};
-            
-            size_t padding = 0;
-            if (!clean.empty()) {
-                if (clean[clean.size() - 1] == '=') padding++;
-                if (clean.size() > 1 && clean[clean.size() - 2] == '=') padding++;
-            }
-            
-            std::vector<uint8_t> result(It(clean.begin()), It(clean.end()));
-            result.erase(result.end() - padding, result.end());
-            
-            return result;
-        } catch (const std::exception& e) {
-            throw std::runtime_error(e.what());
+// Header lookup as std::string; empty when absent
+template <typename Request>
+std::string header_value(const Request& req, const char* name) {
+    auto value = req->headers[name];
+    return std::string(value.data(), value.size());
+}
+
+void record_request(const std::string& endpoint, int code, std::chrono::steady_clock::time_point start) {
+    auto& registry = resizer::metrics();
+    std::string labels = "endpoint=\"" + endpoint + "\"";
+    registry.increment("resizer_requests_total", labels + ",code=\"" + std::to_string(code) + "\"");
+    registry.observe("resizer_request_duration_seconds",
+                     std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(), labels);
+}
+
+void record_tenant_request(const std::string& tenant, int code, std::chrono::steady_clock::time_point start,
+                           const resizer::RequestTiming& timing) {
+    auto& registry = resizer::metrics();
+    std::string labels = "tenant=\"" + tenant + "\"";
+    registry.increment("resizer_tenant_requests_total", labels + ",code=\"" + std::to_string(code) + "\"");
+    registry.observe("resizer_tenant_request_duration_seconds",
+                     std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(), labels);
+    registry.observe("resizer_tenant_request_cpu_seconds", timing.cpu_seconds(), labels);
+    for (size_t i = 0; i < resizer::stage_count; ++i) {
+        auto stage = static_cast<resizer::Stage>(i);
+        double seconds = timing.seconds(stage);
+        if (seconds > 0) {
+            registry.observe("resizer_stage_duration_seconds", seconds,
+                             "stage=\"" + std::string(resizer::stage_name(stage)) + "\"");
         }
+    }
 }
 
-// Encode binary data to base64 string
-std::string base64_encode(const unsigned char* data, size_t len) {
-    using namespace boost::archive::iterators;
-    using It = base64_from_binary<transform_width<const unsigned char*, 6, 8>>;
-    
-    std::string result(It(data), It(data + len));
-    
-    // Add padding
-    size_t padding = (3 - len % 3) % 3;
-    result.append(padding, '=');
-    
+// Run an endpoint body and map its exceptions onto JSON error responses:
+// http_error keeps its status, invalid_argument is 400, anything else 500
+template <typename Request, typename Handler>
+void handle_request(Request& req, const std::string& endpoint, Handler&& handler) {
+    resizer::InFlightGuard in_flight;
+    auto start = std::chrono::steady_clock::now();
+    // Image work is charged to a tenant; probes and scrapes are not
+    bool metered = endpoint != "/metrics" && endpoint != "/ready";
+    std::string tenant = metered ? resizer::tenants().identify(header_value(req, resizer::tenants().options().header.c_str()),
+                                                               header_value(req, "x-api-key"))
+                                 : std::string();
+    resizer::TenantScope tenant_scope(tenant);
+    auto timing = std::make_shared<resizer::RequestTiming>();
+    resizer::RequestTimingScope timing_scope(timing);
+    RESIZER_PROBE(request_start, endpoint.c_str(), tenant.c_str());
+    try {
+        if (metered) resizer::tenants().admit(tenant);
+        handler();
+        
+    } catch (const resizer::TenantRegistry::rate_limited_error& e) {
+        req->response.result(429);
+        req->response.headers.set("content-type", "application/json");
+        req->response.headers.set("retry-after", std::to_string((e.retry_after().count() + 999) / 1000));
+        req->response.body = "{\"code\": 429, \"message\": \"" + std::string(e.what()) + "\"}";
+        
+    } catch (const resizer::http_error& e) {
+        // Rejected by a server-side limit (memory budget, decode cost, ...)
+        req->response.result(e.status());
+        req->response.headers.set("content-type", "application/json");
+        if (e.status() == 503) req->response.headers.set("retry-after", "1");
+        req->response.body = "{\"code\": " + std::to_string(e.status()) + ", \"message\": \"" + std::string(e.what()) + "\"}";
+        
+    } catch (const std::invalid_argument& e) {
+        // Client error - invalid input
+        req->response.result(400);
+        req->response.headers.set("content-type", "application/json");
+        req->response.body = "{\"code\": 400, \"message\": \"Invalid input: " + std::string(e.what()) + "\"}";
+        
+    } catch (const std::exception& e) {
+        // Server error - processing failed
+        req->response.result(500);
+        req->response.headers.set("content-type", "application/json");
+        req->response.body = "{\"code\": 500, \"message\": \"Internal server error: " + std::string(e.what()) + "\"}";
+    }
+    if (metered) {
+        req->response.headers.set("server-timing", timing->server_timing(std::chrono::steady_clock::now() - start));
+    }
+    RESIZER_PROBE(request_done, endpoint.c_str(), static_cast<int>(req->response.result()),
+                  std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+    record_request(endpoint, static_cast<int>(req->response.result()), start);
+    if (metered) record_tenant_request(tenant, static_cast<int>(req->response.result()), start, *timing);
+}
+
+// Resize one batch item to all of its targets. Runs in its own fiber, so
+// items wait for memory budget and worker threads independently; failures
+// become the item's status instead of failing the batch.
+json resize_batch_item(const json& item, size_t index, resizer::WorkerPool& pool) {
+    json result = {{"index", index}};
+    if (item.contains("id")) result["id"] = item["id"];
+    try {
+        const auto& input_jpeg = item.at("input_jpeg").get_ref<const std::string&>();
+        std::vector<resizer::TargetSize> targets;
+        for (const auto& target : item.at("targets")) {
+            targets.push_back({target.at("width").get<int>(), target.at("height").get<int>()});
+        }
+        
+        resizer::JpegHeader header;
+        bool have_header = resizer::probe_base64_jpeg(input_jpeg, header);
+        if (have_header) {
+            resizer::enforce_declared_size(header.width, header.height, resizer::decode_limits());
+        }
+        auto reservation = resizer::memory_budget().reserve(
+            resizer::estimate_peak_bytes(input_jpeg.size(), have_header ? &header : nullptr, targets));
+        
+        resizer::ResizeStats stats;
+        auto outputs = pool.submit([&] { return resizer::resize_jpeg_targets(input_jpeg, targets, &stats); }).get();
+        reservation.reconcile(input_jpeg.size() + stats.peak_bytes() + stats.output_bytes);
+        
+        result["code"] = 200;
+        result["outputs"] = json::array();
+        for (size_t i = 0; i < targets.size(); ++i) {
+            result["outputs"].push_back({
+                {"width", targets[i].width},
+                {"height", targets[i].height},
+                {"output_jpeg", std::move(outputs[i])},
+            });
+        }
+    } catch (const resizer::http_error& e) {
+        result["code"] = e.status();
+        result["message"] = e.what();
+    } catch (const std::invalid_argument& e) {
+        result["code"] = 400;
+        result["message"] = std::string("Invalid input: ") + e.what();
+    } catch (const json::exception& e) {
+        result["code"] = 400;
+        result["message"] = std::string("Invalid item: ") + e.what();
+    } catch (const std::exception& e) {
+        result["code"] = 500;
+        result["message"] = std::string("Internal server error: ") + e.what();
+    }
+    resizer::metrics().increment("resizer_batch_items_total", "code=\"" + result["code"].dump() + "\"");
     return result;
 }
 
-// Core image resizing function using OpenCV
-std::string resize_jpeg(const std::string& input_base64, int target_width, int target_height) {
-    if (target_width <= 0 || target_height <= 0) {
-        throw std::invalid_argument("Target dimensions must be positive integers");
+// {"op": "crop", "x": 0, "y": 0, "width": 100, "height": 100}, {"op": "resize",
+// "width": 256}, {"op": "rotate", "degrees": 90}, {"op": "flip", "direction":
+// "horizontal"}, {"op": "sharpen", "amount": 0.5}, {"op": "format", "format":
+// "webp"} or {"op": "quality", "quality": 80}
+resizer::Operation parse_operation(const json& spec) {
+    using Type = resizer::Operation::Type;
+    resizer::Operation op;
+    std::string name = spec.at("op");
+    if (name == "crop") {
+        op.type = Type::crop;
+        op.x = spec.value("x", 0);
+        op.y = spec.value("y", 0);
+        op.width = spec.at("width");
+        op.height = spec.at("height");
+    } else if (name == "resize") {
+        op.type = Type::resize;
+        op.width = spec.value("width", 0);
+        op.height = spec.value("height", 0);
+    } else if (name == "rotate") {
+        op.type = Type::rotate;
+        op.degrees = spec.at("degrees");
+    } else if (name == "flip") {
+        op.type = Type::flip;
+        std::string direction = spec.value("direction", "horizontal");
+        op.horizontal = direction == "horizontal" || direction == "both";
+        op.vertical = direction == "vertical" || direction == "both";
+        if (!op.horizontal && !op.vertical) throw std::invalid_argument("Unknown flip direction '" + direction + "'");
+    } else if (name == "sharpen") {
+        op.type = Type::sharpen;
+        op.amount = spec.value("amount", 0.5);
+    } else if (name == "format") {
+        op.type = Type::format;
+        op.format = spec.at("format");
+    } else if (name == "quality") {
+        op.type = Type::quality;
+        op.quality = spec.at("quality");
+    } else {
+        throw std::invalid_argument("Unknown operation '" + name + "'");
     }
+    return op;
+}
+
+json image_info_json(const resizer::JpegHeader& header) {
+    bool transposed = header.orientation >= 5;
+    return {
+        {"code", "200"},
+        {"message", "success"},
+        {"format", "jpeg"},
+        {"width", header.width},
+        {"height", header.height},
+        {"display_width", transposed ? header.height : header.width},
+        {"display_height", transposed ? header.width : header.height},
+        {"components", header.components},
+        {"progressive", header.progressive},
+        {"subsampling", resizer::subsampling_name(header)},
+        {"orientation", header.orientation},
+        {"icc_profile", header.icc_profile},
+        {"quality", header.quality > 0 ? json(header.quality) : json(nullptr)},
+    };
+}
+
+// GET /img renders a thumbnail as a resize followed by a format change
+std::vector<resizer::Operation> thumbnail_operations(const resizer::ThumbnailSpec& spec) {
+    std::vector<resizer::Operation> operations(2);
+    operations[0].type = resizer::Operation::Type::resize;
+    operations[0].width = spec.width;
+    operations[0].height = spec.height;
+    operations[1].type = resizer::Operation::Type::format;
+    operations[1].format = spec.format;
+    return operations;
+}
+
+// Result caches behind GET /img and the state shared by the background
+// pre-generation jobs. With a shared-memory cache configured, the
+// per-process one is disabled so memory is not spent twice.
+struct Pregen {
+    Pregen(const resizer::ServerConfig& config, std::shared_ptr<resizer::SourceStore> source_store)
+        : store(std::move(source_store)),
+          cache(std::make_shared<resizer::ResultCache>(config.shm_cache.name.empty() ? config.result_cache_bytes : 0)),
+          shared(std::make_shared<resizer::SharedResultCache>(config.shm_cache)),
+          planner(config.pregen),
+          workers(config.pregen_workers),
+          max_pending(config.pregen_max_pending) {}
     
-    if (target_width > 65500 || target_height > 65500) {
-        throw std::invalid_argument("Target dimensions exceed maximum JPEG size");
+    std::shared_ptr<resizer::SourceStore> store;
+    std::shared_ptr<resizer::ResultCache> cache;
+    std::shared_ptr<resizer::SharedResultCache> shared;
+    resizer::PregenPlanner planner;
+    size_t workers;
+    size_t max_pending;
+    
+    bool caching() const { return shared->enabled() || cache->enabled(); }
+    bool enabled() const { return planner.enabled() && store->enabled() && caching(); }
+    
+    std::shared_ptr<const resizer::CachedResult> lookup(const std::string& key) {
+        if (shared->enabled()) return shared->get(key);
+        return cache->enabled() ? cache->get(key) : nullptr;
     }
     
-    std::vector<uint8_t> jpeg_data = base64_decode(input_base64);
+    bool cached(const std::string& key) { return shared->enabled() ? shared->contains(key) : cache->contains(key); }
     
-    if (jpeg_data.empty()) {
-        throw std::invalid_argument("Invalid or empty base64 input");
+    // speculative for pre-generated results nobody has requested yet
+    void store_result(const std::string& key, std::shared_ptr<const resizer::CachedResult> result,
+                      bool speculative = false) {
+        if (shared->enabled()) {
+            shared->put(key, std::move(result));
+        } else if (cache->enabled()) {
+            cache->put(key, std::move(result), speculative);
+        }
+    }
+};
+
+// Render the specs of one source that are not cached yet. Runs on a worker
+// in the pool's background lane; memory is only taken if it is free right
+// now, so speculative work never makes a client request wait.
+void render_pregen(Pregen& pregen, const std::string& hash, const std::vector<resizer::ThumbnailSpec>& specs) {
+    std::vector<resizer::ThumbnailSpec> missing;
+    for (const auto& spec : specs) {
+        if (pregen.cached(resizer::thumbnail_cache_key(hash, spec))) {
+            pregen.planner.count_skipped();
+        } else {
+            missing.push_back(spec);
+        }
     }
+    if (missing.empty()) return;
     
-    cv::Mat input_image = cv::imdecode(jpeg_data, cv::IMREAD_COLOR);
+    auto source = pregen.store->get(hash);
+    if (!source) {
+        pregen.planner.count_failed();
+        return;
+    }
+    resizer::JpegHeader header;
+    bool have_header = resizer::probe_jpeg(source->data(), source->size(), header);
     
-    if (input_image.empty()) {
-        throw std::runtime_error("Failed to decode JPEG image - invalid format or corrupted data");
+    for (const auto& spec : missing) {
+        try {
+            auto operations = thumbnail_operations(spec);
+            auto reservation = resizer::memory_budget().try_reserve(resizer::estimate_operations_bytes(
+                source->size() / 3 * 4, have_header ? &header : nullptr, operations));
+            if (!reservation) {
+                pregen.planner.count_skipped();
+                continue;
+            }
+            resizer::ResizeStats stats;
+            auto image = resizer::execute_pipeline(*source, operations, &stats);
+            reservation->reconcile(stats.peak_bytes() + image.bytes.size());
+            
+            auto result = std::make_shared<resizer::CachedResult>();
+            result->content_type = "image/" + spec.format;
+            result->bytes.assign(image.bytes.begin(), image.bytes.end());
+            pregen.store_result(resizer::thumbnail_cache_key(hash, spec), std::move(result), true);
+            pregen.planner.count_generated();
+        } catch (const std::exception&) {
+            pregen.planner.count_failed();
+        }
     }
+}
+
+// Queue pre-generation for a source the first time it is uploaded or
+// requested. The job is dropped when the background lane is already full.
+void schedule_pregen(const std::shared_ptr<Pregen>& pregen, resizer::WorkerPool& pool, const std::string& hash) {
+    if (!pregen->enabled() || !pregen->planner.first_sight(hash)) return;
+    auto specs = pregen->planner.specs();
+    if (specs.empty()) return;
     
-    cv::Mat resized_image;
-    cv::resize(input_image, resized_image, cv::Size(target_width, target_height), 
-               0, 0, cv::INTER_AREA);
+    bool queued = pool.submit_background([pregen, hash, specs = std::move(specs)] {
+        render_pregen(*pregen, hash, specs);
+    }, pregen->workers, pregen->max_pending);
+    if (queued) {
+        pregen->planner.count_scheduled();
+    } else {
+        pregen->planner.count_dropped();
+    }
+}
+
+// Detected container limits, the thread counts derived from them, and CFS
+// throttling, which shows whether those counts still exceed the quota
+void register_container_metrics(const resizer::CgroupLimits& limits, size_t worker_threads, size_t opencv_threads) {
+    using Type = resizer::MetricsRegistry::Type;
+    auto& registry = resizer::metrics();
     
-    std::vector<uint8_t> output_buffer;
-    std::vector<int> encode_params = {
-        cv::IMWRITE_JPEG_QUALITY, 85,
-        cv::IMWRITE_JPEG_OPTIMIZE, 1 
-    };
+    registry.describe("resizer_container_cpu_limit", Type::gauge, "CPU quota of the container's cgroup (0 = none)");
+    registry.describe("resizer_container_memory_limit_bytes", Type::gauge, "Memory limit of the container's cgroup (0 = none)");
+    registry.describe("resizer_worker_threads", Type::gauge, "Pipeline worker threads");
+    registry.describe("resizer_opencv_threads", Type::gauge, "Threads OpenCV may use within one call");
+    registry.describe("resizer_cpu_periods_total", Type::counter, "CFS enforcement periods of the cgroup");
+    registry.describe("resizer_cpu_throttled_periods_total", Type::counter, "CFS periods in which the cgroup was throttled");
+    registry.describe("resizer_cpu_throttled_seconds_total", Type::counter, "Time the cgroup spent throttled");
     
-    bool encode_success = cv::imencode(".jpg", resized_image, output_buffer, encode_params);
+    registry.add_collector([limits, worker_threads, opencv_threads](resizer::MetricsRegistry& r) {
+        r.set("resizer_container_cpu_limit", limits.cpus);
+        r.set("resizer_container_memory_limit_bytes", limits.memory_bytes);
+        r.set("resizer_worker_threads", worker_threads);
+        r.set("resizer_opencv_threads", opencv_threads);
+        auto throttling = resizer::cpu_throttling(limits);
+        r.set("resizer_cpu_periods_total", throttling.periods);
+        r.set("resizer_cpu_throttled_periods_total", throttling.throttled_periods);
+        r.set("resizer_cpu_throttled_seconds_total", throttling.throttled_seconds);
+    });
+}
+
+// Hardware counter totals per pipeline stage, and the ratios that make them
+// comparable across image sizes and hosts
+void register_perf_metrics() {
+    using Type = resizer::MetricsRegistry::Type;
+    auto& registry = resizer::metrics();
     
-    if (!encode_success || output_buffer.empty()) {
-        throw std::runtime_error("Failed to encode resized image to JPEG");
-    }
+    registry.describe("resizer_stage_cycles_total", Type::counter, "CPU cycles spent in each pipeline stage");
+    registry.describe("resizer_stage_instructions_total", Type::counter, "Instructions retired in each pipeline stage");
+    registry.describe("resizer_stage_llc_misses_total", Type::counter, "Last-level cache misses in each pipeline stage");
+    registry.describe("resizer_stage_branch_misses_total", Type::counter, "Branch mispredictions in each pipeline stage");
+    registry.describe("resizer_source_megapixels_total", Type::counter, "Source megapixels decoded while counting");
+    registry.describe("resizer_stage_ipc", Type::gauge, "Instructions per cycle of each pipeline stage since start-up");
+    registry.describe("resizer_stage_llc_misses_per_megapixel", Type::gauge, "LLC misses per source megapixel by stage");
+    registry.describe("resizer_stage_branch_misses_per_megapixel", Type::gauge, "Branch misses per source megapixel by stage");
     
-    // Encode output to base64
-    return base64_encode(output_buffer.data(), output_buffer.size());
+    registry.add_collector([](resizer::MetricsRegistry& r) {
+        auto totals = resizer::stage_counters().totals();
+        double megapixels = totals.megapixels();
+        r.set("resizer_source_megapixels_total", megapixels);
+        for (size_t i = 0; i < resizer::stage_count; ++i) {
+            const auto& counts = totals.stages[i];
+            std::string labels = "stage=\"" + std::string(resizer::stage_name(static_cast<resizer::Stage>(i))) + "\"";
+            r.set("resizer_stage_cycles_total", counts.cycles, labels);
+            r.set("resizer_stage_instructions_total", counts.instructions, labels);
+            r.set("resizer_stage_llc_misses_total", counts.llc_misses, labels);
+            r.set("resizer_stage_branch_misses_total", counts.branch_misses, labels);
+            if (counts.cycles > 0) {
+                r.set("resizer_stage_ipc", static_cast<double>(counts.instructions) / counts.cycles, labels);
+            }
+            if (megapixels > 0) {
+                r.set("resizer_stage_llc_misses_per_megapixel", counts.llc_misses / megapixels, labels);
+                r.set("resizer_stage_branch_misses_per_megapixel", counts.branch_misses / megapixels, labels);
+            }
+        }
+    });
 }
 
+// Per-tenant scheduling and rate limiting; request counts and latencies are
+// recorded as requests finish
+void register_tenant_metrics(const std::shared_ptr<resizer::WorkerPool>& pool) {
+    using Type = resizer::MetricsRegistry::Type;
+    auto& registry = resizer::metrics();
+    
+    registry.describe("resizer_tenant_requests_total", Type::counter, "Requests by tenant and status code");
+    registry.describe("resizer_tenant_request_duration_seconds", Type::summary, "Request handling time by tenant");
+    registry.describe("resizer_tenant_rate_limited_total", Type::counter, "Requests rejected with 429 by tenant");
+    registry.describe("resizer_tenant_request_cpu_seconds", Type::summary, "Worker CPU time per request by tenant");
+    registry.describe("resizer_stage_duration_seconds", Type::summary, "Time per request spent in each pipeline stage");
+    registry.describe("resizer_tenant_cpu_seconds_total", Type::counter, "Worker CPU time spent on each tenant's jobs");
+    registry.describe("resizer_tenant_jobs_total", Type::counter, "Worker jobs completed by tenant");
+    registry.describe("resizer_tenant_queued_jobs", Type::gauge, "Jobs waiting for a worker by tenant");
+    registry.describe("resizer_tenant_running_jobs", Type::gauge, "Jobs running on workers by tenant");
+    
+    registry.add_collector([pool](resizer::MetricsRegistry& r) {
+        for (const auto& tenant : resizer::tenants().stats()) {
+            r.set("resizer_tenant_rate_limited_total", tenant.rate_limited, "tenant=\"" + tenant.name + "\"");
+        }
+        for (const auto& tenant : pool->tenant_stats()) {
+            // Jobs submitted outside any request
+            std::string labels = "tenant=\"" + (tenant.name.empty() ? std::string("internal") : tenant.name) + "\"";
+            r.set("resizer_tenant_cpu_seconds_total", tenant.cpu_seconds, labels);
+            r.set("resizer_tenant_jobs_total", tenant.completed, labels);
+            r.set("resizer_tenant_queued_jobs", tenant.queued, labels);
+            r.set("resizer_tenant_running_jobs", tenant.running, labels);
+        }
+    });
 }
 
-using json = nlohmann::json;
+// Result cache and pre-generation counters, sampled on every scrape
+void register_cache_metrics(const std::shared_ptr<Pregen>& pregen) {
+    using Type = resizer::MetricsRegistry::Type;
+    auto& registry = resizer::metrics();
+    
+    registry.describe("resizer_result_cache_capacity_bytes", Type::gauge, "Byte budget of the result cache");
+    registry.describe("resizer_result_cache_size_bytes", Type::gauge, "Bytes held by the result cache");
+    registry.describe("resizer_result_cache_entries", Type::gauge, "Results held by the result cache");
+    registry.describe("resizer_result_cache_hits_total", Type::counter, "GET /img requests served from the result cache");
+    registry.describe("resizer_result_cache_misses_total", Type::counter, "GET /img requests that had to render");
+    registry.describe("resizer_result_cache_evictions_total", Type::counter, "Results evicted to make room for an admitted one");
+    registry.describe("resizer_result_cache_segment_bytes", Type::gauge, "Bytes held per W-TinyLFU segment");
+    registry.describe("resizer_result_cache_admissions_total", Type::counter, "Results leaving the admission window, by outcome");
+    registry.describe("resizer_shm_cache_segment_bytes", Type::gauge, "Size of the shared-memory result cache segment");
+    registry.describe("resizer_shm_cache_used_bytes", Type::gauge, "Slab pages of the shared cache in use");
+    registry.describe("resizer_shm_cache_entries", Type::gauge, "Results held by the shared cache, all processes");
+    registry.describe("resizer_shm_cache_hits_total", Type::counter, "Shared cache hits, all processes");
+    registry.describe("resizer_shm_cache_misses_total", Type::counter, "Shared cache misses, all processes");
+    registry.describe("resizer_shm_cache_evictions_total", Type::counter, "Results evicted from the shared cache");
+    registry.describe("resizer_shm_cache_recoveries_total", Type::counter, "Shared cache stripes cleared after a process died holding their lock");
+    registry.describe("resizer_shm_cache_oversized_total", Type::counter, "Results too large for a shared cache slab");
+    registry.describe("resizer_pregen_jobs_total", Type::counter, "Pre-generation jobs by outcome (scheduled or dropped)");
+    registry.describe("resizer_pregen_results_total", Type::counter, "Pre-generated thumbnails by outcome");
+    
+    registry.add_collector([pregen](resizer::MetricsRegistry& r) {
+        auto cache = pregen->cache->stats();
+        r.set("resizer_result_cache_capacity_bytes", cache.capacity_bytes);
+        r.set("resizer_result_cache_size_bytes", cache.size_bytes);
+        r.set("resizer_result_cache_entries", cache.entries);
+        r.set("resizer_result_cache_hits_total", cache.hits);
+        r.set("resizer_result_cache_misses_total", cache.misses);
+        r.set("resizer_result_cache_evictions_total", cache.evictions);
+        r.set("resizer_result_cache_segment_bytes", cache.window_bytes, "segment=\"window\"");
+        r.set("resizer_result_cache_segment_bytes", cache.probation_bytes, "segment=\"probation\"");
+        r.set("resizer_result_cache_segment_bytes", cache.protected_bytes, "segment=\"protected\"");
+        r.set("resizer_result_cache_admissions_total", cache.admitted, "outcome=\"admitted\"");
+        r.set("resizer_result_cache_admissions_total", cache.rejected, "outcome=\"rejected\"");
+        
+        if (pregen->shared->enabled()) {
+            auto shared = pregen->shared->stats();
+            r.set("resizer_shm_cache_segment_bytes", shared.segment_bytes);
+            r.set("resizer_shm_cache_used_bytes", shared.used_bytes);
+            r.set("resizer_shm_cache_entries", shared.entries);
+            r.set("resizer_shm_cache_hits_total", shared.hits);
+            r.set("resizer_shm_cache_misses_total", shared.misses);
+            r.set("resizer_shm_cache_evictions_total", shared.evictions);
+            r.set("resizer_shm_cache_recoveries_total", shared.recoveries);
+            r.set("resizer_shm_cache_oversized_total", shared.oversized);
+        }
+        
+        auto jobs = pregen->planner.stats();
+        r.set("resizer_pregen_jobs_total", jobs.scheduled, "outcome=\"scheduled\"");
+        r.set("resizer_pregen_jobs_total", jobs.dropped, "outcome=\"dropped\"");
+        r.set("resizer_pregen_results_total", jobs.generated, "outcome=\"generated\"");
+        r.set("resizer_pregen_results_total", jobs.skipped, "outcome=\"skipped\"");
+        r.set("resizer_pregen_results_total", jobs.failed, "outcome=\"failed\"");
+    });
+}
+
+// Save the result cache for the next process; false if it could not be written
+bool save_cache_snapshot(const Pregen& pregen, const resizer::ServerConfig& config) {
+    if (config.cache_snapshot.empty() || !pregen.cache->enabled()) return true;
+    try {
+        uint64_t limit = config.cache_snapshot_bytes > 0 ? config.cache_snapshot_bytes : UINT64_MAX;
+        auto entries = pregen.cache->snapshot(limit);
+        resizer::write_cache_snapshot(config.cache_snapshot, entries);
+        std::cout << "Saved " << entries.size() << " cached results to " << config.cache_snapshot << std::endl;
+        return true;
+    } catch (const std::exception& e) {
+        std::cerr << "Warning: could not save cache snapshot: " << e.what() << std::endl;
+        return false;
+    }
+}
+
+// Report not-ready, give load balancers delay to notice, let in-flight
+// requests finish and their responses go out, save the cache unless that was
+// already done for a successor, then stop. Runs once, from whichever of the
+// signal and handover threads gets there first.
+void drain_and_stop(const asyik::service_ptr& service, const std::shared_ptr<Pregen>& pregen,
+                    const resizer::ServerConfig& config, std::chrono::milliseconds delay, bool save_snapshot) {
+    static std::once_flag once;
+    std::call_once(once, [&] {
+        resizer::lifecycle().set_ready(false);
+        std::this_thread::sleep_for(delay);
+        if (!resizer::lifecycle().wait_idle(config.drain_timeout, config.drain_grace)) {
+            std::cerr << "Warning: stopping with " << resizer::lifecycle().in_flight()
+                      << " requests still in flight" << std::endl;
+        }
+        if (save_snapshot) save_cache_snapshot(*pregen, config);
+        service->stop();
+    });
+}
+
+}
 
 int main() {
     try {
+        // Termination signals are taken by a dedicated thread (below); every
+        // thread started from here on inherits the blocked mask
+        resizer::block_termination_signals();
+        auto config = resizer::ServerConfig::from_env();
+        
+        // Confine I/O and workers to one NUMA node so a request is received,
+        // decoded, resized and answered without crossing the interconnect.
+        // Must happen before any thread is spawned so they all inherit it.
+        std::vector<int> worker_cpus;
+        if (config.numa_node >= 0) {
+            auto nodes = resizer::discover_numa_nodes();
+            auto node = std::find_if(nodes.begin(), nodes.end(),
+                                     [&](const resizer::NumaNode& n) { return n.id == config.numa_node; });
+            if (node == nodes.end()) {
+                throw std::runtime_error("NUMA node " + std::to_string(config.numa_node) + " not found");
+            }
+            worker_cpus = node->cpus;
+            
+            if (!resizer::pin_current_thread(worker_cpus) || !resizer::prefer_memory_node(node->id)) {
+                std::cerr << "Warning: could not fully apply NUMA placement for node " << node->id << std::endl;
+            }
+            std::cout << "Pinned to NUMA node " << node->id << " (" << worker_cpus.size() << " CPUs)" << std::endl;
+        }
+        
+        // Size threads to the CPUs the container may actually use, not the
+        // host's: a pool wider than the CFS quota runs it dry early in each
+        // period and the whole process is throttled until the next one
+        size_t usable_cpus = resizer::container_cpus(
+            config.container, worker_cpus.empty() ? resizer::available_cpus() : worker_cpus.size());
+        size_t worker_threads = config.worker_threads > 0 ? config.worker_threads : usable_cpus;
+        // Workers already run one image per CPU; OpenCV's own parallel loops
+        // would otherwise start a host-wide thread pool under each of them
+        size_t opencv_threads = config.opencv_threads > 0 ? config.opencv_threads
+                                                          : std::max<size_t>(1, usable_cpus / worker_threads);
+        cv::setNumThreads(static_cast<int>(opencv_threads));
+        if (config.container.version > 0 && (config.container.cpus > 0 || config.container.memory_bytes > 0)) {
+            std::cout << "Container limits (cgroup v" << config.container.version << "): ";
+            if (config.container.cpus > 0) std::cout << config.container.cpus << " CPUs, ";
+            if (config.container.memory_bytes > 0) std::cout << (config.container.memory_bytes >> 20) << " MB, ";
+            std::cout << worker_threads << " workers, " << opencv_threads << " OpenCV threads" << std::endl;
+        }
+        // Non-JPEG inputs still go through cv::imdecode; give it the same pixel cap
+        resizer::decode_limits() = config.decode_limits;
+        setenv("OPENCV_IO_MAX_IMAGE_PIXELS", std::to_string(config.decode_limits.max_pixels).c_str(), 0);
+        
+        resizer::memory_budget().configure(config.memory_budget_bytes, config.memory_wait);
+        resizer::pixel_pool().configure(config.pixel_pool);
+        if (config.prefault_buffers > 0) {
+            resizer::pixel_pool().prefault(config.prefault_buffers, config.prefault_buffer_bytes);
+            std::cout << "Pre-faulted " << config.prefault_buffers << " pixel buffers of "
+                      << (config.prefault_buffer_bytes >> 20) << " MB" << std::endl;
+        }
+        
+        auto pool = std::make_shared<resizer::WorkerPool>(worker_threads, [worker_cpus](size_t) {
+            if (!worker_cpus.empty()) resizer::pin_current_thread(worker_cpus);
+        });
+        
+        resizer::tenants().configure(config.tenants);
+        pool->set_default_tenant(config.tenants.defaults.weight, config.tenants.defaults.max_concurrency);
+        for (const auto& [name, policy] : config.tenants.policies) {
+            pool->set_tenant(name, policy.weight, policy.max_concurrency);
+        }
+        
+        register_metrics();
+        register_container_metrics(config.container, worker_threads, opencv_threads);
+        register_tenant_metrics(pool);
+        if (config.perf_counters) {
+            std::string error = resizer::enable_perf_counters();
+            if (error.empty()) {
+                register_perf_metrics();
+                std::cout << "Counting cycles, instructions and cache misses per pipeline stage" << std::endl;
+            } else {
+                std::cerr << "Warning: RESIZER_PERF_COUNTERS is set but hardware counters are unavailable: " << error
+                          << std::endl;
+            }
+        }
+        
         // Create libasyik service - this manages the async I/O
         auto service = asyik::make_service();
         
-        // Create HTTP server on port 8080
-        auto server = asyik::make_http_server(service, "0.0.0.0", 8080);
+        // Content-addressed sources for the cacheable GET API
+        auto store = std::make_shared<resizer::SourceStore>(config.source_dir);
+        auto pregen = std::make_shared<Pregen>(config, store);
+        register_cache_metrics(pregen);
+        
+        // Replacing a running server: have it save its cache for the preload
+        // below, then share its listening socket
+        std::unique_ptr<resizer::HandoverClient> predecessor;
+        if (!config.handover_socket.empty()) {
+            predecessor = resizer::HandoverClient::connect(config.handover_socket, config.handover_timeout);
+        }
+        if (predecessor && !config.cache_snapshot.empty() && !predecessor->save_state()) {
+            std::cerr << "Warning: previous process could not save its cache snapshot" << std::endl;
+        }
+        
+        // Start with the previous process's hot set; nothing is served before this
+        if (!config.cache_snapshot.empty() && pregen->cache->enabled()) {
+            try {
+                auto entries = resizer::read_cache_snapshot(config.cache_snapshot);
+                pregen->cache->restore(entries);
+                std::cout << "Preloaded " << entries.size() << " cached results from " << config.cache_snapshot << std::endl;
+            } catch (const std::exception& e) {
+                std::cerr << "Warning: ignoring cache snapshot: " << e.what() << std::endl;
+            }
+        }
+        
+        // Create HTTP server. A successor cannot bind the port the previous
+        // process holds: it binds an ephemeral one and serves the inherited
+        // socket from that acceptor instead
+        int inherited = predecessor ? predecessor->take_listener() : -1;
+        auto existing_listeners = resizer::listening_sockets();
+        auto server = asyik::make_http_server(service, config.address, predecessor ? 0 : config.port);
+        if (predecessor) {
+            int acceptor = -1;
+            for (int fd : resizer::listening_sockets()) {
+                if (std::find(existing_listeners.begin(), existing_listeners.end(), fd) == existing_listeners.end()) {
+                    acceptor = fd;
+                }
+            }
+            if (acceptor < 0 || !resizer::adopt_listening_socket(inherited, acceptor)) {
+                throw std::runtime_error("Cannot serve the listening socket of the previous process");
+            }
+        }
+        
+        // The parser enforces the largest endpoint limit while reading, so an
+        // oversized Content-Length or chunked body is cut off before it is
+        // buffered; endpoints with smaller limits check again below
+        server->set_request_body_limit(config.body_limits.largest());
         
         // Register the /resize_image endpoint
-        server->on_http_request("/resize_image", "POST",[](auto req, auto args) 
+        auto resize_body_limit = config.body_limits.limit_for("/resize_image");
+        server->on_http_request("/resize_image", "POST",[pool, resize_body_limit](auto req, auto args) 
+        {
+                handle_request(req, "/resize_image", [&] {
+                    resizer::enforce_body_limit(header_value(req, "content-length"), req->body.size(), resize_body_limit);
+                    auto data = json::parse(req->body);
+                    std::string input_jpeg = data["input_jpeg"];
+                    std::string output_type = data.value("output_type", "jpeg");
+                    
+                    if (output_type == "lqip") {
+                        // Placeholders are a few hundred bytes of output, but the decode
+                        // behind them is still a full frame when the source is too small
+                        // for a 1/8-scale decode, so they reserve like any other resize
+                        int lqip_size = data.value("lqip_size", 32);
+                        resizer::JpegHeader header;
+                        bool have_header = resizer::probe_base64_jpeg(input_jpeg, header);
+                        if (have_header) {
+                            resizer::enforce_declared_size(header.width, header.height, resizer::decode_limits());
+                        }
+                        auto reservation = resizer::memory_budget().reserve(resizer::estimate_peak_bytes(
+                            input_jpeg.size(), have_header ? &header : nullptr, lqip_size, lqip_size));
+                        
+                        resizer::ResizeStats stats;
+                        auto placeholder = pool->submit([&] {
+                            return resizer::lqip_jpeg(input_jpeg, lqip_size, &stats);
+                        }).get();
+                        reservation.reconcile(input_jpeg.size() + stats.peak_bytes() + stats.output_bytes);
+                        
+                        json response = {
+                            {"code", "200"},
+                            {"message", "success"},
+                            {"output_jpeg", placeholder.jpeg_base64},
+                            {"blurhash", placeholder.blurhash},
+                            {"width", placeholder.width},
+                            {"height", placeholder.height},
+                        };
+                        req->response.result(200);
+                        req->response.headers.set("content-type", "application/json");
+                        req->response.body = response.dump();
+                    } else if (output_type != "jpeg") {
+                        throw std::invalid_argument("Unknown output_type '" + output_type + "'");
+                    } else if (data.contains("operations")) {
+                        std::vector<resizer::Operation> operations;
+                        for (const auto& spec : data["operations"]) operations.push_back(parse_operation(spec));
+                        
+                        // Plan up front when the header is readable so the reservation
+                        // reflects the crop and the decode scale
+                        resizer::JpegHeader header;
+                        bool have_header = resizer::probe_base64_jpeg(input_jpeg, header);
+                        if (have_header) {
+                            resizer::enforce_declared_size(header.width, header.height, resizer::decode_limits());
+                        }
+                        auto reservation = resizer::memory_budget().reserve(resizer::estimate_operations_bytes(
+                            input_jpeg.size(), have_header ? &header : nullptr, operations));
+                        
+                        resizer::ResizeStats stats;
+                        auto result = pool->submit([&] { return resizer::run_pipeline(input_jpeg, operations, &stats); }).get();
+                        reservation.reconcile(input_jpeg.size() + stats.peak_bytes() + stats.output_bytes);
+                        
+                        json response = {
+                            {"code", "200"},
+                            {"message", "success"},
+                            {"output_image", std::move(result.image_base64)},
+                            {"format", result.plan.format},
+                            {"width", result.plan.output.width},
+                            {"height", result.plan.output.height},
+                        };
+                        req->response.result(200);
+                        req->response.headers.set("content-type", "application/json");
+                        req->response.body = response.dump();
+                    } else {
+                        int desired_width = data["desired_width"];
+                        int desired_height = data["desired_height"];
+                        bool no_upscale = data.value("no_upscale", false);
+                        bool strip_metadata = data.value("strip_metadata", false);
+                        
+                        resizer::JpegHeader header;
+                        bool have_header = resizer::probe_base64_jpeg(input_jpeg, header);
+                        if (have_header) {
+                            resizer::enforce_declared_size(header.width, header.height, resizer::decode_limits());
+                        }
+                        
+                        std::string output_jpeg;
+                        if (have_header && resizer::can_pass_through(header, desired_width, desired_height, no_upscale)) {
+                            // No pixel changes needed: answer with the source bytes
+                            resizer::metrics().increment("resizer_passthrough_total");
+                            output_jpeg = strip_metadata
+                                ? pool->submit([&] { return resizer::strip_metadata_base64(input_jpeg); }).get()
+                                : std::move(input_jpeg);
+                        } else {
+                            // Reserve the estimated peak before any pixel memory is touched;
+                            // this waits, or fails with 413/503, when the budget is exhausted
+                            auto reservation = resizer::memory_budget().reserve(resizer::estimate_peak_bytes(
+                                input_jpeg.size(), have_header ? &header : nullptr, desired_width, desired_height));
+                            
+                            // Perform image resizing on a worker thread; this fiber yields until it is done
+                            resizer::ResizeStats stats;
+                            output_jpeg = pool->submit([&]() -> std::string {
+                                return resizer::resize_jpeg(input_jpeg, desired_width, desired_height, &stats);
+                            }).get();
+                            reservation.reconcile(input_jpeg.size() + stats.peak_bytes() + stats.output_bytes);
+                        }
+                        
+                        req->response.result(200);
+                        req->response.headers.set("content-type", "application/json");
+                        req->response.body = "{\"code\": \"200\", \"message\": \"success\", \"output_jpeg\": \"" + output_jpeg + "\"}";
+                    }
+                });
+            });
+        
+        // Raw JPEG in, raw JPEG out: POST /resize_image/binary?width=W&height=H
+        // with optional progressive=1 and quality=Q. The response is not
+        // streamed: libasyik sends it only after the handler returns and has
+        // no chunked writer, so the encoder's stripes are collected into the
+        // body and the first byte still waits for the whole encode. The sink
+        // below is where a chunked writer would attach. What this endpoint
+        // does save is the base64 step and any second copy of the input or
+        // the output.
+        auto binary_body_limit = config.body_limits.limit_for("/resize_image/binary");
+        server->on_http_request("/resize_image/binary", "POST", [pool, binary_body_limit](auto req, auto args)
+        {
+                handle_request(req, "/resize_image/binary", [&] {
+                    resizer::enforce_body_limit(header_value(req, "content-length"), req->body.size(), binary_body_limit);
+                    std::string target(req->target());
+                    auto int_param = [&](const char* name, int fallback) {
+                        std::string value = resizer::query_param(target, name);
+                        try {
+                            return value.empty() ? fallback : std::stoi(value);
+                        } catch (const std::exception&) {
+                            throw std::invalid_argument(std::string(name) + " must be an integer");
+                        }
+                    };
+                    resizer::TargetSize size{int_param("width", 0), int_param("height", 0)};
+                    resizer::EncodeOptions options;
+                    options.progressive = int_param("progressive", 0) != 0;
+                    options.quality = int_param("quality", options.quality);
+                    if (options.quality < 1 || options.quality > 100) {
+                        throw std::invalid_argument("quality must be between 1 and 100");
+                    }
+                    resizer::validate_target(size);
+                    
+                    // The body is decoded where it is; this fiber waits on the worker
+                    // below, so the request outlives every read of it
+                    const auto* jpeg_data = reinterpret_cast<const uint8_t*>(req->body.data());
+                    size_t jpeg_size = req->body.size();
+                    resizer::JpegHeader header;
+                    bool have_header = resizer::probe_jpeg(jpeg_data, jpeg_size, header);
+                    if (have_header) {
+                        resizer::enforce_declared_size(header.width, header.height, resizer::decode_limits());
+                    }
+                    auto reservation = resizer::memory_budget().reserve(
+                        resizer::estimate_binary_peak_bytes(jpeg_size, have_header ? &header : nullptr, {size}));
+                    
+                    std::string body;
+                    resizer::ResizeStats stats;
+                    pool->submit([&] {
+                        resizer::resize_jpeg_to_sink(jpeg_data, jpeg_size, size, options,
+                                                     [&](const uint8_t* data, size_t length) {
+                            body.append(reinterpret_cast<const char*>(data), length);
+                        }, &stats);
+                    }).get();
+                    reservation.reconcile(jpeg_size + stats.peak_bytes() + stats.output_bytes);
+                    
+                    req->response.result(200);
+                    req->response.headers.set("content-type", "image/jpeg");
+                    req->response.body = std::move(body);
+                });
+            });
+        
+        // Many images per call. Every item runs in its own fiber and results are
+        // written as NDJSON lines in completion order. libasyik sends the body
+        // once the handler returns, so the lines arrive together; the order
+        // still tells clients which items finished first.
+        auto batch_body_limit = config.body_limits.limit_for("/resize_batch");
+        auto batch_max_items = config.batch_max_items;
+        server->on_http_request("/resize_batch", "POST", [pool, batch_body_limit, batch_max_items](auto req, auto args)
         {
-                try {
-                    std::string raw_body = req->body;
-                    auto data = json::parse(raw_body);
-                    auto input_jpeg = data["input_jpeg"];
-                    auto desired_width = data["desired_width"];
-                    auto desired_height = data["desired_height"];
+                handle_request(req, "/resize_batch", [&] {
+                    resizer::enforce_body_limit(header_value(req, "content-length"), req->body.size(), batch_body_limit);
+                    auto data = json::parse(req->body);
+                    const json& items = data.at("items");
+                    if (!items.is_array()) throw std::invalid_argument("items must be an array");
+                    if (items.size() > batch_max_items) {
+                        throw resizer::http_error(413, "Batch has " + std::to_string(items.size()) +
+                                                       " items, more than the limit of " + std::to_string(batch_max_items));
+                    }
+                    
+                    // Capacity is a power of two holding one slot less; every push
+                    // must find room since nobody pops until all fibers are started
+                    size_t capacity = 2;
+                    while (capacity <= items.size()) capacity <<= 1;
+                    boost::fibers::buffered_channel<std::string> lines(capacity);
+                    
+                    std::vector<boost::fibers::fiber> workers;
+                    workers.reserve(items.size());
+                    std::string tenant = resizer::current_tenant();
+                    auto timing = resizer::current_request_timing();
+                    for (size_t i = 0; i < items.size(); ++i) {
+                        workers.emplace_back([&, i] {
+                            resizer::TenantScope tenant_scope(tenant);
+                            resizer::RequestTimingScope timing_scope(timing);
+                            lines.push(resize_batch_item(items[i], i, *pool).dump());
+                        });
+                    }
                     
-                    // Perform image resizing
-                    std::string output_jpeg = resize_jpeg(input_jpeg, desired_width, desired_height);
+                    std::string body;
+                    for (size_t i = 0; i < items.size(); ++i) {
+                        std::string line;
+                        lines.pop(line);
+                        body += line;
+                        body += '\n';
+                    }
+                    for (auto& worker : workers) worker.join();
                     
                     req->response.result(200);
+                    req->response.headers.set("content-type", "application/x-ndjson");
+                    req->response.body = std::move(body);
+                });
+            });
+        
+        auto sources_body_limit = config.body_limits.limit_for("/sources");
+        server->on_http_request("/sources", "POST", [pool, store, pregen, sources_body_limit](auto req, auto args)
+        {
+                handle_request(req, "/sources", [&] {
+                    resizer::enforce_body_limit(header_value(req, "content-length"), req->body.size(), sources_body_limit);
+                    if (!store->enabled()) throw resizer::http_error(404, "Source store is not configured");
+                    
+                    resizer::JpegHeader header;
+                    const auto* bytes = reinterpret_cast<const uint8_t*>(req->body.data());
+                    if (!resizer::probe_jpeg(bytes, req->body.size(), header)) {
+                        throw std::invalid_argument("Body does not start with a readable JPEG header");
+                    }
+                    resizer::enforce_declared_size(header.width, header.height, resizer::decode_limits());
+                    std::string hash = pool->submit([&] { return store->put(bytes, req->body.size()); }).get();
+                    schedule_pregen(pregen, *pool, hash);
+                    
+                    json response = {
+                        {"code", "201"},
+                        {"message", "stored"},
+                        {"hash", hash},
+                        {"width", header.width},
+                        {"height", header.height},
+                    };
+                    req->response.result(201);
                     req->response.headers.set("content-type", "application/json");
-                    req->response.body = "{\"code\": \"200\", \"message\": \"success\", \"output_jpeg\": \"" + output_jpeg + "\"}";
+                    req->response.body = response.dump();
+                });
+            });
+        
+        // GET /img/{hash}/{w}x{h}.{fmt}. The output depends only on the source
+        // bytes and the URL, so it is served as immutable for CDNs and browsers.
+        auto signing_key = config.url_signing_key;
+        server->on_http_request("/img/<string>/<string>", "GET", [pool, store, pregen, signing_key](auto req, auto args)
+        {
+                handle_request(req, "/img", [&] {
+                    std::string hash = args[1];
+                    std::string spec_text = args[2];
+                    resizer::ThumbnailSpec spec;
+                    if (!resizer::SourceStore::valid_hash(hash) || !resizer::parse_thumbnail_spec(spec_text, spec)) {
+                        throw resizer::http_error(404, "Unknown image URL");
+                    }
+                    
+                    std::string target(req->target());
+                    if (!signing_key.empty() && !resizer::verify_url_signature(
+                            signing_key, resizer::target_path(target), resizer::query_param(target, "sig"))) {
+                        throw resizer::http_error(403, "Missing or invalid URL signature");
+                    }
+                    
+                    std::string etag = "\"" + hash + "-" + spec_text + "\"";
+                    auto set_cache_headers = [&] {
+                        req->response.headers.set("cache-control", "public, max-age=31536000, immutable");
+                        req->response.headers.set("etag", etag);
+                    };
+                    if (resizer::etag_matches(header_value(req, "if-none-match"), etag)) {
+                        req->response.result(304);
+                        set_cache_headers();
+                        return;
+                    }
+                    
+                    pregen->planner.record(spec);
+                    std::string cache_key = resizer::thumbnail_cache_key(hash, spec);
+                    auto cached = pregen->lookup(cache_key);
+                    if (cached) {
+                        req->response.result(200);
+                        req->response.headers.set("content-type", cached->content_type);
+                        set_cache_headers();
+                        req->response.body = cached->bytes;
+                        schedule_pregen(pregen, *pool, hash);
+                        return;
+                    }
+                    
+                    auto source = pool->submit([&] { return store->get(hash); }).get();
+                    if (!source) throw resizer::http_error(404, "Unknown source " + hash);
+                    schedule_pregen(pregen, *pool, hash);
+                    
+                    auto operations = thumbnail_operations(spec);
+                    resizer::JpegHeader header;
+                    bool have_header = resizer::probe_jpeg(source->data(), source->size(), header);
+                    if (have_header) {
+                        resizer::enforce_declared_size(header.width, header.height, resizer::decode_limits());
+                    }
+                    // Estimates are expressed in base64 input size
+                    auto reservation = resizer::memory_budget().reserve(resizer::estimate_operations_bytes(
+                        source->size() / 3 * 4, have_header ? &header : nullptr, operations));
+                    
+                    resizer::ResizeStats stats;
+                    auto image = pool->submit([&] { return resizer::execute_pipeline(*source, operations, &stats); }).get();
+                    reservation.reconcile(stats.peak_bytes() + image.bytes.size());
+                    
+                    req->response.result(200);
+                    req->response.headers.set("content-type", "image/" + spec.format);
+                    set_cache_headers();
+                    req->response.body.assign(image.bytes.begin(), image.bytes.end());
+                    if (pregen->caching()) {
+                        auto result = std::make_shared<resizer::CachedResult>();
+                        result->content_type = "image/" + spec.format;
+                        result->bytes = req->response.body;
+                        pregen->store_result(cache_key, std::move(result));
+                    }
+                });
+            });
+        
+        // Header-only metadata: the JSON variant decodes just enough base64 to
+        // reach the frame header and the binary one reads the body in place,
+        // so neither ever allocates pixel memory
+        auto info_body_limit = config.body_limits.limit_for("/image_info");
+        server->on_http_request("/image_info", "POST", [info_body_limit](auto req, auto args)
+        {
+                handle_request(req, "/image_info", [&] {
+                    resizer::enforce_body_limit(header_value(req, "content-length"), req->body.size(), info_body_limit);
+                    auto data = json::parse(req->body);
+                    std::string input_jpeg = data["input_jpeg"];
                     
-                } catch (const std::invalid_argument& e) {
-                    // Client error - invalid input
-                    req->response.result(400);
+                    resizer::JpegHeader header;
+                    if (!resizer::probe_base64_jpeg(input_jpeg, header)) {
+                        throw std::invalid_argument("input_jpeg does not start with a readable JPEG header");
+                    }
+                    req->response.result(200);
                     req->response.headers.set("content-type", "application/json");
-                    req->response.body = "{\"code\": 400, \"message\": \"Invalid input: " + std::string(e.what()) + "\"}";
+                    req->response.body = image_info_json(header).dump();
+                });
+            });
+        
+        auto info_binary_body_limit = config.body_limits.limit_for("/image_info/binary");
+        server->on_http_request("/image_info/binary", "POST", [info_binary_body_limit](auto req, auto args)
+        {
+                handle_request(req, "/image_info/binary", [&] {
+                    resizer::enforce_body_limit(header_value(req, "content-length"), req->body.size(), info_binary_body_limit);
                     
-                } catch (const std::exception& e) {
-                    // Server error - processing failed
-                    req->response.result(500);
+                    resizer::JpegHeader header;
+                    const auto* bytes = reinterpret_cast<const uint8_t*>(req->body.data());
+                    if (!resizer::probe_jpeg(bytes, req->body.size(), header)) {
+                        throw std::invalid_argument("Body does not start with a readable JPEG header");
+                    }
+                    req->response.result(200);
                     req->response.headers.set("content-type", "application/json");
-                    req->response.body = "{\"code\": 500, \"message\": \"Internal server error: " + std::string(e.what()) + "\"}";
-                }
+                    req->response.body = image_info_json(header).dump();
+                });
+            });
+        
+        // Readiness probe: 503 once shutdown has begun, so load balancers
+        // stop routing here while in-flight requests finish
+        server->on_http_request("/ready", "GET", [](auto req, auto args)
+        {
+                bool ready = resizer::lifecycle().ready();
+                req->response.result(ready ? 200 : 503);
+                req->response.headers.set("content-type", "application/json");
+                req->response.body = ready ? "{\"status\": \"ready\"}" : "{\"status\": \"draining\"}";
+            });
+        
+        // Prometheus scrape endpoint
+        server->on_http_request("/metrics", "GET", [](auto req, auto args)
+        {
+                req->response.result(200);
+                req->response.headers.set("content-type", "text/plain; version=0.0.4");
+                req->response.body = resizer::metrics().render();
             });
         
-        std::cout << "Server started on http://0.0.0.0:8080" << std::endl;
+        std::cout << "Server started on http://" << config.address << ":" << config.port
+                  << " with " << pool->size() << " worker threads" << std::endl;
         std::cout << "Endpoint: POST /resize_image" << std::endl;
+        std::cout << "Endpoint: POST /resize_image/binary" << std::endl;
+        std::cout << "Endpoint: POST /resize_batch" << std::endl;
+        std::cout << "Endpoint: POST /image_info" << std::endl;
+        std::cout << "Endpoint: POST /image_info/binary" << std::endl;
+        if (store->enabled()) {
+            std::cout << "Endpoint: POST /sources, GET /img/{hash}/{w}x{h}.{fmt} (store: " << config.source_dir
+                      << (signing_key.empty() ? "" : ", signed URLs") << ")" << std::endl;
+            if (pregen->shared->enabled()) {
+                std::cout << "Shared result cache: " << config.shm_cache.name << " ("
+                          << (config.shm_cache.size_bytes >> 20) << " MB)" << std::endl;
+            }
+            std::cout << "Result cache: " << (pregen->cache->stats().capacity_bytes >> 20) << " MB, pre-generating "
+                      << config.pregen.configured.size() << " configured and up to " << config.pregen.learned_top_k
+                      << " learned sizes" << std::endl;
+        }
+        std::cout << "Endpoint: GET /ready" << std::endl;
+        if (!config.handover_socket.empty()) {
+            std::cout << "Handover socket: " << config.handover_socket << std::endl;
+        }
+        std::cout << "Endpoint: GET /metrics" << std::endl;
         std::cout << "Press Ctrl+C to stop..." << std::endl;
         
+        // SIGTERM/SIGINT: drain, waiting drain_delay for load balancers first
+        std::thread([service, pregen, config] {
+            int received = resizer::wait_for_termination();
+            std::cout << "Received " << (received == SIGTERM ? "SIGTERM" : "SIGINT") << ", draining" << std::endl;
+            drain_and_stop(service, pregen, config, config.drain_delay, true);
+        }).detach();
+        
+        // A successor taking the port over: it shares the listening socket,
+        // and once it is serving this process stops accepting; nothing new can
+        // reach it then, so drain without the balancer delay. The snapshot it
+        // asked for is the one it loaded; saving again on the way out would
+        // overwrite it under the successor.
+        if (!config.handover_socket.empty()) {
+            auto snapshot_saved = std::make_shared<std::atomic<bool>>(false);
+            resizer::HandoverServer::start(config.handover_socket, config.handover_timeout, {
+                [pregen, config, snapshot_saved] {
+                    bool saved = save_cache_snapshot(*pregen, config);
+                    if (saved) *snapshot_saved = true;
+                    return saved;
+                },
+                [config] { return resizer::find_listening_socket(config.port); },
+                [config] {
+                    int fd = resizer::find_listening_socket(config.port);
+                    return fd >= 0 && resizer::release_listening_socket(fd);
+                },
+                [service, pregen, config, snapshot_saved] {
+                    std::cout << "Handed port " << config.port << " over to a new process, draining" << std::endl;
+                    drain_and_stop(service, pregen, config, std::chrono::milliseconds(0), !snapshot_saved->load());
+                },
+            });
+        }
+        
+        // The previous process accepts alongside this one until told to stop,
+        // which happens only once this service is running
+        if (predecessor) {
+            std::shared_ptr<resizer::HandoverClient> handover = std::move(predecessor);
+            service->execute([handover, port = config.port] {
+                std::thread([handover, port] {
+                    try {
+                        handover->release_port();
+                        std::cout << "Took over port " << port << " from the previous process" << std::endl;
+                    } catch (const std::exception& e) {
+                        std::cerr << "Warning: " << e.what() << "; both processes are accepting" << std::endl;
+                    }
+                }).detach();
+            });
+        }
+        
+        resizer::lifecycle().set_ready(true);
         service->run();
         
     } catch (const std::exception& e) {
@@ -0,0 +1,149 @@
+#pragma once
+
+#include <boost/fiber/condition_variable.hpp>
+#include <boost/fiber/mutex.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <utility>
+
+#include "errors.hpp"
+
+namespace resizer {
+
+// Global accountant for the memory held by in-flight requests. Each request
+// reserves its estimated peak before any pixel buffer is allocated; when the
+// budget is exhausted it waits (as a fiber, without blocking the I/O thread)
+// or is turned away, so a burst of large images queues instead of OOMing.
+class MemoryBudget {
+public:
+    struct Stats {
+        uint64_t limit = 0;
+        uint64_t in_use = 0;
+        uint64_t peak = 0;
+        uint64_t reservations = 0;
+        uint64_t waits = 0;
+        uint64_t rejections = 0;
+        // Sum of reserved estimates and reconciled actuals, for accuracy tracking
+        uint64_t estimated_bytes = 0;
+        uint64_t actual_bytes = 0;
+    };
+
+    class Reservation {
+    public:
+        Reservation() = default;
+        Reservation(MemoryBudget* owner, uint64_t bytes) : owner_(owner), bytes_(bytes) {}
+        Reservation(Reservation&& other) noexcept { *this = std::move(other); }
+        Reservation& operator=(Reservation&& other) noexcept {
+            if (this != &other) {
+                release();
+                owner_ = std::exchange(other.owner_, nullptr);
+                bytes_ = std::exchange(other.bytes_, 0);
+            }
+            return *this;
+        }
+        ~Reservation() { release(); }
+
+        uint64_t bytes() const { return bytes_; }
+
+        // Replace the estimate with what the pipeline actually held. Growing
+        // never waits: the memory is already allocated by then.
+        void reconcile(uint64_t actual) {
+            if (owner_) owner_->adjust(bytes_, actual);
+            bytes_ = actual;
+        }
+
+        void release() {
+            if (owner_) owner_->adjust(bytes_, 0);
+            owner_ = nullptr;
+            bytes_ = 0;
+        }
+
+    private:
+        MemoryBudget* owner_ = nullptr;
+        uint64_t bytes_ = 0;
+    };
+
+    // A limit of 0 disables accounting limits (usage is still tracked)
+    void configure(uint64_t limit, std::chrono::milliseconds max_wait) {
+        std::lock_guard<boost::fibers::mutex> lock(mutex_);
+        stats_.limit = limit;
+        max_wait_ = max_wait;
+    }
+
+    // Throws http_error 413 when bytes can never fit, 503 when the budget
+    // stays exhausted for longer than the configured wait.
+    Reservation reserve(uint64_t bytes) {
+        std::unique_lock<boost::fibers::mutex> lock(mutex_);
+        stats_.reservations++;
+        stats_.estimated_bytes += bytes;
+
+        if (stats_.limit > 0 && bytes > stats_.limit) {
+            stats_.rejections++;
+            throw http_error(413, "Image needs an estimated " + std::to_string(bytes >> 20) +
+                                  " MB, more than the server memory budget");
+        }
+
+        auto fits = [&] { return stats_.limit == 0 || stats_.in_use + bytes <= stats_.limit; };
+        if (!fits()) {
+            stats_.waits++;
+            waiting_++;
+            bool granted = released_.wait_for(lock, max_wait_, fits);
+            waiting_--;
+            if (!granted) {
+                stats_.rejections++;
+                throw http_error(503, "Server memory budget exhausted, retry later");
+            }
+        }
+
+        stats_.in_use += bytes;
+        stats_.peak = std::max(stats_.peak, stats_.in_use);
+        return Reservation(this, bytes);
+    }
+
+    // Reserve only if bytes fit right now. For optional background work,
+    // which must neither wait on a worker thread nor take memory a client
+    // request is queueing for; a refusal is not counted as a rejection.
+    std::optional<Reservation> try_reserve(uint64_t bytes) {
+        std::lock_guard<boost::fibers::mutex> lock(mutex_);
+        if (stats_.limit > 0 && (waiting_ > 0 || stats_.in_use + bytes > stats_.limit)) return std::nullopt;
+        stats_.reservations++;
+        stats_.estimated_bytes += bytes;
+        stats_.in_use += bytes;
+        stats_.peak = std::max(stats_.peak, stats_.in_use);
+        return Reservation(this, bytes);
+    }
+
+    Stats stats() {
+        std::lock_guard<boost::fibers::mutex> lock(mutex_);
+        return stats_;
+    }
+
+private:
+    void adjust(uint64_t from, uint64_t to) {
+        {
+            std::lock_guard<boost::fibers::mutex> lock(mutex_);
+            stats_.in_use = stats_.in_use - from + to;
+            stats_.peak = std::max(stats_.peak, stats_.in_use);
+            if (to > 0) stats_.actual_bytes += to;
+        }
+        if (to < from) released_.notify_all();
+    }
+
+    boost::fibers::mutex mutex_;
+    boost::fibers::condition_variable released_;
+    std::chrono::milliseconds max_wait_{2000};
+    size_t waiting_ = 0;
+    Stats stats_;
+};
+
+inline MemoryBudget& memory_budget() {
+    static MemoryBudget budget;
+    return budget;
+}
+
+}
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace resizer {
+
+// Minimal Prometheus text-format registry. Series are keyed by metric name
+// plus a preformatted label set such as `code="200",endpoint="/resize_image"`.
+class MetricsRegistry {
+public:
+    enum class Type { counter, gauge, summary };
+
+    // Collectors run right before rendering to refresh gauges sampled from
+    // other subsystems (allocator, buffer pool, ...)
+    using Collector = std::function<void(MetricsRegistry&)>;
+
+    void describe(const std::string& name, Type type, const std::string& help) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto& family = families_[name];
+        family.type = type;
+        family.help = help;
+    }
+
+    void increment(const std::string& name, const std::string& labels = "", double delta = 1) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        families_[name].series[labels].value += delta;
+    }
+
+    void set(const std::string& name, double value, const std::string& labels = "") {
+        std::lock_guard<std::mutex> lock(mutex_);
+        families_[name].series[labels].value = value;
+    }
+
+    // Summaries are exported as <name>_sum and <name>_count
+    void observe(const std::string& name, double value, const std::string& labels = "") {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto& series = families_[name].series[labels];
+        series.value += value;
+        series.count++;
+    }
+
+    void add_collector(Collector collector) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        collectors_.push_back(std::move(collector));
+    }
+
+    std::string render() {
+        std::vector<Collector> collectors;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            collectors = collectors_;
+        }
+        for (auto& collect : collectors) collect(*this);
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::ostringstream out;
+        for (const auto& [name, family] : families_) {
+            if (!family.help.empty()) out << "# HELP " << name << " " << family.help << "\n";
+            out << "# TYPE " << name << " " << type_name(family.type) << "\n";
+            for (const auto& [labels, series] : family.series) {
+                std::string suffix = labels.empty() ? "" : "{" + labels + "}";
+                if (family.type == Type::summary) {
+                    out << name << "_sum" << suffix << " " << format_value(series.value) << "\n";
+                    out << name << "_count" << suffix << " " << series.count << "\n";
+                } else {
+                    out << name << suffix << " " << format_value(series.value) << "\n";
+                }
+            }
+        }
+        return out.str();
+    }
+
+private:
+    struct Series {
+        double value = 0;
+        uint64_t count = 0;
+    };
+
+    struct Family {
+        Type type = Type::gauge;
+        std::string help;
+        std::map<std::string, Series> series;
+    };
+
+    // Byte counts and totals past a million must not lose digits to the
+    // stream's default six significant ones, so integral values are written
+    // in full and others with the fewest digits that read back exactly
+    static std::string format_value(double value) {
+        if (std::isnan(value)) return "NaN";
+        if (std::isinf(value)) return value > 0 ? "+Inf" : "-Inf";
+        if (value == std::trunc(value) && std::fabs(value) < 9.2e18) {
+            return std::to_string(static_cast<int64_t>(value));
+        }
+        std::string text;
+        for (int precision : {15, 16, 17}) {
+            std::ostringstream out;
+            out.precision(precision);
+            out << value;
+            text = out.str();
+            if (std::strtod(text.c_str(), nullptr) == value) break;
+        }
+        return text;
+    }
+
+    static const char* type_name(Type type) {
+        switch (type) {
+            case Type::counter: return "counter";
+            case Type::summary: return "summary";
+            default: return "gauge";
+        }
+    }
+
+    std::mutex mutex_;
+    std::map<std::string, Family> families_;
+    std::vector<Collector> collectors_;
+};
+
+inline MetricsRegistry& metrics() {
+    static MetricsRegistry registry;
+    return registry;
+}
+
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/mempolicy.h>
+
+#include <algorithm>
+#include <dirent.h>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace resizer {
+
+struct NumaNode {
+    int id = -1;
+    std::vector<int> cpus;
+};
+
+// Parse a kernel cpulist such as "0-3,8-11"
+inline std::vector<int> parse_cpu_list(const std::string& list) {
+    std::vector<int> cpus;
+    std::stringstream stream(list);
+    std::string range;
+
+    while (std::getline(stream, range, ',')) {
+        if (range.empty() || range == "\n") continue;
+        size_t dash = range.find('-');
+        int first = std::stoi(range.substr(0, dash));
+        int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+        for (int cpu = first; cpu <= last; ++cpu) cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+// Enumerate NUMA nodes from sysfs so that no libnuma dependency is needed.
+// Returns an empty list on kernels built without NUMA support.
+inline std::vector<NumaNode> discover_numa_nodes(const std::string& root = "/sys/devices/system/node") {
+    std::vector<NumaNode> nodes;
+
+    DIR* dir = opendir(root.c_str());
+    if (dir == nullptr) return nodes;
+
+    while (dirent* entry = readdir(dir)) {
+        std::string name = entry->d_name;
+        if (name.rfind("node", 0) != 0 || name.size() == 4) continue;
+        if (!std::all_of(name.begin() + 4, name.end(), ::isdigit)) continue;
+
+        std::ifstream cpulist(root + "/" + name + "/cpulist");
+        std::string list;
+        if (!std::getline(cpulist, list)) continue;
+
+        NumaNode node;
+        node.id = std::stoi(name.substr(4));
+        node.cpus = parse_cpu_list(list);
+        if (!node.cpus.empty()) nodes.push_back(std::move(node));
+    }
+    closedir(dir);
+
+    std::sort(nodes.begin(), nodes.end(),
+              [](const NumaNode& a, const NumaNode& b) { return a.id < b.id; });
+    return nodes;
+}
+
+inline bool pin_current_thread(const std::vector<int>& cpus) {
+    if (cpus.empty()) return false;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+        if (cpu >= 0 && cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+// Prefer allocations from the given node for the calling thread. Threads
+// spawned afterwards inherit the policy, so call this before starting any.
+// MPOL_PREFERRED rather than MPOL_BIND: a full node falls back to remote
+// memory instead of invoking the OOM killer.
+inline bool prefer_memory_node(int node) {
+    constexpr size_t bits_per_word = 8 * sizeof(unsigned long);
+    constexpr size_t max_nodes = 1024;
+    if (node < 0 || static_cast<size_t>(node) >= max_nodes) return false;
+
+    unsigned long mask[max_nodes / bits_per_word] = {};
+    mask[node / bits_per_word] |= 1UL << (node % bits_per_word);
+
+    // The kernel treats maxnode as one past the last valid bit
+    return syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, max_nodes + 1) == 0;
+}
+
+}
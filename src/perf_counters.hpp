@@ -0,0 +1,179 @@
+#pragma once
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+
+namespace resizer {
+
+// Hardware counters of the calling thread, for seeing why a stage is slow
+// rather than only that it is: instructions per cycle, last-level cache
+// misses and branch misses. Off unless enabled, since every read is a system
+// call and the PMU is shared with whatever else profiles the host.
+struct PerfSample {
+    uint64_t cycles = 0;
+    uint64_t instructions = 0;
+    uint64_t llc_misses = 0;
+    uint64_t branch_misses = 0;
+};
+
+// Raw group counts with the time the group was enabled and actually counting
+struct PerfReading {
+    PerfSample counts;
+    uint64_t time_enabled = 0;
+    uint64_t time_running = 0;
+};
+
+// Counts between two readings of one group. When more events are requested
+// than the PMU has counters the kernel time-slices groups, so counts are
+// scaled by the share of the interval the group was on the PMU.
+inline PerfSample perf_delta(const PerfReading& begin, const PerfReading& end) {
+    PerfSample delta;
+    uint64_t enabled = end.time_enabled - begin.time_enabled;
+    uint64_t running = end.time_running - begin.time_running;
+    if (running == 0) return delta;
+    double scale = static_cast<double>(enabled) / running;
+    auto scaled = [scale](uint64_t from, uint64_t to) { return static_cast<uint64_t>((to - from) * scale + 0.5); };
+    delta.cycles = scaled(begin.counts.cycles, end.counts.cycles);
+    delta.instructions = scaled(begin.counts.instructions, end.counts.instructions);
+    delta.llc_misses = scaled(begin.counts.llc_misses, end.counts.llc_misses);
+    delta.branch_misses = scaled(begin.counts.branch_misses, end.counts.branch_misses);
+    return delta;
+}
+
+// Why perf_event_open failed, in terms of what to change
+inline std::string perf_error_message(int error) {
+    switch (error) {
+    case ENOENT:
+    case EOPNOTSUPP:
+        return "no hardware counters (virtual machine without a virtual PMU?)";
+    case EACCES:
+    case EPERM:
+        return "not permitted (lower kernel.perf_event_paranoid to 2 or grant CAP_PERFMON)";
+    case ENOSYS:
+        return "perf_event_open is not available (blocked by seccomp?)";
+    default:
+        return std::strerror(error);
+    }
+}
+
+// Cycles, instructions, LLC misses and branch misses of the calling thread,
+// opened as one group so all four are scheduled onto the PMU together and
+// read with a single system call. User space only, which is what the
+// pipeline runs in and what paranoid level 2 allows.
+class PerfCounterGroup {
+public:
+    PerfCounterGroup() {
+        static const uint64_t events[event_count] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                                     PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+        for (size_t i = 0; i < event_count; ++i) {
+            perf_event_attr attr{};
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = events[i];
+            attr.disabled = i == 0;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            int fd = static_cast<int>(
+                ::syscall(__NR_perf_event_open, &attr, 0, -1, i == 0 ? -1 : fds_[0], PERF_FLAG_FD_CLOEXEC));
+            if (fd < 0) {
+                error_ = errno;
+                close_all();
+                return;
+            }
+            fds_[i] = fd;
+        }
+        ::ioctl(fds_[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ::ioctl(fds_[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+    ~PerfCounterGroup() { close_all(); }
+    PerfCounterGroup(const PerfCounterGroup&) = delete;
+    PerfCounterGroup& operator=(const PerfCounterGroup&) = delete;
+
+    bool valid() const { return fds_[0] >= 0; }
+    // errno of the failed open
+    int error() const { return error_; }
+
+    bool read(PerfReading& reading) const {
+        // nr, time_enabled, time_running, then one value per event
+        uint64_t buffer[3 + event_count];
+        if (!valid() || ::read(fds_[0], buffer, sizeof(buffer)) != static_cast<ssize_t>(sizeof(buffer)) ||
+            buffer[0] != event_count) {
+            return false;
+        }
+        reading.time_enabled = buffer[1];
+        reading.time_running = buffer[2];
+        reading.counts.cycles = buffer[3];
+        reading.counts.instructions = buffer[4];
+        reading.counts.llc_misses = buffer[5];
+        reading.counts.branch_misses = buffer[6];
+        return true;
+    }
+
+private:
+    static constexpr size_t event_count = 4;
+
+    void close_all() {
+        for (int& fd : fds_) {
+            if (fd >= 0) ::close(fd);
+            fd = -1;
+        }
+    }
+
+    int fds_[event_count] = {-1, -1, -1, -1};
+    int error_ = 0;
+};
+
+namespace detail {
+
+inline std::atomic<bool>& perf_counters_flag() {
+    static std::atomic<bool> enabled{false};
+    return enabled;
+}
+
+}
+
+inline bool perf_counters_enabled() { return detail::perf_counters_flag().load(std::memory_order_relaxed); }
+
+// Turn counting on for every thread, after checking this host allows it;
+// returns why not, or an empty string once enabled
+inline std::string enable_perf_counters() {
+    PerfCounterGroup probe;
+    PerfReading reading;
+    if (!probe.valid()) return perf_error_message(probe.error());
+    if (!probe.read(reading)) return "cannot read the counter group";
+    detail::perf_counters_flag().store(true, std::memory_order_relaxed);
+    return "";
+}
+
+inline void disable_perf_counters() { detail::perf_counters_flag().store(false, std::memory_order_relaxed); }
+
+namespace detail {
+
+// The calling thread's group, opened on first use and closed when the
+// thread exits; nullptr while counting is off or if this thread's group
+// could not be opened (e.g. out of descriptors)
+inline PerfCounterGroup* thread_perf_group() {
+    if (!perf_counters_enabled()) return nullptr;
+    thread_local std::unique_ptr<PerfCounterGroup> group;
+    thread_local bool attempted = false;
+    if (!attempted) {
+        attempted = true;
+        auto opened = std::make_unique<PerfCounterGroup>();
+        if (opened->valid()) group = std::move(opened);
+    }
+    return group.get();
+}
+
+}
+
+}
@@ -0,0 +1,339 @@
+#pragma once
+
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "jpeg_decoder.hpp"
+#include "jpeg_encoder.hpp"
+#include "jpeg_probe.hpp"
+#include "pixel_pool.hpp"
+#include "request_timing.hpp"
+#include "resizer.hpp"
+
+namespace resizer {
+
+// One step of a client-supplied transformation, in request order
+struct Operation {
+    enum class Type { crop, resize, rotate, flip, sharpen, format, quality };
+
+    Type type = Type::resize;
+    int x = 0, y = 0;            // crop origin
+    int width = 0, height = 0;   // crop or resize size; 0 keeps the aspect ratio on resize
+    int degrees = 0;             // rotate, clockwise multiple of 90
+    bool horizontal = false;     // flip around the vertical axis
+    bool vertical = false;       // flip around the horizontal axis
+    double amount = 0;           // sharpen strength
+    std::string format;          // jpeg, png or webp
+    int quality = 0;
+};
+
+// Operations reduced to at most one pass of each kind, in the cheapest order:
+// crop the source (a view, no copy), resize once, rotate/flip the small
+// result, sharpen at output size, encode. The decoder is told the final
+// scale so it can drop resolution inside the IDCT.
+struct Plan {
+    // Part of the upright source that is kept, in source pixels
+    cv::Rect2d region;
+    // Size the region is resized to, before orientation is applied
+    TargetSize resize;
+    // EXIF-style transform (1-8) applied to the resized frame
+    int orientation = 1;
+    // Final image size
+    TargetSize output;
+    double sharpen = 0;
+    std::string format = "jpeg";
+    int quality = 85;
+
+    // Size the whole source would have at the plan's scale; decode_source
+    // picks its DCT scale from this
+    TargetSize decode_target(int source_width, int source_height) const {
+        return {static_cast<int>(std::ceil(resize.width * source_width / region.width)),
+                static_cast<int>(std::ceil(resize.height * source_height / region.height))};
+    }
+};
+
+namespace detail {
+
+// Orientation as "transpose, then flip columns, then flip rows", the order
+// apply_exif_orientation uses. Indexed by EXIF value.
+struct Orientation {
+    bool transpose = false;
+    bool flip_x = false;
+    bool flip_y = false;
+
+    static Orientation from_exif(int value) {
+        static const Orientation table[9] = {
+            {}, {false, false, false}, {false, true, false}, {false, true, true}, {false, false, true},
+            {true, false, false}, {true, true, false}, {true, true, true}, {true, false, true},
+        };
+        return table[value >= 1 && value <= 8 ? value : 1];
+    }
+
+    int to_exif() const {
+        for (int value = 1; value <= 8; ++value) {
+            Orientation o = from_exif(value);
+            if (o.transpose == transpose && o.flip_x == flip_x && o.flip_y == flip_y) return value;
+        }
+        return 1;
+    }
+
+    // Transposing after a flip equals flipping the other axis after transposing
+    void then_transpose() {
+        transpose = !transpose;
+        std::swap(flip_x, flip_y);
+    }
+};
+
+}
+
+// Fold the operations into a Plan for a source of the given upright size.
+// Throws std::invalid_argument for operations that cannot be applied.
+inline Plan plan_operations(const std::vector<Operation>& operations, int source_width, int source_height) {
+    if (source_width <= 0 || source_height <= 0) {
+        throw std::invalid_argument("Source dimensions must be positive");
+    }
+
+    Plan plan;
+    plan.region = cv::Rect2d(0, 0, source_width, source_height);
+    // Size of the image as the operations so far have left it
+    TargetSize current{source_width, source_height};
+    detail::Orientation orientation;
+
+    for (const auto& op : operations) {
+        switch (op.type) {
+            case Operation::Type::crop: {
+                if (op.width <= 0 || op.height <= 0 || op.x < 0 || op.y < 0 ||
+                    op.x + op.width > current.width || op.y + op.height > current.height) {
+                    throw std::invalid_argument("Crop rectangle must lie inside the " + std::to_string(current.width) +
+                                                "x" + std::to_string(current.height) + " image");
+                }
+                // Map the rectangle back through the pending flips and transpose
+                double x = orientation.flip_x ? current.width - op.x - op.width : op.x;
+                double y = orientation.flip_y ? current.height - op.y - op.height : op.y;
+                double w = op.width, h = op.height;
+                TargetSize unoriented = current;
+                if (orientation.transpose) {
+                    std::swap(x, y);
+                    std::swap(w, h);
+                    std::swap(unoriented.width, unoriented.height);
+                }
+                // ... and back through the pending resize into source pixels
+                double sx = plan.region.width / unoriented.width;
+                double sy = plan.region.height / unoriented.height;
+                plan.region = cv::Rect2d(plan.region.x + x * sx, plan.region.y + y * sy, w * sx, h * sy);
+                current = {op.width, op.height};
+                break;
+            }
+            case Operation::Type::resize: {
+                if (op.width < 0 || op.height < 0 || (op.width == 0 && op.height == 0)) {
+                    throw std::invalid_argument("Resize needs a positive width or height");
+                }
+                TargetSize next{op.width, op.height};
+                if (next.width == 0) {
+                    next.width = std::max(1, static_cast<int>(std::lround(double(op.height) * current.width / current.height)));
+                }
+                if (next.height == 0) {
+                    next.height = std::max(1, static_cast<int>(std::lround(double(op.width) * current.height / current.width)));
+                }
+                validate_target(next);
+                // Consecutive resizes fuse: only the last size matters
+                current = next;
+                break;
+            }
+            case Operation::Type::rotate: {
+                int degrees = ((op.degrees % 360) + 360) % 360;
+                if (degrees % 90 != 0) throw std::invalid_argument("Rotation must be a multiple of 90 degrees");
+                // 90 clockwise is a transpose followed by a column flip
+                for (int quarter = 0; quarter < degrees / 90; ++quarter) {
+                    orientation.then_transpose();
+                    orientation.flip_x = !orientation.flip_x;
+                    std::swap(current.width, current.height);
+                }
+                break;
+            }
+            case Operation::Type::flip:
+                if (op.horizontal) orientation.flip_x = !orientation.flip_x;
+                if (op.vertical) orientation.flip_y = !orientation.flip_y;
+                break;
+            case Operation::Type::sharpen:
+                if (op.amount < 0 || op.amount > 5) throw std::invalid_argument("Sharpen amount must be between 0 and 5");
+                plan.sharpen = op.amount;
+                break;
+            case Operation::Type::format:
+                if (op.format != "jpeg" && op.format != "png" && op.format != "webp") {
+                    throw std::invalid_argument("Unsupported format '" + op.format + "'");
+                }
+                plan.format = op.format;
+                break;
+            case Operation::Type::quality:
+                if (op.quality < 1 || op.quality > 100) throw std::invalid_argument("Quality must be between 1 and 100");
+                plan.quality = op.quality;
+                break;
+        }
+    }
+
+    plan.output = current;
+    plan.resize = orientation.transpose ? TargetSize{current.height, current.width} : current;
+    plan.orientation = orientation.to_exif();
+    return plan;
+}
+
+// Memory bound for executing a plan; see estimate_peak_bytes
+inline uint64_t estimate_plan_bytes(size_t input_base64_size, const JpegHeader* header, const Plan& plan) {
+    uint64_t compressed = input_base64_size / 4 * 3;
+    uint64_t decoded = compressed * 10;
+    if (header) {
+        bool transposed = header->orientation >= 5;
+        int width = transposed ? header->height : header->width;
+        int height = transposed ? header->width : header->height;
+        TargetSize target = plan.decode_target(width, height);
+        uint64_t denom = choose_scale_denom(*header, target.width, target.height);
+        decoded = ((header->width + denom - 1) / denom) * ((header->height + denom - 1) / denom) * 3;
+        if (transposed) decoded *= 2;
+    }
+    uint64_t resized = uint64_t(plan.output.width) * plan.output.height * 3;
+    // PNG output can exceed the raw pixels; budget for that instead of JPEG's third
+    uint64_t encoded = plan.format == "png" ? resized + resized / 8 : resized / 3;
+    uint64_t output = encoded / 3 * 4;
+    // Resized, oriented and sharpened frames may be alive together
+    return input_base64_size + compressed + decoded + 3 * resized + encoded + 2 * output;
+}
+
+// Memory bound for running operations on an image whose header may be
+// unknown; without one the plan cannot be made ahead of decoding
+inline uint64_t estimate_operations_bytes(size_t input_base64_size, const JpegHeader* header,
+                                          const std::vector<Operation>& operations) {
+    if (!header) return estimate_peak_bytes(input_base64_size, nullptr, 0, 0);
+    bool transposed = header->orientation >= 5;
+    Plan plan = plan_operations(operations, transposed ? header->height : header->width,
+                                transposed ? header->width : header->height);
+    return estimate_plan_bytes(input_base64_size, header, plan);
+}
+
+// Encoded image in the plan's format and quality
+inline std::vector<uint8_t> encode_image(const cv::Mat& image, const std::string& format, int quality) {
+    StageTimer timer(Stage::encode);
+    std::vector<uint8_t> buffer;
+    bool ok = false;
+    if (format == "png") {
+        ok = cv::imencode(".png", image, buffer, {cv::IMWRITE_PNG_COMPRESSION, 3});
+    } else if (format == "webp") {
+        ok = cv::imencode(".webp", image, buffer, {cv::IMWRITE_WEBP_QUALITY, quality});
+    } else {
+        EncodeOptions options;
+        options.quality = quality;
+        options.optimize = true;
+        encode_jpeg(image, options, [&](const uint8_t* data, size_t size) { buffer.insert(buffer.end(), data, data + size); });
+        ok = true;
+    }
+    if (!ok || buffer.empty()) {
+        throw std::runtime_error("Failed to encode image as " + format);
+    }
+    RESIZER_PROBE(encode_done, image.cols, image.rows, buffer.size());
+    return buffer;
+}
+
+// Encoded output of a plan, in the plan's format
+struct EncodedImage {
+    std::vector<uint8_t> bytes;
+    Plan plan;
+};
+
+// Plan and run the operations on one compressed image. Fills every stats
+// field except output_bytes, which depends on how the caller ships the bytes.
+inline EncodedImage execute_pipeline(const std::vector<uint8_t>& data, const std::vector<Operation>& operations,
+                                     ResizeStats* stats = nullptr) {
+    if (data.empty()) {
+        throw std::invalid_argument("Invalid or empty image input");
+    }
+
+    // Plan against the header when there is one, so the decoder can scale
+    EncodedImage result;
+    PixelBufferPool::Lease lease;
+    cv::Mat source;
+    int source_width = 0, source_height = 0;
+    JpegHeader header;
+    if (probe_jpeg(data.data(), data.size(), header)) {
+        bool transposed = header.orientation >= 5;
+        source_width = transposed ? header.height : header.width;
+        source_height = transposed ? header.width : header.height;
+        result.plan = plan_operations(operations, source_width, source_height);
+        TargetSize target = result.plan.decode_target(source_width, source_height);
+        source = decode_source(data, target.width, target.height, lease);
+    } else {
+        source = decode_source(data, 0, 0, lease);
+        source_width = source.cols;
+        source_height = source.rows;
+        result.plan = plan_operations(operations, source_width, source_height);
+    }
+    const Plan& plan = result.plan;
+
+    // The decoded frame may be scaled down; map the region onto it
+    double sx = double(source.cols) / source_width;
+    double sy = double(source.rows) / source_height;
+    cv::Rect roi(static_cast<int>(std::floor(plan.region.x * sx)), static_cast<int>(std::floor(plan.region.y * sy)),
+                 std::max(1, static_cast<int>(std::lround(plan.region.width * sx))),
+                 std::max(1, static_cast<int>(std::lround(plan.region.height * sy))));
+    roi &= cv::Rect(0, 0, source.cols, source.rows);
+    cv::Mat region = source(roi);
+
+    cv::Mat image;
+    size_t resized_bytes = 0;
+    {
+        StageTimer timer(Stage::resize);
+        if (region.cols == plan.resize.width && region.rows == plan.resize.height) {
+            image = region;
+        } else {
+            cv::resize(region, image, cv::Size(plan.resize.width, plan.resize.height), 0, 0, cv::INTER_AREA);
+        }
+        resized_bytes = image.data == region.data ? 0 : image.total() * image.elemSize();
+
+        // Orientation on the output-sized frame costs a fraction of doing it on the source
+        if (plan.orientation != 1) apply_exif_orientation(image, plan.orientation);
+        if (plan.sharpen > 0) {
+            cv::Mat blurred;
+            cv::GaussianBlur(image, blurred, cv::Size(0, 0), 1.0);
+            cv::addWeighted(image, 1.0 + plan.sharpen, blurred, -plan.sharpen, 0, image);
+        }
+    }
+
+    result.bytes = encode_image(image, plan.format, plan.quality);
+
+    if (stats) {
+        stats->compressed_bytes = data.size();
+        stats->decoded_bytes = decoded_frame_bytes(source, lease);
+        stats->resized_bytes = resized_bytes;
+        stats->encoded_bytes = result.bytes.size();
+    }
+    return result;
+}
+
+struct PipelineResult {
+    std::string image_base64;
+    Plan plan;
+};
+
+// Plan and run the operations on one base64 image
+inline PipelineResult run_pipeline(const std::string& input_base64, const std::vector<Operation>& operations,
+                                   ResizeStats* stats = nullptr) {
+    std::vector<uint8_t> data = base64_decode(input_base64);
+    if (data.empty()) {
+        throw std::invalid_argument("Invalid or empty base64 input");
+    }
+
+    EncodedImage encoded = execute_pipeline(data, operations, stats);
+    PipelineResult result;
+    result.image_base64 = base64_encode(encoded.bytes.data(), encoded.bytes.size());
+    result.plan = std::move(encoded.plan);
+    if (stats) stats->output_bytes = result.image_base64.size();
+    return result;
+}
+
+}
@@ -0,0 +1,210 @@
+#pragma once
+
+#include <sys/mman.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace resizer {
+
+enum class HugePageMode {
+    off,          // plain 4 KB pages
+    transparent,  // 2 MB aligned mappings with madvise(MADV_HUGEPAGE)
+    explicit_     // MAP_HUGETLB from the reserved hugetlbfs pool, THP fallback
+};
+
+inline HugePageMode parse_huge_page_mode(const std::string& value) {
+    if (value == "off") return HugePageMode::off;
+    if (value == "thp") return HugePageMode::transparent;
+    if (value == "hugetlb") return HugePageMode::explicit_;
+    throw std::invalid_argument("huge page mode must be off, thp or hugetlb, got '" + value + "'");
+}
+
+// Recycles the large pixel buffers behind decoded and resized frames. Frames
+// of 50-150 MB would otherwise be mmap'd and faulted in 4 KB at a time on
+// every request; pooled buffers are huge-page backed and already resident.
+class PixelBufferPool {
+public:
+    static constexpr size_t huge_page_size = 2 * 1024 * 1024;
+
+    struct Options {
+        HugePageMode mode = HugePageMode::transparent;
+        // Requests below this size are left to the regular allocator
+        size_t min_buffer_bytes = 8 * 1024 * 1024;
+        // Idle buffers beyond this total are unmapped instead of kept
+        size_t max_cached_bytes = 512 * 1024 * 1024;
+    };
+
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        size_t mapped_bytes = 0;
+        size_t cached_bytes = 0;
+        size_t huge_tlb_maps = 0;
+    };
+
+    // Owns one buffer while a frame is alive and hands it back on destruction
+    class Lease {
+    public:
+        Lease() = default;
+        Lease(PixelBufferPool* owner, uint8_t* data, size_t capacity)
+            : owner_(owner), data_(data), capacity_(capacity) {}
+        Lease(Lease&& other) noexcept { *this = std::move(other); }
+        Lease& operator=(Lease&& other) noexcept {
+            if (this != &other) {
+                reset();
+                owner_ = std::exchange(other.owner_, nullptr);
+                data_ = std::exchange(other.data_, nullptr);
+                capacity_ = std::exchange(other.capacity_, 0);
+            }
+            return *this;
+        }
+        ~Lease() { reset(); }
+
+        uint8_t* data() const { return data_; }
+        size_t capacity() const { return capacity_; }
+        explicit operator bool() const { return data_ != nullptr; }
+
+        void reset() {
+            if (owner_ && data_) owner_->release(data_, capacity_);
+            owner_ = nullptr;
+            data_ = nullptr;
+            capacity_ = 0;
+        }
+
+    private:
+        PixelBufferPool* owner_ = nullptr;
+        uint8_t* data_ = nullptr;
+        size_t capacity_ = 0;
+    };
+
+    PixelBufferPool() = default;
+    explicit PixelBufferPool(const Options& options) : options_(options) {}
+
+    ~PixelBufferPool() {
+        for (auto& entry : free_) unmap(entry.second, entry.first);
+    }
+
+    PixelBufferPool(const PixelBufferPool&) = delete;
+    PixelBufferPool& operator=(const PixelBufferPool&) = delete;
+
+    void configure(const Options& options) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        options_ = options;
+    }
+
+    Options options() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return options_;
+    }
+
+    // Returns an empty lease when the pool is off or the buffer is small;
+    // callers then let cv::Mat allocate as usual.
+    Lease acquire(size_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (options_.mode == HugePageMode::off || bytes < options_.min_buffer_bytes) return {};
+
+        size_t capacity = round_up(bytes);
+        auto it = free_.lower_bound(capacity);
+        // Best fit, but do not hand a 150 MB buffer to a 10 MB frame
+        if (it != free_.end() && it->first <= capacity * 2) {
+            Lease lease(this, it->second, it->first);
+            stats_.cached_bytes -= it->first;
+            stats_.hits++;
+            free_.erase(it);
+            return lease;
+        }
+
+        stats_.misses++;
+        uint8_t* data = map(capacity);
+        return Lease(this, data, capacity);
+    }
+
+    // Map and touch buffers up front so the first large requests after
+    // start-up do not pay for page faults.
+    void prefault(size_t count, size_t bytes) {
+        std::vector<Lease> warm;
+        for (size_t i = 0; i < count; ++i) {
+            Lease lease = acquire(bytes);
+            if (!lease) return;
+            for (size_t offset = 0; offset < lease.capacity(); offset += 4096) {
+                lease.data()[offset] = 0;
+            }
+            warm.push_back(std::move(lease));
+        }
+    }
+
+    Stats stats() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return stats_;
+    }
+
+private:
+    static size_t round_up(size_t bytes) {
+        return (bytes + huge_page_size - 1) / huge_page_size * huge_page_size;
+    }
+
+    // Called with mutex_ held
+    uint8_t* map(size_t capacity) {
+        if (options_.mode == HugePageMode::explicit_) {
+            void* p = mmap(nullptr, capacity, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (p != MAP_FAILED) {
+                stats_.mapped_bytes += capacity;
+                stats_.huge_tlb_maps++;
+                return static_cast<uint8_t*>(p);
+            }
+            // No reserved huge pages left: fall through to THP
+        }
+
+        // Over-map by one huge page so the buffer can start on a 2 MB boundary
+        size_t span = capacity + huge_page_size;
+        void* p = mmap(nullptr, span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) throw std::bad_alloc();
+
+        uintptr_t raw = reinterpret_cast<uintptr_t>(p);
+        uintptr_t aligned = (raw + huge_page_size - 1) & ~(uintptr_t(huge_page_size) - 1);
+        if (aligned > raw) munmap(p, aligned - raw);
+        size_t tail = raw + span - (aligned + capacity);
+        if (tail > 0) munmap(reinterpret_cast<void*>(aligned + capacity), tail);
+
+        madvise(reinterpret_cast<void*>(aligned), capacity, MADV_HUGEPAGE);
+        stats_.mapped_bytes += capacity;
+        return reinterpret_cast<uint8_t*>(aligned);
+    }
+
+    void unmap(uint8_t* data, size_t capacity) {
+        munmap(data, capacity);
+        stats_.mapped_bytes -= capacity;
+    }
+
+    void release(uint8_t* data, size_t capacity) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stats_.cached_bytes + capacity > options_.max_cached_bytes) {
+            unmap(data, capacity);
+            return;
+        }
+        free_.emplace(capacity, data);
+        stats_.cached_bytes += capacity;
+    }
+
+    mutable std::mutex mutex_;
+    Options options_;
+    Stats stats_;
+    std::multimap<size_t, uint8_t*> free_;
+};
+
+// Process-wide pool shared by all worker threads
+inline PixelBufferPool& pixel_pool() {
+    static PixelBufferPool pool;
+    return pool;
+}
+
+}
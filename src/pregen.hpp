@@ -0,0 +1,154 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <iterator>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "url_api.hpp"
+
+namespace resizer {
+
+// Decides which thumbnails of a source are worth rendering before anyone
+// asks for them: a configured list plus the specs requested most often
+// recently. Rendering itself is left to the caller.
+class PregenPlanner {
+public:
+    struct Options {
+        // Always generated, e.g. "256x0.jpg,1024x0.webp"
+        std::vector<ThumbnailSpec> configured;
+        // Most requested specs added on top of the configured ones; 0 disables learning
+        size_t learned_top_k = 0;
+        // A spec must have been requested this often to be learned
+        uint64_t learned_min_requests = 3;
+        // Counts are halved every this many requests so the set follows shifts in demand
+        uint64_t decay_interval = 10000;
+        // Sources remembered as already pre-generated
+        size_t remembered_sources = 65536;
+    };
+
+    struct Stats {
+        uint64_t scheduled = 0;
+        uint64_t generated = 0;
+        uint64_t skipped = 0;
+        uint64_t dropped = 0;
+        uint64_t failed = 0;
+    };
+
+    PregenPlanner() = default;
+    explicit PregenPlanner(Options options) : options_(std::move(options)) {}
+
+    bool enabled() const { return !options_.configured.empty() || options_.learned_top_k > 0; }
+
+    // Count one client request for a spec
+    void record(const ThumbnailSpec& spec) {
+        if (options_.learned_top_k == 0) return;
+        std::lock_guard<std::mutex> lock(mutex_);
+        counts_[format_thumbnail_spec(spec)]++;
+        if (options_.decay_interval > 0 && ++recorded_ % options_.decay_interval == 0) {
+            for (auto it = counts_.begin(); it != counts_.end();) {
+                it->second /= 2;
+                it = it->second == 0 ? counts_.erase(it) : std::next(it);
+            }
+        }
+    }
+
+    // True exactly once per source (until it is forgotten again), on upload
+    // or on the first request that names it
+    bool first_sight(const std::string& hash) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (seen_.count(hash)) return false;
+        // Forgetting everything at once is crude but bounded; the worst case
+        // is one more round of cache lookups for sources seen before
+        if (seen_.size() >= options_.remembered_sources) seen_.clear();
+        seen_.insert(hash);
+        return true;
+    }
+
+    // Configured specs followed by the learned ones, without duplicates
+    std::vector<ThumbnailSpec> specs() {
+        std::vector<ThumbnailSpec> result = options_.configured;
+        if (options_.learned_top_k == 0) return result;
+
+        std::vector<std::pair<uint64_t, std::string>> ranked;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (const auto& [text, count] : counts_) {
+                if (count >= options_.learned_min_requests) ranked.emplace_back(count, text);
+            }
+        }
+        std::sort(ranked.begin(), ranked.end(), [](const auto& a, const auto& b) {
+            return a.first != b.first ? a.first > b.first : a.second < b.second;
+        });
+
+        size_t learned = 0;
+        for (const auto& [count, text] : ranked) {
+            if (learned == options_.learned_top_k) break;
+            ThumbnailSpec spec;
+            if (!parse_thumbnail_spec(text, spec)) continue;
+            bool duplicate = std::any_of(result.begin(), result.end(), [&](const ThumbnailSpec& s) {
+                return format_thumbnail_spec(s) == text;
+            });
+            if (duplicate) continue;
+            result.push_back(spec);
+            ++learned;
+        }
+        return result;
+    }
+
+    Stats stats() const {
+        Stats s;
+        s.scheduled = scheduled_.load(std::memory_order_relaxed);
+        s.generated = generated_.load(std::memory_order_relaxed);
+        s.skipped = skipped_.load(std::memory_order_relaxed);
+        s.dropped = dropped_.load(std::memory_order_relaxed);
+        s.failed = failed_.load(std::memory_order_relaxed);
+        return s;
+    }
+
+    // Outcome counters, bumped by whoever runs the jobs
+    void count_scheduled() { scheduled_.fetch_add(1, std::memory_order_relaxed); }
+    void count_generated() { generated_.fetch_add(1, std::memory_order_relaxed); }
+    void count_skipped() { skipped_.fetch_add(1, std::memory_order_relaxed); }
+    void count_dropped() { dropped_.fetch_add(1, std::memory_order_relaxed); }
+    void count_failed() { failed_.fetch_add(1, std::memory_order_relaxed); }
+
+private:
+    Options options_;
+    std::mutex mutex_;
+    std::unordered_map<std::string, uint64_t> counts_;
+    std::unordered_set<std::string> seen_;
+    uint64_t recorded_ = 0;
+    std::atomic<uint64_t> scheduled_{0};
+    std::atomic<uint64_t> generated_{0};
+    std::atomic<uint64_t> skipped_{0};
+    std::atomic<uint64_t> dropped_{0};
+    std::atomic<uint64_t> failed_{0};
+};
+
+// Comma separated thumbnail specs such as "256x0.jpg,1024x0.webp"
+inline std::vector<ThumbnailSpec> parse_thumbnail_specs(const std::string& text) {
+    std::vector<ThumbnailSpec> specs;
+    size_t start = 0;
+    while (start <= text.size()) {
+        size_t end = text.find(',', start);
+        if (end == std::string::npos) end = text.size();
+        std::string item = text.substr(start, end - start);
+        if (!item.empty()) {
+            ThumbnailSpec spec;
+            if (!parse_thumbnail_spec(item, spec)) throw std::invalid_argument("invalid thumbnail spec '" + item + "'");
+            specs.push_back(spec);
+        }
+        start = end + 1;
+    }
+    return specs;
+}
+
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+// USDT probes for tracing a running server with bpftrace or perf without
+// rebuilding or restarting it, e.g.
+//
+//   bpftrace -e 'usdt:/usr/local/bin/resize_server:resizer:decode_done
+//                { @mp = hist(arg0 * arg1 / 1000000) }'
+//
+// Each probe compiles to a single nop plus an ELF note; the tracer patches
+// the nop while attached, so a server nobody is tracing pays nothing beyond
+// keeping the arguments live. Probes:
+//
+//   request_start(endpoint, tenant)
+//   request_done(endpoint, status, duration_ns)
+//   stage_entry(stage), stage_exit(stage)       stage name strings
+//   resize_start(input_bytes, width, height)    base64 in, largest target
+//   resize_done(output_bytes)                   base64 out, all targets
+//   decode_done(source_width, source_height, decoded_width, decoded_height, input_bytes)
+//   resize_frame_done(input_width, input_height, target_width, target_height)
+//   encode_done(width, height, output_bytes)
+//
+// Built without <sys/sdt.h> (systemtap-sdt-dev) or with
+// -DRESIZER_DISABLE_PROBES the arguments are not evaluated, only named so
+// that values computed for a probe do not warn as unused.
+#if !defined(RESIZER_DISABLE_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define RESIZER_PROBES_ENABLED 1
+#endif
+#endif
+
+#ifdef RESIZER_PROBES_ENABLED
+#define RESIZER_PROBE(name, ...) STAP_PROBEV(resizer, name, __VA_ARGS__)
+#else
+#define RESIZER_PROBE(name, ...) ((void)sizeof((__VA_ARGS__, 0)))
+#endif
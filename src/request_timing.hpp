@@ -0,0 +1,182 @@
+#pragma once
+
+#include <time.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+#include "perf_counters.hpp"
+#include "probes.hpp"
+
+namespace resizer {
+
+// Where a request's time went: wall time per pipeline stage, summed over
+// every worker job and batch item of the request, plus the worker thread CPU
+// time it consumed. Reported to the client as Server-Timing.
+enum class Stage { queue, decode, resize, encode, serialize };
+constexpr size_t stage_count = 5;
+
+inline const char* stage_name(Stage stage) {
+    static const char* names[stage_count] = {"queue", "decode", "resize", "encode", "serialize"};
+    return names[static_cast<size_t>(stage)];
+}
+
+inline int64_t thread_cpu_ns() {
+    timespec ts{};
+    ::clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+class RequestTiming {
+public:
+    // Atomic because batch items of one request run on several workers at once
+    void add(Stage stage, std::chrono::nanoseconds elapsed) {
+        stages_[static_cast<size_t>(stage)].fetch_add(elapsed.count(), std::memory_order_relaxed);
+    }
+    void add_cpu(int64_t ns) { cpu_ns_.fetch_add(ns, std::memory_order_relaxed); }
+
+    double seconds(Stage stage) const {
+        return stages_[static_cast<size_t>(stage)].load(std::memory_order_relaxed) / 1e9;
+    }
+    double cpu_seconds() const { return cpu_ns_.load(std::memory_order_relaxed) / 1e9; }
+
+    // "queue;dur=0.1, decode;dur=3.2, ..., cpu;dur=6.5, total;dur=8.0" in
+    // milliseconds; stages the request never entered are left out
+    std::string server_timing(std::chrono::nanoseconds total) const {
+        std::string header;
+        char item[64];
+        for (size_t i = 0; i < stage_count; ++i) {
+            int64_t ns = stages_[i].load(std::memory_order_relaxed);
+            if (ns == 0) continue;
+            std::snprintf(item, sizeof(item), "%s;dur=%.2f, ", stage_name(static_cast<Stage>(i)), ns / 1e6);
+            header += item;
+        }
+        int64_t cpu = cpu_ns_.load(std::memory_order_relaxed);
+        if (cpu > 0) {
+            std::snprintf(item, sizeof(item), "cpu;dur=%.2f, ", cpu / 1e6);
+            header += item;
+        }
+        std::snprintf(item, sizeof(item), "total;dur=%.2f", total.count() / 1e6);
+        return header + item;
+    }
+
+private:
+    std::array<std::atomic<int64_t>, stage_count> stages_{};
+    std::atomic<int64_t> cpu_ns_{0};
+};
+
+namespace detail {
+
+// Set on a worker thread while it runs a job for a timed request
+inline RequestTiming*& worker_timing() {
+    thread_local RequestTiming* timing = nullptr;
+    return timing;
+}
+
+}
+
+// Binds a worker thread to the request whose job it is running, and
+// charges the thread CPU time used meanwhile to that request
+class WorkerTimingBinding {
+public:
+    explicit WorkerTimingBinding(RequestTiming* timing)
+        : timing_(timing), previous_(detail::worker_timing()), cpu_start_(thread_cpu_ns()) {
+        detail::worker_timing() = timing;
+    }
+    ~WorkerTimingBinding() {
+        timing_->add_cpu(thread_cpu_ns() - cpu_start_);
+        detail::worker_timing() = previous_;
+    }
+    WorkerTimingBinding(const WorkerTimingBinding&) = delete;
+    WorkerTimingBinding& operator=(const WorkerTimingBinding&) = delete;
+
+private:
+    RequestTiming* timing_;
+    RequestTiming* previous_;
+    int64_t cpu_start_;
+};
+
+// Hardware counter totals per stage over all requests while perf counters
+// are enabled, with the source megapixels decoded meanwhile, so the cost of a
+// stage can be put per image area: IPC = instructions / cycles, and misses
+// per megapixel = misses / megapixels.
+class StageCounters {
+public:
+    struct Totals {
+        std::array<PerfSample, stage_count> stages;
+        uint64_t source_pixels = 0;
+        double megapixels() const { return source_pixels / 1e6; }
+    };
+
+    void add(Stage stage, const PerfSample& sample) {
+        auto& counts = stages_[static_cast<size_t>(stage)];
+        counts[0].fetch_add(sample.cycles, std::memory_order_relaxed);
+        counts[1].fetch_add(sample.instructions, std::memory_order_relaxed);
+        counts[2].fetch_add(sample.llc_misses, std::memory_order_relaxed);
+        counts[3].fetch_add(sample.branch_misses, std::memory_order_relaxed);
+    }
+    void add_source_pixels(uint64_t pixels) { source_pixels_.fetch_add(pixels, std::memory_order_relaxed); }
+
+    Totals totals() const {
+        Totals totals;
+        for (size_t i = 0; i < stage_count; ++i) {
+            totals.stages[i].cycles = stages_[i][0].load(std::memory_order_relaxed);
+            totals.stages[i].instructions = stages_[i][1].load(std::memory_order_relaxed);
+            totals.stages[i].llc_misses = stages_[i][2].load(std::memory_order_relaxed);
+            totals.stages[i].branch_misses = stages_[i][3].load(std::memory_order_relaxed);
+        }
+        totals.source_pixels = source_pixels_.load(std::memory_order_relaxed);
+        return totals;
+    }
+
+    void reset() {
+        for (auto& counts : stages_) {
+            for (auto& count : counts) count.store(0, std::memory_order_relaxed);
+        }
+        source_pixels_.store(0, std::memory_order_relaxed);
+    }
+
+private:
+    std::array<std::array<std::atomic<uint64_t>, 4>, stage_count> stages_{};
+    std::atomic<uint64_t> source_pixels_{0};
+};
+
+inline StageCounters& stage_counters() {
+    static StageCounters instance;
+    return instance;
+}
+
+// Adds the wall time of its scope to a stage of the request the worker
+// thread is running a job for; does nothing outside such a job. With perf
+// counters enabled it also adds the thread's hardware counts to the stage's
+// process-wide totals, inside a job or not.
+class StageTimer {
+public:
+    explicit StageTimer(Stage stage)
+        : stage_(stage), timing_(detail::worker_timing()), perf_(detail::thread_perf_group()) {
+        RESIZER_PROBE(stage_entry, stage_name(stage_));
+        if (timing_) start_ = std::chrono::steady_clock::now();
+        if (perf_ && !perf_->read(perf_start_)) perf_ = nullptr;
+    }
+    ~StageTimer() {
+        RESIZER_PROBE(stage_exit, stage_name(stage_));
+        PerfReading perf_end;
+        if (perf_ && perf_->read(perf_end)) stage_counters().add(stage_, perf_delta(perf_start_, perf_end));
+        if (timing_) timing_->add(stage_, std::chrono::steady_clock::now() - start_);
+    }
+    StageTimer(const StageTimer&) = delete;
+    StageTimer& operator=(const StageTimer&) = delete;
+
+private:
+    Stage stage_;
+    RequestTiming* timing_;
+    std::chrono::steady_clock::time_point start_;
+    PerfCounterGroup* perf_;
+    PerfReading perf_start_;
+};
+
+}
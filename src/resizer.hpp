@@ -0,0 +1,450 @@
+#pragma once
+
+#include <boost/algorithm/string.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Base64 encoding/decoding utilities using Boost
+#include <boost/archive/iterators/base64_from_binary.hpp>
+#include <boost/archive/iterators/binary_from_base64.hpp>
+#include <boost/archive/iterators/transform_width.hpp>
+
+#include "blurhash.hpp"
+#include "jpeg_decoder.hpp"
+#include "jpeg_encoder.hpp"
+#include "jpeg_metadata.hpp"
+#include "jpeg_probe.hpp"
+#include "pixel_pool.hpp"
+#include "probes.hpp"
+#include "request_timing.hpp"
+
+namespace resizer {
+
+// Decode base64 string to binary data
+inline std::vector<uint8_t> base64_decode(const std::string& encoded) {
+        StageTimer timer(Stage::serialize);
+
+        try {
+            using namespace boost::archive::iterators;
+            using It = transform_width<binary_from_base64<std::string::const_iterator>, 8, 6>;
+            
+            // Remove padding characters for proper decoding
+            std::string clean = encoded;
+            boost::trim(clean);
+            clean.erase(std::remove(clean.begin(), clean.end(), '\n'), clean.end());
+            clean.erase(std::remove(clean.begin(), clean.end(), '\r'), clean.end());
+            
+            if (clean.empty()) return {};
+            
+            size_t padding = 0;
+            if (!clean.empty()) {
+                if (clean[clean.size() - 1] == '=') padding++;
+                if (clean.size() > 1 && clean[clean.size() - 2] == '=') padding++;
+            }
+            
+            std::vector<uint8_t> result(It(clean.begin()), It(clean.end()));
+            result.erase(result.end() - padding, result.end());
+            
+            return result;
+        } catch (const std::exception& e) {
+            throw std::runtime_error(e.what());
+        }
+}
+
+// Encode binary data to base64 string
+inline std::string base64_encode(const unsigned char* data, size_t len) {
+    StageTimer timer(Stage::serialize);
+    using namespace boost::archive::iterators;
+    using It = base64_from_binary<transform_width<const unsigned char*, 6, 8>>;
+    
+    std::string result(It(data), It(data + len));
+    
+    // Add padding
+    size_t padding = (3 - len % 3) % 3;
+    result.append(padding, '=');
+    
+    return result;
+}
+
+// Sizes of the buffers one resize_jpeg call holds. They are all alive when
+// the output is base64 encoded, so their sum is the call's peak. With several
+// targets the resized frame is the largest one and the encoded and output
+// sizes are totals, so the sum stays an upper bound.
+struct ResizeStats {
+    size_t compressed_bytes = 0;
+    size_t decoded_bytes = 0;
+    size_t resized_bytes = 0;
+    size_t encoded_bytes = 0;
+    size_t output_bytes = 0;
+
+    uint64_t peak_bytes() const {
+        return uint64_t(compressed_bytes) + decoded_bytes + resized_bytes + encoded_bytes + output_bytes;
+    }
+};
+
+// Decode only enough base64 to read the frame header. SOF normally sits in
+// the first few KB, but large EXIF or ICC segments can push it further out.
+inline bool probe_base64_jpeg(const std::string& input_base64, JpegHeader& header) {
+    for (size_t chars : {size_t(16 * 1024), size_t(256 * 1024)}) {
+        std::string prefix;
+        prefix.reserve(chars);
+        for (char c : input_base64) {
+            if (prefix.size() == chars) break;
+            if (!std::isspace(static_cast<unsigned char>(c))) prefix.push_back(c);
+        }
+        bool whole_input = prefix.size() < chars;
+        if (!whole_input) prefix.resize(prefix.size() / 4 * 4);
+        
+        try {
+            std::vector<uint8_t> bytes = base64_decode(prefix);
+            if (probe_jpeg(bytes.data(), bytes.size(), header)) return true;
+        } catch (const std::exception&) {
+            return false;
+        }
+        if (whole_input) return false;
+    }
+    return false;
+}
+
+// True when the source can be returned as-is: the target equals the source
+// size, or no_upscale is set and the source already fits inside the target.
+// Only for upright three-component (YCbCr) images, since a resize applies
+// EXIF orientation and always outputs colour: returning grayscale or CMYK
+// bytes would differ from what the same request gets at any other size.
+inline bool can_pass_through(const JpegHeader& header, int target_width, int target_height, bool no_upscale) {
+    if (header.orientation != 1 || header.components != 3) return false;
+    if (header.width == target_width && header.height == target_height) return true;
+    return no_upscale && header.width <= target_width && header.height <= target_height;
+}
+
+// Original bytes with metadata segments removed in the compressed domain
+inline std::string strip_metadata_base64(const std::string& input_base64) {
+    std::vector<uint8_t> jpeg_data = base64_decode(input_base64);
+    std::vector<uint8_t> stripped = strip_jpeg_metadata(jpeg_data.data(), jpeg_data.size());
+    return base64_encode(stripped.data(), stripped.size());
+}
+
+struct TargetSize {
+    int width = 0;
+    int height = 0;
+};
+
+inline void validate_target(const TargetSize& target) {
+    if (target.width <= 0 || target.height <= 0) {
+        throw std::invalid_argument("Target dimensions must be positive integers");
+    }
+    
+    if (target.width > 65500 || target.height > 65500) {
+        throw std::invalid_argument("Target dimensions exceed maximum JPEG size");
+    }
+}
+
+// Smallest size covering every target, used to pick one decode scale
+inline TargetSize covering_target(const std::vector<TargetSize>& targets) {
+    TargetSize cover;
+    for (const auto& target : targets) {
+        cover.width = std::max(cover.width, target.width);
+        cover.height = std::max(cover.height, target.height);
+    }
+    return cover;
+}
+
+namespace detail {
+
+// Pixel and output memory for compressed bytes of JPEG: the decoded frame,
+// counted once at the DCT scale decode_source will pick for the covering
+// target, the largest resized frame (only one is alive at a time) and every
+// output. When the header could not be read, assume a 10:1 compression ratio.
+inline uint64_t estimate_pixel_bytes(uint64_t compressed, const JpegHeader* header,
+                                     const std::vector<TargetSize>& targets) {
+    TargetSize cover = covering_target(targets);
+    uint64_t decoded = compressed * 10;
+    if (header) {
+        uint64_t denom = choose_scale_denom(*header, cover.width, cover.height);
+        decoded = ((header->width + denom - 1) / denom) * ((header->height + denom - 1) / denom) * 3;
+        // Turning a sideways frame upright transposes it into a second one
+        if (header->orientation >= 5) decoded *= 2;
+    }
+    
+    uint64_t largest_resized = 0;
+    uint64_t outputs = 0;
+    for (const auto& target : targets) {
+        uint64_t resized = uint64_t(std::max(target.width, 0)) * std::max(target.height, 0) * 3;
+        // Quality 85 output stays well under a third of the raw pixels
+        uint64_t encoded = resized / 3;
+        uint64_t output = encoded / 3 * 4;
+        largest_resized = std::max(largest_resized, resized);
+        // The output twice: base64 plus the response body
+        outputs += encoded + 2 * output;
+    }
+    return decoded + largest_resized + outputs;
+}
+
+}
+
+// Upper bound on the memory a request holds from parsing to response: the
+// base64 input, the JPEG decoded from it, and the frames and outputs above
+inline uint64_t estimate_peak_bytes(size_t input_base64_size, const JpegHeader* header,
+                                    const std::vector<TargetSize>& targets) {
+    uint64_t compressed = input_base64_size / 4 * 3;
+    return input_base64_size + compressed + detail::estimate_pixel_bytes(compressed, header, targets);
+}
+
+inline uint64_t estimate_peak_bytes(size_t input_base64_size, const JpegHeader* header,
+                                    int target_width, int target_height) {
+    return estimate_peak_bytes(input_base64_size, header, {TargetSize{target_width, target_height}});
+}
+
+// The same bound for a request body that is the JPEG itself, decoded in place
+inline uint64_t estimate_binary_peak_bytes(size_t input_size, const JpegHeader* header,
+                                           const std::vector<TargetSize>& targets) {
+    return input_size + detail::estimate_pixel_bytes(input_size, header, targets);
+}
+
+// Decode to an upright BGR frame no smaller than the target where possible.
+// JPEGs go through the cost-limited decoder, scaled down inside the IDCT by
+// the largest factor that keeps the target reachable (progressive files at
+// 1/8 only read their DC scan), into pooled huge-page memory for large
+// frames. Anything else is left to OpenCV's other codecs.
+inline cv::Mat decode_source(const uint8_t* data, size_t size, int target_width, int target_height,
+                             PixelBufferPool::Lease& lease) {
+    StageTimer timer(Stage::decode);
+    cv::Mat image;
+    JpegHeader header;
+    int source_width = 0, source_height = 0;
+    if (probe_jpeg(data, size, header)) {
+        source_width = header.width;
+        source_height = header.height;
+        enforce_declared_size(header.width, header.height, decode_limits());
+        if (perf_counters_enabled()) stage_counters().add_source_pixels(uint64_t(header.width) * header.height);
+        int denom = choose_scale_denom(header, target_width, target_height);
+        int width = (header.width + denom - 1) / denom;
+        int height = (header.height + denom - 1) / denom;
+        lease = pixel_pool().acquire(size_t(width) * height * 3);
+        if (lease) image = cv::Mat(height, width, CV_8UC3, lease.data());
+        
+        decode_jpeg(data, size, decode_limits(), image, denom);
+        apply_exif_orientation(image, header.orientation);
+    } else {
+        // imdecode only reads its input
+        image = cv::imdecode(cv::Mat(1, static_cast<int>(size), CV_8UC1, const_cast<uint8_t*>(data)), cv::IMREAD_COLOR);
+        if (perf_counters_enabled()) stage_counters().add_source_pixels(image.total());
+        source_width = image.cols;
+        source_height = image.rows;
+    }
+    
+    if (image.empty()) {
+        throw std::runtime_error("Failed to decode JPEG image - invalid format or corrupted data");
+    }
+    RESIZER_PROBE(decode_done, source_width, source_height, image.cols, image.rows, size);
+    return image;
+}
+
+inline cv::Mat decode_source(const std::vector<uint8_t>& jpeg_data, int target_width, int target_height,
+                             PixelBufferPool::Lease& lease) {
+    return decode_source(jpeg_data.data(), jpeg_data.size(), target_width, target_height, lease);
+}
+
+// Resize a decoded frame into pooled memory. A scaled decode can land exactly
+// on the target, in which case the input is returned without a copy.
+inline cv::Mat resize_frame(const cv::Mat& input_image, const TargetSize& target, PixelBufferPool::Lease& lease) {
+    if (input_image.cols == target.width && input_image.rows == target.height) return input_image;
+    
+    StageTimer timer(Stage::resize);
+    cv::Mat resized_image;
+    lease = pixel_pool().acquire(size_t(target.width) * target.height * 3);
+    if (lease) resized_image = cv::Mat(target.height, target.width, CV_8UC3, lease.data());
+    cv::resize(input_image, resized_image, cv::Size(target.width, target.height), 
+               0, 0, cv::INTER_AREA);
+    RESIZER_PROBE(resize_frame_done, input_image.cols, input_image.rows, target.width, target.height);
+    return resized_image;
+}
+
+// A frame transposed upright no longer lives in its lease, and both are held
+// until the request is done
+inline size_t decoded_frame_bytes(const cv::Mat& image, const PixelBufferPool::Lease& lease) {
+    size_t frame = image.total() * image.elemSize();
+    if (!lease) return frame;
+    return image.data == lease.data() ? lease.capacity() : lease.capacity() + frame;
+}
+
+inline size_t resized_frame_bytes(const cv::Mat& input_image, const cv::Mat& resized_image,
+                                  const PixelBufferPool::Lease& lease) {
+    if (lease) return lease.capacity();
+    return resized_image.data == input_image.data ? 0 : resized_image.total() * resized_image.elemSize();
+}
+
+// Resize one decoded frame and encode it as a base64 JPEG. Stats accumulate
+// so several targets of one source can share a ResizeStats.
+inline std::string encode_target(const cv::Mat& input_image, const TargetSize& target, ResizeStats* stats) {
+    PixelBufferPool::Lease output_lease;
+    cv::Mat resized_image = resize_frame(input_image, target, output_lease);
+    
+    // Same settings cv::imencode was given (quality 85, optimised Huffman
+    // tables), but the encoder's flushes go straight into base64, so no
+    // buffer of the whole compressed image is ever held
+    StageTimer timer(Stage::encode);
+    EncodeOptions options;
+    options.optimize = true;
+    std::string output;
+    Base64Writer writer(output);
+    size_t encoded_bytes = 0;
+    encode_jpeg(resized_image, options, [&](const uint8_t* data, size_t size) {
+        encoded_bytes += size;
+        writer.write(data, size);
+    });
+    writer.finish();
+    RESIZER_PROBE(encode_done, resized_image.cols, resized_image.rows, encoded_bytes);
+    
+    if (stats) {
+        stats->resized_bytes = std::max(stats->resized_bytes, resized_frame_bytes(input_image, resized_image, output_lease));
+        stats->encoded_bytes += options.flush_bytes;
+        stats->output_bytes += output.size();
+    }
+    return output;
+}
+
+// Decode once, at the scale covering the largest target, and produce one
+// base64 JPEG per target in the same order
+inline std::vector<std::string> resize_jpeg_targets(const std::string& input_base64,
+                                                    const std::vector<TargetSize>& targets,
+                                                    ResizeStats* stats = nullptr) {
+    if (targets.empty()) {
+        throw std::invalid_argument("At least one target size is required");
+    }
+    for (const auto& target : targets) validate_target(target);
+    
+    TargetSize cover = covering_target(targets);
+    RESIZER_PROBE(resize_start, input_base64.size(), cover.width, cover.height);
+    std::vector<uint8_t> jpeg_data = base64_decode(input_base64);
+    
+    if (jpeg_data.empty()) {
+        throw std::invalid_argument("Invalid or empty base64 input");
+    }
+    
+    PixelBufferPool::Lease input_lease;
+    cv::Mat input_image = decode_source(jpeg_data, cover.width, cover.height, input_lease);
+    if (stats) {
+        *stats = ResizeStats{};
+        stats->compressed_bytes = jpeg_data.size();
+        stats->decoded_bytes = decoded_frame_bytes(input_image, input_lease);
+    }
+    
+    std::vector<std::string> outputs;
+    outputs.reserve(targets.size());
+    size_t output_bytes = 0;
+    for (const auto& target : targets) {
+        outputs.push_back(encode_target(input_image, target, stats));
+        output_bytes += outputs.back().size();
+    }
+    RESIZER_PROBE(resize_done, output_bytes);
+    return outputs;
+}
+
+// Core image resizing function using OpenCV
+inline std::string resize_jpeg(const std::string& input_base64, int target_width, int target_height,
+                               ResizeStats* stats = nullptr) {
+    return std::move(resize_jpeg_targets(input_base64, {TargetSize{target_width, target_height}}, stats).front());
+}
+
+// Resize raw JPEG bytes and hand the encoded output to sink stripe by stripe,
+// without building the whole output in memory first. The input is only read,
+// so a request body can be passed as it is.
+inline void resize_jpeg_to_sink(const uint8_t* jpeg_data, size_t jpeg_size, const TargetSize& target,
+                                const EncodeOptions& options, const ByteSink& sink, ResizeStats* stats = nullptr) {
+    validate_target(target);
+    if (jpeg_size == 0) {
+        throw std::invalid_argument("Empty image input");
+    }
+    
+    PixelBufferPool::Lease input_lease;
+    cv::Mat input_image = decode_source(jpeg_data, jpeg_size, target.width, target.height, input_lease);
+    PixelBufferPool::Lease output_lease;
+    cv::Mat resized_image = resize_frame(input_image, target, output_lease);
+    
+    size_t encoded_bytes = 0;
+    StageTimer timer(Stage::encode);
+    encode_jpeg(resized_image, options, [&](const uint8_t* data, size_t size) {
+        encoded_bytes += size;
+        sink(data, size);
+    });
+    RESIZER_PROBE(encode_done, resized_image.cols, resized_image.rows, encoded_bytes);
+    
+    if (stats) {
+        stats->compressed_bytes = jpeg_size;
+        stats->decoded_bytes = decoded_frame_bytes(input_image, input_lease);
+        stats->resized_bytes = resized_frame_bytes(input_image, resized_image, output_lease);
+        // Only one flush buffer is alive at a time; the bytes live in the sink
+        stats->encoded_bytes = options.flush_bytes;
+        stats->output_bytes = encoded_bytes;
+    }
+}
+
+inline void resize_jpeg_to_sink(const std::vector<uint8_t>& jpeg_data, const TargetSize& target,
+                                const EncodeOptions& options, const ByteSink& sink, ResizeStats* stats = nullptr) {
+    resize_jpeg_to_sink(jpeg_data.data(), jpeg_data.size(), target, options, sink, stats);
+}
+
+// Low-quality image placeholder: a tiny JPEG plus its BlurHash, for clients
+// to show while the real image loads
+struct Placeholder {
+    std::string jpeg_base64;
+    std::string blurhash;
+    int width = 0;
+    int height = 0;
+};
+
+// Fit the source into a max_side box. Decoding for a box this small takes
+// the 1/8-scale path, so the cost is dominated by entropy decoding the DC
+// coefficients.
+inline Placeholder lqip_jpeg(const std::string& input_base64, int max_side = 32, ResizeStats* stats = nullptr) {
+    if (max_side <= 0 || max_side > 256) {
+        throw std::invalid_argument("Placeholder size must be between 1 and 256");
+    }
+    
+    std::vector<uint8_t> jpeg_data = base64_decode(input_base64);
+    if (jpeg_data.empty()) {
+        throw std::invalid_argument("Invalid or empty base64 input");
+    }
+    
+    PixelBufferPool::Lease lease;
+    cv::Mat source = decode_source(jpeg_data, max_side, max_side, lease);
+    
+    double scale = std::min(1.0, double(max_side) / std::max(source.cols, source.rows));
+    Placeholder placeholder;
+    placeholder.width = std::max(1, static_cast<int>(source.cols * scale + 0.5));
+    placeholder.height = std::max(1, static_cast<int>(source.rows * scale + 0.5));
+    
+    cv::Mat tiny;
+    {
+        StageTimer timer(Stage::resize);
+        cv::resize(source, tiny, cv::Size(placeholder.width, placeholder.height), 0, 0, cv::INTER_AREA);
+    }
+    
+    std::vector<uint8_t> output_buffer;
+    {
+        StageTimer timer(Stage::encode);
+        if (!cv::imencode(".jpg", tiny, output_buffer, {cv::IMWRITE_JPEG_QUALITY, 60}) || output_buffer.empty()) {
+            throw std::runtime_error("Failed to encode placeholder image to JPEG");
+        }
+    }
+    placeholder.jpeg_base64 = base64_encode(output_buffer.data(), output_buffer.size());
+    placeholder.blurhash = blurhash_encode(tiny);
+    
+    if (stats) {
+        stats->compressed_bytes = jpeg_data.size();
+        stats->decoded_bytes = decoded_frame_bytes(source, lease);
+        stats->resized_bytes = tiny.total() * tiny.elemSize();
+        stats->encoded_bytes = output_buffer.size();
+        stats->output_bytes = placeholder.jpeg_base64.size();
+    }
+    return placeholder;
+}
+
+}
@@ -0,0 +1,327 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace resizer {
+
+// Encoded output kept by the result cache
+struct CachedResult {
+    std::string content_type;
+    std::string bytes;
+};
+
+// A cached result with its estimated request frequency, as saved across restarts
+struct CacheEntry {
+    std::string key;
+    std::shared_ptr<const CachedResult> value;
+    uint8_t frequency = 0;
+};
+
+// Approximate access counts for every key seen recently, including keys that
+// are not cached: a count-min sketch of four rows of counters saturating at
+// 15. All counters are halved once the sample is full so old popularity fades.
+class FrequencySketch {
+public:
+    explicit FrequencySketch(size_t width = 1024) {
+        size_t w = 64;
+        while (w < width) w <<= 1;
+        mask_ = w - 1;
+        table_.assign(w * rows, 0);
+        sample_size_ = 10 * w;
+    }
+
+    // Conservative update: only the smallest counters grow, which keeps
+    // collisions from inflating keys that share some of their cells
+    void increment(uint64_t hash) {
+        size_t cells[rows];
+        uint8_t lowest = max_count;
+        for (size_t row = 0; row < rows; ++row) {
+            cells[row] = index(hash, row);
+            lowest = std::min(lowest, table_[cells[row]]);
+        }
+        if (lowest == max_count) return;
+        for (size_t cell : cells) {
+            if (table_[cell] == lowest) table_[cell]++;
+        }
+        if (++additions_ >= sample_size_) age();
+    }
+
+    uint8_t estimate(uint64_t hash) const {
+        uint8_t lowest = max_count;
+        for (size_t row = 0; row < rows; ++row) lowest = std::min(lowest, table_[index(hash, row)]);
+        return lowest;
+    }
+
+private:
+    static constexpr size_t rows = 4;
+    static constexpr uint8_t max_count = 15;
+
+    size_t index(uint64_t hash, size_t row) const {
+        static constexpr uint64_t seeds[rows] = {
+            0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL, 0x165667B19E3779F9ULL, 0xD6E8FEB86659FD93ULL};
+        uint64_t h = (hash + seeds[row]) * seeds[(row + 1) % rows];
+        h ^= h >> 32;
+        return row * (mask_ + 1) + (h & mask_);
+    }
+
+    void age() {
+        for (auto& counter : table_) counter >>= 1;
+        additions_ /= 2;
+    }
+
+    std::vector<uint8_t> table_;
+    size_t mask_ = 0;
+    size_t additions_ = 0;
+    size_t sample_size_ = 0;
+};
+
+// In-memory cache of encoded results bounded by a byte budget, using
+// W-TinyLFU: new results enter a small LRU window, and a result leaving the
+// window only displaces main-area entries it is requested more often than.
+// The main area is a segmented LRU whose protected part holds results hit
+// at least twice, so a scan of one-off requests (crawlers, backfills) churns
+// through the window and probation without evicting the hot set.
+// Keys identify the output completely (source hash plus output spec), so
+// entries never go stale and are only dropped to make room.
+class ResultCache {
+public:
+    struct Stats {
+        uint64_t capacity_bytes = 0;
+        uint64_t size_bytes = 0;
+        uint64_t window_bytes = 0;
+        uint64_t probation_bytes = 0;
+        uint64_t protected_bytes = 0;
+        uint64_t entries = 0;
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t insertions = 0;
+        // Results leaving the window that were let into the main area or turned away
+        uint64_t admitted = 0;
+        uint64_t rejected = 0;
+        // Main-area results evicted in favour of an admitted one
+        uint64_t evictions = 0;
+    };
+
+    // window_percent of the capacity is the admission window; 80% of the
+    // rest is reserved for the protected segment
+    explicit ResultCache(uint64_t capacity_bytes = 0, unsigned window_percent = 1)
+        : sketch_(sketch_width(capacity_bytes)) {
+        stats_.capacity_bytes = capacity_bytes;
+        window_capacity_ = capacity_bytes * std::min(window_percent, 100u) / 100;
+        main_capacity_ = capacity_bytes - window_capacity_;
+        protected_capacity_ = main_capacity_ / 5 * 4;
+    }
+
+    ResultCache(const ResultCache&) = delete;
+    ResultCache& operator=(const ResultCache&) = delete;
+
+    // A capacity of 0 disables the cache: lookups miss and inserts are ignored
+    bool enabled() const { return stats_.capacity_bytes > 0; }
+
+    std::shared_ptr<const CachedResult> get(const std::string& key) {
+        uint64_t hash = std::hash<std::string>{}(key);
+        std::lock_guard<std::mutex> lock(mutex_);
+        sketch_.increment(hash);
+        auto it = index_.find(key);
+        if (it == index_.end()) {
+            stats_.misses++;
+            return nullptr;
+        }
+        stats_.hits++;
+        auto node = it->second;
+        switch (node->segment) {
+            case Segment::window: window_.splice(window_.begin(), window_, node); break;
+            case Segment::protect: protected_.splice(protected_.begin(), protected_, node); break;
+            case Segment::probation: promote(node); break;
+        }
+        return node->value;
+    }
+
+    // Presence check that neither counts as a lookup nor refreshes recency,
+    // for speculative work deciding whether it still has anything to do
+    bool contains(const std::string& key) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return index_.count(key) > 0;
+    }
+
+    // speculative marks results rendered ahead of demand (pre-generation),
+    // which have not been requested yet but are expected to be
+    void put(const std::string& key, std::shared_ptr<const CachedResult> value, bool speculative = false) {
+        if (!value) return;
+        uint64_t charge = entry_charge(key, *value);
+        uint64_t hash = std::hash<std::string>{}(key);
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (charge > main_capacity_) return;
+
+        auto it = index_.find(key);
+        if (it != index_.end()) {
+            remove(it->second);
+            index_.erase(it);
+        }
+        // Inserts follow a miss that was already counted; only speculative
+        // inserts arrive without one
+        if (sketch_.estimate(hash) == 0) sketch_.increment(hash);
+
+        window_.push_front(Node{key, hash, std::move(value), charge, Segment::window, speculative});
+        index_[key] = window_.begin();
+        stats_.window_bytes += charge;
+        stats_.insertions++;
+
+        while (stats_.window_bytes > window_capacity_ && !window_.empty()) {
+            auto candidate = std::prev(window_.end());
+            stats_.window_bytes -= candidate->charge;
+            admit(candidate);
+        }
+    }
+
+    // The hottest entries, protected segment first and most recent first
+    // within each segment, up to max_bytes of payload
+    std::vector<CacheEntry> snapshot(uint64_t max_bytes) {
+        std::vector<CacheEntry> entries;
+        uint64_t total = 0;
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const List* segment : {&protected_, &probation_, &window_}) {
+            for (const auto& node : *segment) {
+                if (total + node.value->bytes.size() > max_bytes) return entries;
+                total += node.value->bytes.size();
+                entries.push_back({node.key, node.value, sketch_.estimate(node.hash)});
+            }
+        }
+        return entries;
+    }
+
+    // Reload a snapshot into an empty cache, coldest first so the hottest end
+    // up most recent, with the saved frequencies so admission still favours them
+    void restore(const std::vector<CacheEntry>& entries) {
+        for (auto it = entries.rbegin(); it != entries.rend(); ++it) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                uint64_t hash = std::hash<std::string>{}(it->key);
+                for (uint8_t i = 0; i < it->frequency; ++i) sketch_.increment(hash);
+            }
+            put(it->key, it->value);
+        }
+    }
+
+    Stats stats() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Stats copy = stats_;
+        copy.entries = index_.size();
+        copy.size_bytes = stats_.window_bytes + stats_.probation_bytes + stats_.protected_bytes;
+        return copy;
+    }
+
+private:
+    enum class Segment { window, probation, protect };
+
+    struct Node {
+        std::string key;
+        uint64_t hash = 0;
+        std::shared_ptr<const CachedResult> value;
+        uint64_t charge = 0;
+        Segment segment = Segment::window;
+        bool speculative = false;
+    };
+    using List = std::list<Node>;
+
+    // One sketch column per ~16 KB of capacity, about one per thumbnail
+    static size_t sketch_width(uint64_t capacity_bytes) {
+        return static_cast<size_t>(std::min<uint64_t>(std::max<uint64_t>(capacity_bytes >> 14, 256), 1u << 24));
+    }
+
+    // Payload plus a rough allowance for the key, node and index bucket
+    static uint64_t entry_charge(const std::string& key, const CachedResult& value) {
+        return value.bytes.size() + value.content_type.size() + 2 * key.size() + 160;
+    }
+
+    uint64_t main_bytes() const { return stats_.probation_bytes + stats_.protected_bytes; }
+
+    // Move the window's LRU entry into probation if it is more popular than
+    // every main-area entry that would have to go to make room for it. Once
+    // the main area is full every entry there has been requested, so a
+    // speculative result, counted once, would lose every tie; it wins ties
+    // against entries requested only once instead, and still never displaces
+    // one requested twice.
+    void admit(List::iterator candidate) {
+        if (main_bytes() + candidate->charge > main_capacity_) {
+            uint64_t needed = main_bytes() + candidate->charge - main_capacity_;
+            uint8_t frequency = sketch_.estimate(candidate->hash);
+            uint8_t displaceable = candidate->speculative ? 1 : 0;
+
+            std::vector<List::iterator> victims;
+            uint64_t freed = 0;
+            for (List* segment : {&probation_, &protected_}) {
+                for (auto it = segment->end(); freed < needed && it != segment->begin();) {
+                    --it;
+                    uint8_t victim = sketch_.estimate(it->hash);
+                    if (victim >= frequency && victim > displaceable) {
+                        index_.erase(candidate->key);
+                        window_.erase(candidate);
+                        stats_.rejected++;
+                        return;
+                    }
+                    victims.push_back(it);
+                    freed += it->charge;
+                }
+            }
+            for (auto victim : victims) {
+                index_.erase(victim->key);
+                remove(victim);
+                stats_.evictions++;
+            }
+        }
+        candidate->segment = Segment::probation;
+        probation_.splice(probation_.begin(), window_, candidate);
+        stats_.probation_bytes += candidate->charge;
+        stats_.admitted++;
+    }
+
+    // Second hit: probation to protected, demoting protected overflow back
+    void promote(List::iterator node) {
+        stats_.probation_bytes -= node->charge;
+        stats_.protected_bytes += node->charge;
+        node->segment = Segment::protect;
+        protected_.splice(protected_.begin(), probation_, node);
+
+        while (stats_.protected_bytes > protected_capacity_ && protected_.size() > 1) {
+            auto demoted = std::prev(protected_.end());
+            stats_.protected_bytes -= demoted->charge;
+            stats_.probation_bytes += demoted->charge;
+            demoted->segment = Segment::probation;
+            probation_.splice(probation_.begin(), protected_, demoted);
+        }
+    }
+
+    // Unlink a node and its charge; the caller owns the index entry
+    void remove(List::iterator node) {
+        switch (node->segment) {
+            case Segment::window: stats_.window_bytes -= node->charge; window_.erase(node); break;
+            case Segment::probation: stats_.probation_bytes -= node->charge; probation_.erase(node); break;
+            case Segment::protect: stats_.protected_bytes -= node->charge; protected_.erase(node); break;
+        }
+    }
+
+    std::mutex mutex_;
+    FrequencySketch sketch_;
+    uint64_t window_capacity_ = 0;
+    uint64_t main_capacity_ = 0;
+    uint64_t protected_capacity_ = 0;
+    List window_;
+    List probation_;
+    List protected_;
+    std::unordered_map<std::string, List::iterator> index_;
+    Stats stats_;
+};
+
+}
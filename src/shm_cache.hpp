@@ -0,0 +1,548 @@
+#pragma once
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include "result_cache.hpp"
+
+namespace resizer {
+
+namespace detail::shm {
+
+constexpr uint64_t ready_magic = 0x52535a4353484d31ULL;  // "RSZCSHM1"
+constexpr uint32_t layout_version = 1;
+constexpr uint64_t page_bytes = 512 << 10;
+constexpr size_t max_classes = 48;
+
+// Same key must hash the same in every process, so no std::hash. FNV-1a
+// with a murmur3 finaliser, as both the high bits (stripe) and the low bits
+// (bucket) are used.
+inline uint64_t key_hash(const std::string& key) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (unsigned char c : key) {
+        hash ^= c;
+        hash *= 0x100000001b3ULL;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+// Everything in the segment refers to other parts of it by byte offset from
+// its start, as each process maps it at a different address; 0 is null
+struct Item {
+    uint64_t chain_next;
+    uint64_t lru_prev;
+    uint64_t lru_next;
+    uint64_t hash;
+    // Stripe clock at the last access, to compare LRU tails across classes
+    uint64_t touched;
+    uint32_t key_bytes;
+    uint32_t type_bytes;
+    uint32_t value_bytes;
+    uint16_t size_class;
+    // Set while the chunk holds an item, clear while it is on a free list
+    uint16_t live;
+};
+
+// Start of every slab page; chunks follow at page_header_bytes
+struct Page {
+    uint32_t size_class;
+};
+constexpr uint64_t page_header_bytes = 64;
+
+struct SizeClass {
+    uint64_t free_head;
+    uint64_t lru_head;
+    uint64_t lru_tail;
+    uint64_t items;
+};
+
+// A lock, a slice of the hash index and its own slab pages: operations on
+// different stripes never touch the same memory
+struct alignas(64) Stripe {
+    pthread_mutex_t mutex;
+    uint64_t buckets;
+    uint64_t pages;
+    uint64_t pages_total;
+    uint64_t pages_used;
+    uint64_t clock;
+    uint64_t items;
+    SizeClass classes[max_classes];
+};
+
+struct Header {
+    std::atomic<uint64_t> magic;
+    uint32_t version;
+    uint32_t stripe_count;
+    uint64_t segment_bytes;
+    uint64_t buckets_per_stripe;
+    uint32_t class_count;
+    uint32_t class_bytes[max_classes];
+    std::atomic<uint64_t> hits;
+    std::atomic<uint64_t> misses;
+    std::atomic<uint64_t> insertions;
+    std::atomic<uint64_t> evictions;
+    std::atomic<uint64_t> recoveries;
+    std::atomic<uint64_t> oversized;
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "shared counters must be address-free");
+
+inline uint64_t round_up(uint64_t value, uint64_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+}
+
+// Result cache in a POSIX shared-memory segment, so every resize_server
+// process on a host (prefork, SO_REUSEPORT) reads and fills the same one.
+// Keys hash to one of N stripes, each guarded by a robust process-shared
+// mutex and owning its part of the index and of the slab pages. Values live
+// in slab chunks of geometrically growing size classes, with an LRU per class
+// as in memcached. If a process dies holding a stripe lock, the next process
+// to take it gets EOWNERDEAD and clears that stripe, since it may have been
+// left half-written; the rest of the cache is unaffected.
+class SharedResultCache {
+public:
+    struct Options {
+        // shm_open name such as "/resizer-cache"; empty disables the cache
+        std::string name;
+        uint64_t size_bytes = 1ULL << 30;
+        size_t stripes = 16;
+    };
+
+    struct Stats {
+        uint64_t segment_bytes = 0;
+        // Slab pages handed out to size classes
+        uint64_t used_bytes = 0;
+        uint64_t entries = 0;
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t insertions = 0;
+        uint64_t evictions = 0;
+        // Stripes cleared after their lock holder died
+        uint64_t recoveries = 0;
+        // Results larger than the largest slab chunk, never stored
+        uint64_t oversized = 0;
+    };
+
+    SharedResultCache() = default;
+
+    // Attach to the named segment, creating and formatting it if this is the
+    // first process. Throws if an existing segment has a different layout.
+    explicit SharedResultCache(const Options& options) {
+        if (options.name.empty()) return;
+        if (options.stripes == 0) throw std::invalid_argument("shared cache needs at least one stripe");
+
+        int fd = ::shm_open(options.name.c_str(), O_RDWR | O_CREAT, 0600);
+        if (fd < 0) throw std::system_error(errno, std::generic_category(), "shm_open " + options.name);
+        // Serialises formatting against other starting processes; released
+        // by the kernel if this one dies half-way
+        ::flock(fd, LOCK_EX);
+        try {
+            attach(fd, options);
+        } catch (...) {
+            ::flock(fd, LOCK_UN);
+            ::close(fd);
+            throw;
+        }
+        ::flock(fd, LOCK_UN);
+        ::close(fd);
+    }
+
+    ~SharedResultCache() {
+        if (base_) ::munmap(base_, size_);
+    }
+
+    SharedResultCache(const SharedResultCache&) = delete;
+    SharedResultCache& operator=(const SharedResultCache&) = delete;
+
+    bool enabled() const { return base_ != nullptr; }
+
+    // Remove the segment name; processes already attached keep their mapping
+    static void unlink(const std::string& name) { ::shm_unlink(name.c_str()); }
+
+    std::shared_ptr<const CachedResult> get(const std::string& key) {
+        uint64_t hash = detail::shm::key_hash(key);
+        auto& stripe = stripe_for(hash);
+        StripeLock lock(*this, stripe);
+        if (!lock) return nullptr;
+
+        uint64_t offset = find(stripe, hash, key);
+        if (offset == 0) {
+            header()->misses.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        auto* item = at<detail::shm::Item>(offset);
+        auto& size_class = stripe.classes[item->size_class];
+        lru_unlink(size_class, offset);
+        lru_push_front(stripe, size_class, offset);
+
+        auto result = std::make_shared<CachedResult>();
+        const char* data = reinterpret_cast<const char*>(item + 1) + item->key_bytes;
+        result->content_type.assign(data, item->type_bytes);
+        result->bytes.assign(data + item->type_bytes, item->value_bytes);
+        header()->hits.fetch_add(1, std::memory_order_relaxed);
+        return result;
+    }
+
+    bool contains(const std::string& key) {
+        uint64_t hash = detail::shm::key_hash(key);
+        auto& stripe = stripe_for(hash);
+        StripeLock lock(*this, stripe);
+        return lock && find(stripe, hash, key) != 0;
+    }
+
+    void put(const std::string& key, std::shared_ptr<const CachedResult> value) {
+        if (!value) return;
+        uint64_t total = sizeof(detail::shm::Item) + key.size() + value->content_type.size() + value->bytes.size();
+        auto* h = header();
+        uint32_t size_class = 0;
+        while (size_class < h->class_count && h->class_bytes[size_class] < total) ++size_class;
+        if (size_class == h->class_count) {
+            h->oversized.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        uint64_t hash = detail::shm::key_hash(key);
+        auto& stripe = stripe_for(hash);
+        StripeLock lock(*this, stripe);
+        if (!lock) return;
+
+        if (uint64_t existing = find(stripe, hash, key)) release_item(stripe, existing);
+        uint64_t offset = allocate(stripe, size_class);
+        if (offset == 0) return;
+
+        auto* item = at<detail::shm::Item>(offset);
+        item->hash = hash;
+        item->key_bytes = static_cast<uint32_t>(key.size());
+        item->type_bytes = static_cast<uint32_t>(value->content_type.size());
+        item->value_bytes = static_cast<uint32_t>(value->bytes.size());
+        item->size_class = static_cast<uint16_t>(size_class);
+        item->live = 1;
+        char* data = reinterpret_cast<char*>(item + 1);
+        std::memcpy(data, key.data(), key.size());
+        std::memcpy(data + key.size(), value->content_type.data(), value->content_type.size());
+        std::memcpy(data + key.size() + value->content_type.size(), value->bytes.data(), value->bytes.size());
+
+        uint64_t* bucket = bucket_for(stripe, hash);
+        item->chain_next = *bucket;
+        *bucket = offset;
+        lru_push_front(stripe, stripe.classes[size_class], offset);
+        stripe.classes[size_class].items++;
+        stripe.items++;
+        h->insertions.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    Stats stats() {
+        Stats s;
+        if (!base_) return s;
+        auto* h = header();
+        s.segment_bytes = h->segment_bytes;
+        for (uint32_t i = 0; i < h->stripe_count; ++i) {
+            auto& stripe = stripes()[i];
+            StripeLock lock(*this, stripe);
+            if (!lock) continue;
+            s.used_bytes += stripe.pages_used * detail::shm::page_bytes;
+            s.entries += stripe.items;
+        }
+        s.hits = h->hits.load(std::memory_order_relaxed);
+        s.misses = h->misses.load(std::memory_order_relaxed);
+        s.insertions = h->insertions.load(std::memory_order_relaxed);
+        s.evictions = h->evictions.load(std::memory_order_relaxed);
+        s.recoveries = h->recoveries.load(std::memory_order_relaxed);
+        s.oversized = h->oversized.load(std::memory_order_relaxed);
+        return s;
+    }
+
+private:
+    using Stripe = detail::shm::Stripe;
+    using SizeClass = detail::shm::SizeClass;
+
+    // Holds a stripe mutex; converts EOWNERDEAD into a cleared, usable stripe
+    class StripeLock {
+    public:
+        StripeLock(SharedResultCache& cache, Stripe& stripe) : stripe_(stripe) {
+            int rc = ::pthread_mutex_lock(&stripe.mutex);
+            if (rc == EOWNERDEAD) {
+                cache.reset_stripe(stripe);
+                ::pthread_mutex_consistent(&stripe.mutex);
+                cache.header()->recoveries.fetch_add(1, std::memory_order_relaxed);
+                rc = 0;
+            }
+            locked_ = rc == 0;
+        }
+        ~StripeLock() {
+            if (locked_) ::pthread_mutex_unlock(&stripe_.mutex);
+        }
+        StripeLock(const StripeLock&) = delete;
+        StripeLock& operator=(const StripeLock&) = delete;
+
+        // False only for ENOTRECOVERABLE and similar; callers treat it as a miss
+        explicit operator bool() const { return locked_; }
+
+    private:
+        Stripe& stripe_;
+        bool locked_ = false;
+    };
+
+    void attach(int fd, const Options& options) {
+        using namespace detail::shm;
+        uint64_t header_bytes = round_up(sizeof(Header), 4096);
+        uint64_t stripe_bytes = round_up(sizeof(Stripe) * options.stripes, 4096);
+        if (options.size_bytes <= header_bytes + stripe_bytes) {
+            throw std::invalid_argument("shared cache size is too small for its stripes");
+        }
+        uint64_t data_bytes = options.size_bytes - header_bytes - stripe_bytes;
+        // About one bucket per 16 KB of slab space, a typical thumbnail
+        uint64_t buckets = 64;
+        while (buckets * 16384 < data_bytes / options.stripes) buckets <<= 1;
+        uint64_t bucket_bytes = round_up(buckets * sizeof(uint64_t) * options.stripes, 4096);
+        uint64_t pages_per_stripe =
+            data_bytes > bucket_bytes ? (data_bytes - bucket_bytes) / page_bytes / options.stripes : 0;
+        if (pages_per_stripe == 0) {
+            throw std::invalid_argument("shared cache needs at least one 512 KB slab page per stripe");
+        }
+
+        struct stat st;
+        if (::fstat(fd, &st) != 0) throw std::system_error(errno, std::generic_category(), "fstat " + options.name);
+        bool format = st.st_size == 0;
+        if (!format && static_cast<uint64_t>(st.st_size) != options.size_bytes) {
+            // A segment that never finished formatting may be resized; a live one may not
+            void* existing = ::mmap(nullptr, sizeof(Header), PROT_READ, MAP_SHARED, fd, 0);
+            bool ready = existing != MAP_FAILED &&
+                         static_cast<Header*>(existing)->magic.load(std::memory_order_acquire) == ready_magic;
+            if (existing != MAP_FAILED) ::munmap(existing, sizeof(Header));
+            if (ready) {
+                throw std::invalid_argument("shared cache " + options.name + " already exists with a different size");
+            }
+            format = true;
+        }
+        if (format && ::ftruncate(fd, static_cast<off_t>(options.size_bytes)) != 0) {
+            throw std::system_error(errno, std::generic_category(), "ftruncate " + options.name);
+        }
+
+        void* mapped = ::mmap(nullptr, options.size_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mapped == MAP_FAILED) throw std::system_error(errno, std::generic_category(), "mmap " + options.name);
+        base_ = static_cast<uint8_t*>(mapped);
+        size_ = options.size_bytes;
+
+        auto* h = header();
+        if (format || h->magic.load(std::memory_order_acquire) != ready_magic) {
+            format_segment(options, buckets, header_bytes + stripe_bytes, header_bytes + stripe_bytes + bucket_bytes,
+                           pages_per_stripe);
+        } else if (h->version != layout_version || h->stripe_count != options.stripes ||
+                   h->buckets_per_stripe != buckets) {
+            ::munmap(base_, size_);
+            base_ = nullptr;
+            throw std::invalid_argument("shared cache " + options.name + " already exists with a different layout");
+        }
+    }
+
+    void format_segment(const Options& options, uint64_t buckets, uint64_t buckets_offset, uint64_t pages_offset,
+                        uint64_t pages_per_stripe) {
+        using namespace detail::shm;
+        auto* h = header();
+        std::memset(base_, 0, pages_offset);
+        h->version = layout_version;
+        h->stripe_count = static_cast<uint32_t>(options.stripes);
+        h->segment_bytes = options.size_bytes;
+        h->buckets_per_stripe = buckets;
+
+        // 512 bytes growing by 1.25x, 64-byte aligned, up to a whole page
+        uint64_t largest = page_bytes - page_header_bytes;
+        uint64_t size = 512;
+        h->class_count = 0;
+        while (h->class_count < max_classes) {
+            h->class_bytes[h->class_count++] = static_cast<uint32_t>(std::min(size, largest));
+            if (size >= largest) break;
+            size = round_up(size * 5 / 4, 64);
+        }
+
+        pthread_mutexattr_t attr;
+        ::pthread_mutexattr_init(&attr);
+        ::pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        ::pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        for (size_t i = 0; i < options.stripes; ++i) {
+            auto& stripe = stripes()[i];
+            ::pthread_mutex_init(&stripe.mutex, &attr);
+            stripe.buckets = buckets_offset + i * buckets * sizeof(uint64_t);
+            stripe.pages = pages_offset + i * pages_per_stripe * page_bytes;
+            stripe.pages_total = pages_per_stripe;
+        }
+        ::pthread_mutexattr_destroy(&attr);
+        h->magic.store(ready_magic, std::memory_order_release);
+    }
+
+    detail::shm::Header* header() const { return reinterpret_cast<detail::shm::Header*>(base_); }
+
+    Stripe* stripes() const {
+        return reinterpret_cast<Stripe*>(base_ + detail::shm::round_up(sizeof(detail::shm::Header), 4096));
+    }
+
+    template <typename T>
+    T* at(uint64_t offset) const { return reinterpret_cast<T*>(base_ + offset); }
+
+    Stripe& stripe_for(uint64_t hash) const { return stripes()[(hash >> 32) % header()->stripe_count]; }
+
+    uint64_t* bucket_for(Stripe& stripe, uint64_t hash) const {
+        return at<uint64_t>(stripe.buckets) + (hash & (header()->buckets_per_stripe - 1));
+    }
+
+    uint64_t find(Stripe& stripe, uint64_t hash, const std::string& key) const {
+        for (uint64_t offset = *bucket_for(stripe, hash); offset != 0;) {
+            auto* item = at<detail::shm::Item>(offset);
+            if (item->hash == hash && item->key_bytes == key.size() &&
+                std::memcmp(item + 1, key.data(), key.size()) == 0) {
+                return offset;
+            }
+            offset = item->chain_next;
+        }
+        return 0;
+    }
+
+    void lru_push_front(Stripe& stripe, SizeClass& size_class, uint64_t offset) {
+        auto* item = at<detail::shm::Item>(offset);
+        item->touched = ++stripe.clock;
+        item->lru_prev = 0;
+        item->lru_next = size_class.lru_head;
+        if (size_class.lru_head) at<detail::shm::Item>(size_class.lru_head)->lru_prev = offset;
+        size_class.lru_head = offset;
+        if (!size_class.lru_tail) size_class.lru_tail = offset;
+    }
+
+    void lru_unlink(SizeClass& size_class, uint64_t offset) {
+        auto* item = at<detail::shm::Item>(offset);
+        if (item->lru_prev) at<detail::shm::Item>(item->lru_prev)->lru_next = item->lru_next;
+        else size_class.lru_head = item->lru_next;
+        if (item->lru_next) at<detail::shm::Item>(item->lru_next)->lru_prev = item->lru_prev;
+        else size_class.lru_tail = item->lru_prev;
+    }
+
+    // Unlink an item from the index and its LRU and return its chunk
+    void release_item(Stripe& stripe, uint64_t offset) {
+        auto* item = at<detail::shm::Item>(offset);
+        uint64_t* link = bucket_for(stripe, item->hash);
+        while (*link != offset) link = &at<detail::shm::Item>(*link)->chain_next;
+        *link = item->chain_next;
+
+        auto& size_class = stripe.classes[item->size_class];
+        lru_unlink(size_class, offset);
+        size_class.items--;
+        stripe.items--;
+        item->live = 0;
+        item->chain_next = size_class.free_head;
+        size_class.free_head = offset;
+    }
+
+    // A free chunk of the class: from its free list or a fresh page, else
+    // by evicting the stripe's least recently used item. When that item is
+    // in another class, its whole page moves to this one, so pages follow
+    // demand instead of staying with the classes that claimed them first.
+    uint64_t allocate(Stripe& stripe, uint32_t size_class_index) {
+        auto& size_class = stripe.classes[size_class_index];
+        if (size_class.free_head == 0) {
+            if (stripe.pages_used < stripe.pages_total) {
+                carve_page(stripe, stripe.pages + stripe.pages_used++ * detail::shm::page_bytes, size_class_index);
+            } else {
+                uint64_t oldest = 0;
+                for (uint32_t i = 0; i < header()->class_count; ++i) {
+                    uint64_t tail = stripe.classes[i].lru_tail;
+                    if (tail != 0 && (oldest == 0 || at<detail::shm::Item>(tail)->touched <
+                                                         at<detail::shm::Item>(oldest)->touched)) {
+                        oldest = tail;
+                    }
+                }
+                if (oldest == 0) {
+                    // No items at all, only free chunks of other classes
+                    for (uint64_t i = 0; i < stripe.pages_used && size_class.free_head == 0; ++i) {
+                        uint64_t page = stripe.pages + i * detail::shm::page_bytes;
+                        if (at<detail::shm::Page>(page)->size_class != size_class_index) {
+                            reclaim_page(stripe, page, size_class_index);
+                        }
+                    }
+                    if (size_class.free_head == 0) return 0;
+                } else if (at<detail::shm::Item>(oldest)->size_class == size_class_index) {
+                    release_item(stripe, oldest);
+                    header()->evictions.fetch_add(1, std::memory_order_relaxed);
+                } else {
+                    uint64_t page = stripe.pages + (oldest - stripe.pages) / detail::shm::page_bytes * detail::shm::page_bytes;
+                    reclaim_page(stripe, page, size_class_index);
+                }
+            }
+        }
+        uint64_t offset = size_class.free_head;
+        size_class.free_head = at<detail::shm::Item>(offset)->chain_next;
+        return offset;
+    }
+
+    void carve_page(Stripe& stripe, uint64_t page, uint32_t size_class_index) {
+        auto& size_class = stripe.classes[size_class_index];
+        at<detail::shm::Page>(page)->size_class = size_class_index;
+        uint64_t chunk = header()->class_bytes[size_class_index];
+        uint64_t end = page + detail::shm::page_bytes;
+        for (uint64_t offset = page + detail::shm::page_header_bytes; offset + chunk <= end; offset += chunk) {
+            auto* item = at<detail::shm::Item>(offset);
+            item->live = 0;
+            item->chain_next = size_class.free_head;
+            size_class.free_head = offset;
+        }
+    }
+
+    // Evict everything on a page of another class and re-carve it for this one
+    void reclaim_page(Stripe& stripe, uint64_t page, uint32_t size_class_index) {
+        uint32_t owner = at<detail::shm::Page>(page)->size_class;
+        uint64_t chunk = header()->class_bytes[owner];
+        uint64_t end = page + detail::shm::page_bytes;
+        for (uint64_t offset = page + detail::shm::page_header_bytes; offset + chunk <= end; offset += chunk) {
+            if (at<detail::shm::Item>(offset)->live) {
+                release_item(stripe, offset);
+                header()->evictions.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+        // Drop the page's chunks from the old class's free list
+        uint64_t* link = &stripe.classes[owner].free_head;
+        while (*link != 0) {
+            if (*link >= page && *link < end) {
+                *link = at<detail::shm::Item>(*link)->chain_next;
+            } else {
+                link = &at<detail::shm::Item>(*link)->chain_next;
+            }
+        }
+        carve_page(stripe, page, size_class_index);
+    }
+
+    // Forget everything in a stripe whose previous lock holder died; its
+    // pages are reused from scratch
+    void reset_stripe(Stripe& stripe) {
+        std::memset(at<uint64_t>(stripe.buckets), 0, header()->buckets_per_stripe * sizeof(uint64_t));
+        std::memset(stripe.classes, 0, sizeof(stripe.classes));
+        stripe.pages_used = 0;
+        stripe.items = 0;
+    }
+
+    uint8_t* base_ = nullptr;
+    uint64_t size_ = 0;
+};
+
+}
@@ -0,0 +1,391 @@
+#pragma once
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+namespace resizer {
+
+// Binary upgrades without dropping a connection. The new process connects to
+// the running one over a Unix socket, asks it to save its result cache,
+// preloads that, and receives a duplicate of its listening socket
+// (SCM_RIGHTS). The HTTP server binds its own acceptor, so the new process
+// binds an ephemeral port and puts the inherited socket in that acceptor's
+// place. From then on both processes accept from the one socket and its
+// backlog; only once the new process is serving does it tell the old one to
+// stop accepting, and the old one drains the connections it already has. If
+// the new process fails before that, the old one simply keeps serving.
+namespace detail {
+
+inline void set_io_timeout(int fd, std::chrono::milliseconds timeout) {
+    timeval tv{};
+    tv.tv_sec = static_cast<time_t>(timeout.count() / 1000);
+    tv.tv_usec = static_cast<suseconds_t>((timeout.count() % 1000) * 1000);
+    ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+inline sockaddr_un unix_address(const std::string& path) {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+        throw std::invalid_argument("Handover socket path must be 1-" + std::to_string(sizeof(addr.sun_path) - 1) +
+                                    " characters: " + path);
+    }
+    std::memcpy(addr.sun_path, path.data(), path.size());
+    return addr;
+}
+
+// A newline-terminated line, with passed_fd attached to its first byte
+inline bool write_line(int fd, const std::string& line, int passed_fd = -1) {
+    std::string data = line + "\n";
+    size_t sent = 0;
+    while (sent < data.size()) {
+        iovec iov{const_cast<char*>(data.data() + sent), data.size() - sent};
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+        if (sent == 0 && passed_fd >= 0) {
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+            std::memcpy(CMSG_DATA(cmsg), &passed_fd, sizeof(int));
+        }
+        ssize_t n = ::sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        sent += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+// One newline-terminated line; false on end of stream, error or timeout. A
+// descriptor passed along with it is stored in received_fd when given, and
+// closed otherwise.
+inline bool read_line(int fd, std::string& line, int* received_fd = nullptr) {
+    line.clear();
+    char c;
+    for (;;) {
+        iovec iov{&c, 1};
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        ssize_t n = ::recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+            int passed;
+            std::memcpy(&passed, CMSG_DATA(cmsg), sizeof(int));
+            if (received_fd && *received_fd < 0) {
+                *received_fd = passed;
+            } else {
+                ::close(passed);
+            }
+        }
+        if (c == '\n') return true;
+        if (line.size() >= 256) return false;
+        line.push_back(c);
+    }
+}
+
+class FileDescriptor {
+public:
+    explicit FileDescriptor(int fd = -1) : fd_(fd) {}
+    ~FileDescriptor() {
+        if (fd_ >= 0) ::close(fd_);
+    }
+    FileDescriptor(const FileDescriptor&) = delete;
+    FileDescriptor& operator=(const FileDescriptor&) = delete;
+    int get() const { return fd_; }
+
+private:
+    int fd_;
+};
+
+// Port a listening TCP socket is bound to; false for anything else
+inline bool listening_port(int fd, uint16_t& port) {
+    int listening = 0;
+    socklen_t length = sizeof(listening);
+    if (::getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &length) != 0 || !listening) return false;
+    sockaddr_storage addr{};
+    length = sizeof(addr);
+    if (::getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &length) != 0) return false;
+    if (addr.ss_family == AF_INET) {
+        port = ntohs(reinterpret_cast<sockaddr_in*>(&addr)->sin_port);
+    } else if (addr.ss_family == AF_INET6) {
+        port = ntohs(reinterpret_cast<sockaddr_in6*>(&addr)->sin6_port);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Descriptors open in this process, in /proc/self/fd order
+inline std::vector<int> open_descriptors() {
+    std::vector<int> fds;
+    DIR* dir = ::opendir("/proc/self/fd");
+    if (!dir) return fds;
+    while (dirent* entry = ::readdir(dir)) {
+        char* end = nullptr;
+        long fd = std::strtol(entry->d_name, &end, 10);
+        if (*end != '\0' || end == entry->d_name || fd == ::dirfd(dir)) continue;
+        fds.push_back(static_cast<int>(fd));
+    }
+    ::closedir(dir);
+    return fds;
+}
+
+// How an event loop's epoll instance watches a descriptor: the interest
+// mask and the cookie it hands back with each event (for asio, its
+// per-descriptor state)
+struct EpollRegistration {
+    int epoll_fd = -1;
+    uint32_t events = 0;
+    uint64_t data = 0;
+};
+
+// The registration of fd in any epoll instance of this process, read from
+// /proc/self/fdinfo, which lists every watched descriptor of an epoll fd
+inline bool find_epoll_registration(int fd, EpollRegistration& found) {
+    for (int candidate : open_descriptors()) {
+        char link[64];
+        std::string path = "/proc/self/fd/" + std::to_string(candidate);
+        ssize_t n = ::readlink(path.c_str(), link, sizeof(link) - 1);
+        if (n <= 0) continue;
+        link[n] = '\0';
+        if (std::strcmp(link, "anon_inode:[eventpoll]") != 0) continue;
+
+        std::ifstream info("/proc/self/fdinfo/" + std::to_string(candidate));
+        std::string line;
+        while (std::getline(info, line)) {
+            int target = -1;
+            unsigned int events = 0;
+            unsigned long long data = 0;
+            if (std::sscanf(line.c_str(), " tfd: %d events: %x data: %llx", &target, &events, &data) == 3 &&
+                target == fd) {
+                found.epoll_fd = candidate;
+                found.events = events;
+                found.data = data;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+}
+
+// Every TCP socket this process is listening on
+inline std::vector<int> listening_sockets() {
+    std::vector<int> sockets;
+    uint16_t port = 0;
+    for (int fd : detail::open_descriptors()) {
+        if (detail::listening_port(fd, port)) sockets.push_back(fd);
+    }
+    return sockets;
+}
+
+// The TCP socket this process is listening on for port, or -1 if none
+inline int find_listening_socket(uint16_t port) {
+    uint16_t bound = 0;
+    for (int fd : listening_sockets()) {
+        if (detail::listening_port(fd, bound) && bound == port) return fd;
+    }
+    return -1;
+}
+
+// Serve an inherited listening socket from a server's own acceptor: the
+// socket takes the acceptor's descriptor number and its epoll registration,
+// so the event loop goes on accepting, now from the inherited backlog.
+// Takes ownership of inherited.
+inline bool adopt_listening_socket(int inherited, int acceptor) {
+    detail::FileDescriptor owned(inherited);
+    detail::EpollRegistration registration;
+    bool registered = detail::find_epoll_registration(acceptor, registration);
+    // The event loop expects a non-blocking acceptor
+    int flags = ::fcntl(inherited, F_GETFL);
+    if (flags < 0 || ::fcntl(inherited, F_SETFL, flags | O_NONBLOCK) != 0) return false;
+    // Closing the acceptor's own socket drops its registration with it
+    if (::dup3(inherited, acceptor, O_CLOEXEC) < 0) return false;
+    if (!registered) return true;
+    epoll_event event{};
+    event.events = registration.events;
+    event.data.u64 = registration.data;
+    return ::epoll_ctl(registration.epoll_fd, EPOLL_CTL_ADD, acceptor, &event) == 0;
+}
+
+// Stop accepting on fd. The socket may be shared with a successor, so it is
+// not closed: its epoll registration is dropped and an unbound socket takes
+// the descriptor number, which stays owned by the server that will eventually
+// close it; its pending accept never completes. Unless a successor holds the
+// socket, this frees the port.
+inline bool release_listening_socket(int fd) {
+    detail::EpollRegistration registration;
+    if (detail::find_epoll_registration(fd, registration)) {
+        ::epoll_ctl(registration.epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    }
+    int placeholder = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (placeholder < 0) return false;
+    bool replaced = ::dup3(placeholder, fd, O_CLOEXEC) >= 0;
+    ::close(placeholder);
+    return replaced;
+}
+
+// Old-process side: answers one successor on a Unix socket
+class HandoverServer {
+public:
+    struct Handlers {
+        // Save state the successor will load; false if it could not be saved
+        std::function<bool()> save_state;
+        // The listening socket to share with the successor, or -1; it stays
+        // owned (and accepting) here
+        std::function<int()> listener;
+        // Stop accepting on the shared socket; false if still accepting
+        std::function<bool()> release_port;
+        // Called once accepting has stopped and the successor been told
+        std::function<void()> released;
+    };
+
+    // Listen on path in a background thread, replacing a stale socket file;
+    // a successor that stays silent for timeout is dropped
+    static void start(const std::string& path, std::chrono::milliseconds timeout, Handlers handlers) {
+        sockaddr_un addr = detail::unix_address(path);
+        int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) throw std::system_error(errno, std::generic_category(), "Handover socket");
+        ::unlink(path.c_str());
+        if (::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || ::listen(fd, 4) != 0) {
+            int error = errno;
+            ::close(fd);
+            throw std::system_error(error, std::generic_category(), "Cannot listen on handover socket " + path);
+        }
+        std::thread([fd, timeout, handlers = std::move(handlers)] {
+            detail::FileDescriptor listener(fd);
+            for (;;) {
+                int conn = ::accept4(listener.get(), nullptr, nullptr, SOCK_CLOEXEC);
+                if (conn < 0) {
+                    if (errno == EINTR || errno == ECONNABORTED) continue;
+                    return;
+                }
+                detail::FileDescriptor connection(conn);
+                detail::set_io_timeout(conn, timeout);
+                if (serve(connection.get(), handlers)) return;
+            }
+        }).detach();
+    }
+
+private:
+    // Commands from one successor; true once the port has been handed over.
+    // A successor that goes away before "release" leaves this process
+    // serving, ready for the next one.
+    static bool serve(int fd, const Handlers& handlers) {
+        std::string command;
+        while (detail::read_line(fd, command)) {
+            if (command == "save") {
+                bool saved = !handlers.save_state || handlers.save_state();
+                detail::write_line(fd, saved ? "saved" : "failed");
+            } else if (command == "listener") {
+                int listener = handlers.listener();
+                if (listener < 0) {
+                    detail::write_line(fd, "failed");
+                } else {
+                    detail::write_line(fd, "listener", listener);
+                }
+            } else if (command == "release") {
+                if (!handlers.release_port()) {
+                    detail::write_line(fd, "failed");
+                    continue;
+                }
+                detail::write_line(fd, "released");
+                if (handlers.released) handlers.released();
+                return true;
+            } else {
+                detail::write_line(fd, "unknown");
+            }
+        }
+        return false;
+    }
+};
+
+// New-process side: the connection to the predecessor being replaced
+class HandoverClient {
+public:
+    // nullptr when no process is listening on path
+    static std::unique_ptr<HandoverClient> connect(const std::string& path, std::chrono::milliseconds timeout) {
+        sockaddr_un addr = detail::unix_address(path);
+        int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) throw std::system_error(errno, std::generic_category(), "Handover socket");
+        auto client = std::unique_ptr<HandoverClient>(new HandoverClient(fd));
+        if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+            if (errno == ENOENT || errno == ECONNREFUSED) return nullptr;
+            throw std::system_error(errno, std::generic_category(), "Cannot reach previous process at " + path);
+        }
+        detail::set_io_timeout(fd, timeout);
+        return client;
+    }
+
+    // Ask the predecessor to save its state; false if it could not
+    bool save_state() { return request("save") == "saved"; }
+
+    // A duplicate of the predecessor's listening socket, owned by the
+    // caller; both processes accept from it until release_port
+    int take_listener() {
+        int listener = -1;
+        std::string reply = request("listener", &listener);
+        if (reply != "listener" || listener < 0) {
+            if (listener >= 0) ::close(listener);
+            throw std::runtime_error("Previous process did not pass its listening socket");
+        }
+        return listener;
+    }
+
+    // Ask the predecessor to stop accepting, once this process is serving
+    // the socket from take_listener
+    void release_port() {
+        if (request("release") != "released") {
+            throw std::runtime_error("Previous process did not stop accepting on its listening socket");
+        }
+    }
+
+private:
+    explicit HandoverClient(int fd) : fd_(fd) {}
+
+    std::string request(const std::string& command, int* received_fd = nullptr) {
+        std::string reply;
+        if (!detail::write_line(fd_.get(), command) || !detail::read_line(fd_.get(), reply, received_fd)) {
+            throw std::runtime_error("Lost the handover connection to the previous process");
+        }
+        return reply;
+    }
+
+    detail::FileDescriptor fd_;
+};
+
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "crypto.hpp"
+
+namespace resizer {
+
+// Content-addressed store for source images: each file is named by the
+// SHA-256 of its bytes, so a hash in a URL always refers to the same image
+// and anything derived from it can be cached forever.
+class SourceStore {
+public:
+    SourceStore() = default;
+    // Creates the root directory when it does not exist yet
+    explicit SourceStore(std::string root) : root_(std::move(root)) {
+        if (!root_.empty() && ::mkdir(root_.c_str(), 0755) != 0 && errno != EEXIST) {
+            throw std::system_error(errno, std::generic_category(), "Cannot create source store " + root_);
+        }
+    }
+
+    bool enabled() const { return !root_.empty(); }
+
+    static bool valid_hash(const std::string& hash) {
+        if (hash.size() != 64) return false;
+        for (char c : hash) {
+            if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'))) return false;
+        }
+        return true;
+    }
+
+    // Store bytes and return their hash. Writing goes through a temporary file
+    // and rename, so readers never see a partial source.
+    std::string put(const uint8_t* data, size_t size) const {
+        std::string hash = sha256_hex(data, size);
+        std::string path = path_for(hash);
+        if (::access(path.c_str(), F_OK) == 0) return hash;
+
+        std::string dir = root_ + "/" + hash.substr(0, 2);
+        if (::mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+            throw std::system_error(errno, std::generic_category(), "Cannot create " + dir);
+        }
+        static std::atomic<uint64_t> sequence{0};
+        std::string temp = path + ".tmp." + std::to_string(::getpid()) + "." + std::to_string(sequence++);
+        {
+            std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+            out.write(reinterpret_cast<const char*>(data), static_cast<std::streamsize>(size));
+            if (!out) {
+                std::remove(temp.c_str());
+                throw std::runtime_error("Cannot write source " + hash);
+            }
+        }
+        if (std::rename(temp.c_str(), path.c_str()) != 0) {
+            std::remove(temp.c_str());
+            throw std::system_error(errno, std::generic_category(), "Cannot store source " + hash);
+        }
+        return hash;
+    }
+
+    // Bytes of a stored source; nullopt when the hash is unknown or malformed
+    std::optional<std::vector<uint8_t>> get(const std::string& hash) const {
+        if (!valid_hash(hash)) return std::nullopt;
+        std::ifstream in(path_for(hash), std::ios::binary);
+        if (!in) return std::nullopt;
+        return std::vector<uint8_t>(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+
+private:
+    // Two-character fan-out keeps directories small
+    std::string path_for(const std::string& hash) const {
+        return root_ + "/" + hash.substr(0, 2) + "/" + hash;
+    }
+
+    std::string root_;
+};
+
+}
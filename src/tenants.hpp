@@ -0,0 +1,239 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "errors.hpp"
+
+namespace resizer {
+
+// Share of the workers, concurrent jobs and request rate one tenant gets
+struct TenantPolicy {
+    // Relative share of worker CPU time while other tenants are busy
+    double weight = 1;
+    // Jobs that may run on workers at once; 0 means no cap
+    size_t max_concurrency = 0;
+    // Sustained requests per second and the burst above it; rate 0 means no limit
+    double rate = 0;
+    double burst = 0;
+};
+
+struct TenantOptions {
+    // Header naming the tenant, for deployments where a trusted proxy sets it
+    std::string header = "x-tenant-id";
+    // X-Api-Key values and the tenant each belongs to; a known key wins over the header
+    std::unordered_map<std::string, std::string> api_keys;
+    std::map<std::string, TenantPolicy> policies;
+    // Policy of tenants not listed, including requests naming none ("default")
+    TenantPolicy defaults;
+    // Distinct unlisted tenants tracked separately; later ones share "other"
+    size_t max_tenants = 64;
+};
+
+// Parse "weight=8,concurrency=2,rate=20,burst=40" on top of policy
+inline TenantPolicy parse_tenant_policy(const std::string& text, TenantPolicy policy = {}) {
+    std::stringstream stream(text);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        if (item.empty()) continue;
+        size_t eq = item.find('=');
+        if (eq == std::string::npos) throw std::invalid_argument("tenant setting must look like key=value, got '" + item + "'");
+        std::string key = item.substr(0, eq);
+        double value = std::stod(item.substr(eq + 1));
+        if (value < 0) throw std::invalid_argument("tenant setting " + key + " must not be negative");
+        if (key == "weight") {
+            if (value <= 0) throw std::invalid_argument("tenant weight must be positive");
+            policy.weight = value;
+        } else if (key == "concurrency") {
+            policy.max_concurrency = static_cast<size_t>(value);
+        } else if (key == "rate") {
+            policy.rate = value;
+        } else if (key == "burst") {
+            policy.burst = value;
+        } else {
+            throw std::invalid_argument("unknown tenant setting '" + key + "'");
+        }
+    }
+    return policy;
+}
+
+// Parse "web:weight=8;backfill:weight=1,concurrency=2,rate=20", each tenant
+// starting from defaults
+inline std::map<std::string, TenantPolicy> parse_tenant_policies(const std::string& text,
+                                                                 const TenantPolicy& defaults = {}) {
+    std::map<std::string, TenantPolicy> policies;
+    std::stringstream stream(text);
+    std::string entry;
+    while (std::getline(stream, entry, ';')) {
+        if (entry.empty()) continue;
+        size_t colon = entry.find(':');
+        std::string name = entry.substr(0, colon);
+        if (name.empty()) throw std::invalid_argument("tenant entry needs a name, got '" + entry + "'");
+        policies[name] = colon == std::string::npos ? defaults : parse_tenant_policy(entry.substr(colon + 1), defaults);
+    }
+    return policies;
+}
+
+// Parse "key1=web,key2=backfill"
+inline std::unordered_map<std::string, std::string> parse_tenant_api_keys(const std::string& text) {
+    std::unordered_map<std::string, std::string> keys;
+    std::stringstream stream(text);
+    std::string entry;
+    while (std::getline(stream, entry, ',')) {
+        if (entry.empty()) continue;
+        size_t eq = entry.find('=');
+        if (eq == std::string::npos || eq == 0 || eq + 1 == entry.size()) {
+            throw std::invalid_argument("API key entry must look like key=tenant");
+        }
+        keys[entry.substr(0, eq)] = entry.substr(eq + 1);
+    }
+    return keys;
+}
+
+// Requests allowed at rate per second with bursts up to burst; without a
+// burst, one second's worth (and never less than one request)
+class TokenBucket {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    TokenBucket(double rate = 0, double burst = 0)
+        : rate_(rate), burst_(std::max(burst > 0 ? burst : rate, 1.0)), tokens_(burst_), updated_(Clock::now()) {}
+
+    // Take one token; on refusal, wait holds how long until one is available
+    bool take(Clock::time_point now, std::chrono::milliseconds& wait) {
+        if (rate_ <= 0) return true;
+        double elapsed = std::chrono::duration<double>(now - updated_).count();
+        if (elapsed > 0) {
+            tokens_ = std::min(burst_, tokens_ + elapsed * rate_);
+            updated_ = now;
+        }
+        if (tokens_ >= 1) {
+            tokens_ -= 1;
+            return true;
+        }
+        wait = std::chrono::milliseconds(static_cast<int64_t>((1 - tokens_) / rate_ * 1000) + 1);
+        return false;
+    }
+
+private:
+    double rate_;
+    double burst_;
+    double tokens_;
+    Clock::time_point updated_;
+};
+
+// Tenant identity and rate limits. Scheduling weights and concurrency caps
+// are enforced by the worker pool (WorkerPool::set_tenant); this decides who
+// a request belongs to and whether it may start at all.
+class TenantRegistry {
+public:
+    struct Stats {
+        std::string name;
+        uint64_t admitted = 0;
+        uint64_t rate_limited = 0;
+    };
+
+    void configure(TenantOptions options) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        options_ = std::move(options);
+        tenants_.clear();
+        unlisted_ = 0;
+        for (const auto& [name, policy] : options_.policies) tenant_locked(name, policy);
+    }
+
+    const TenantOptions& options() const { return options_; }
+
+    TenantPolicy policy(const std::string& name) const {
+        auto it = options_.policies.find(name);
+        return it == options_.policies.end() ? options_.defaults : it->second;
+    }
+
+    // Tenant of a request from its tenant header and X-Api-Key. Names are
+    // restricted to [A-Za-z0-9._-], at most 64 characters, since they become
+    // metric labels; anything else is "default".
+    std::string identify(const std::string& header_value, const std::string& api_key) {
+        if (!api_key.empty()) {
+            auto it = options_.api_keys.find(api_key);
+            if (it != options_.api_keys.end()) return it->second;
+        }
+        if (header_value.empty() || header_value.size() > 64 ||
+            !std::all_of(header_value.begin(), header_value.end(), [](char c) {
+                return std::isalnum(static_cast<unsigned char>(c)) || c == '.' || c == '_' || c == '-';
+            })) {
+            return "default";
+        }
+        if (options_.policies.count(header_value)) return header_value;
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (tenants_.count(header_value) || unlisted_ < options_.max_tenants) return header_value;
+        return "other";
+    }
+
+    // Count a request against the tenant's rate; throws http_error 429 when
+    // it is over, with the wait until the next request would be allowed
+    void admit(const std::string& name) {
+        std::chrono::milliseconds wait{0};
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto& tenant = tenant_locked(name, policy(name));
+        if (!tenant.bucket.take(TokenBucket::Clock::now(), wait)) {
+            tenant.stats.rate_limited++;
+            throw rate_limited_error(name, wait);
+        }
+        tenant.stats.admitted++;
+    }
+
+    std::vector<Stats> stats() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::vector<Stats> stats;
+        stats.reserve(tenants_.size());
+        for (const auto& entry : tenants_) stats.push_back(entry.second.stats);
+        return stats;
+    }
+
+    // 429 carrying the suggested Retry-After
+    class rate_limited_error : public http_error {
+    public:
+        rate_limited_error(const std::string& tenant, std::chrono::milliseconds retry_after)
+            : http_error(429, "Rate limit exceeded for tenant " + tenant), retry_after_(retry_after) {}
+        std::chrono::milliseconds retry_after() const { return retry_after_; }
+
+    private:
+        std::chrono::milliseconds retry_after_;
+    };
+
+private:
+    struct Tenant {
+        TokenBucket bucket;
+        Stats stats;
+    };
+
+    Tenant& tenant_locked(const std::string& name, const TenantPolicy& policy) {
+        auto it = tenants_.find(name);
+        if (it == tenants_.end()) {
+            if (!options_.policies.count(name)) unlisted_++;
+            it = tenants_.emplace(name, Tenant{TokenBucket(policy.rate, policy.burst), Stats{name}}).first;
+        }
+        return it->second;
+    }
+
+    std::mutex mutex_;
+    TenantOptions options_;
+    std::unordered_map<std::string, Tenant> tenants_;
+    size_t unlisted_ = 0;
+};
+
+inline TenantRegistry& tenants() {
+    static TenantRegistry instance;
+    return instance;
+}
+
+}
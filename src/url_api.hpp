@@ -0,0 +1,102 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+#include "crypto.hpp"
+
+namespace resizer {
+
+// "{w}x{h}.{fmt}" from /img/{hash}/{w}x{h}.{fmt}; a 0 side keeps the aspect ratio
+struct ThumbnailSpec {
+    int width = 0;
+    int height = 0;
+    std::string format;
+};
+
+inline bool parse_thumbnail_spec(std::string_view text, ThumbnailSpec& spec) {
+    // At most five digits; larger sides are rejected by validate_target anyway
+    auto read_int = [](std::string_view& in, int& out) {
+        size_t digits = 0;
+        out = 0;
+        while (digits < in.size() && digits < 5 && in[digits] >= '0' && in[digits] <= '9') {
+            out = out * 10 + (in[digits] - '0');
+            ++digits;
+        }
+        in.remove_prefix(digits);
+        return digits > 0;
+    };
+
+    std::string_view rest = text;
+    if (!read_int(rest, spec.width) || rest.empty() || rest[0] != 'x') return false;
+    rest.remove_prefix(1);
+    if (!read_int(rest, spec.height) || rest.empty() || rest[0] != '.') return false;
+    rest.remove_prefix(1);
+
+    if (rest == "jpg" || rest == "jpeg") {
+        spec.format = "jpeg";
+    } else if (rest == "png" || rest == "webp") {
+        spec.format = std::string(rest);
+    } else {
+        return false;
+    }
+    return spec.width > 0 || spec.height > 0;
+}
+
+// Canonical spelling of a spec, so "100x0.jpg" and "100x0.jpeg" share one
+// result cache entry
+inline std::string format_thumbnail_spec(const ThumbnailSpec& spec) {
+    return std::to_string(spec.width) + "x" + std::to_string(spec.height) + "." + spec.format;
+}
+
+inline std::string thumbnail_cache_key(const std::string& hash, const ThumbnailSpec& spec) {
+    return hash + "/" + format_thumbnail_spec(spec);
+}
+
+// Value of one query parameter in a request target; empty when absent.
+// Values are compared verbatim, which suits hex signatures.
+inline std::string query_param(std::string_view target, std::string_view name) {
+    size_t query = target.find('?');
+    if (query == std::string_view::npos) return "";
+    std::string_view rest = target.substr(query + 1);
+    while (!rest.empty()) {
+        size_t end = rest.find('&');
+        std::string_view pair = rest.substr(0, end);
+        size_t eq = pair.find('=');
+        if (pair.substr(0, eq) == name) return eq == std::string_view::npos ? "" : std::string(pair.substr(eq + 1));
+        if (end == std::string_view::npos) break;
+        rest.remove_prefix(end + 1);
+    }
+    return "";
+}
+
+inline std::string_view target_path(std::string_view target) {
+    return target.substr(0, target.find('?'));
+}
+
+// URLs are signed over their path: sig = hex(HMAC-SHA256(key, path))
+inline bool verify_url_signature(const std::string& key, std::string_view path, const std::string& signature) {
+    return !signature.empty() && constant_time_equal(hmac_sha256_hex(key, std::string(path)), signature);
+}
+
+// If-None-Match holds a comma separated list of entity tags or "*". Weak
+// validators match too, as GET only needs weak comparison.
+inline bool etag_matches(std::string_view if_none_match, std::string_view etag) {
+    auto trim = [](std::string_view s) {
+        while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) s.remove_prefix(1);
+        while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) s.remove_suffix(1);
+        return s;
+    };
+    while (!if_none_match.empty()) {
+        size_t comma = if_none_match.find(',');
+        std::string_view candidate = trim(if_none_match.substr(0, comma));
+        if (candidate == "*") return true;
+        if (candidate.substr(0, 2) == "W/") candidate.remove_prefix(2);
+        if (candidate == etag) return true;
+        if (comma == std::string_view::npos) break;
+        if_none_match.remove_prefix(comma + 1);
+    }
+    return false;
+}
+
+}
@@ -0,0 +1,324 @@
+#pragma once
+
+#include <boost/fiber/fss.hpp>
+#include <boost/fiber/future.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "request_timing.hpp"
+
+namespace resizer {
+
+namespace detail {
+
+inline boost::fibers::fiber_specific_ptr<std::string>& tenant_slot() {
+    static boost::fibers::fiber_specific_ptr<std::string> slot;
+    return slot;
+}
+
+inline double thread_cpu_seconds() { return thread_cpu_ns() / 1e9; }
+
+}
+
+// Tenant that work submitted from the calling fiber is queued and charged
+// under; empty outside any TenantScope
+inline std::string current_tenant() {
+    const std::string* tenant = detail::tenant_slot().get();
+    return tenant ? *tenant : std::string();
+}
+
+// Sets the calling fiber's tenant for its lifetime. Fibers do not inherit
+// it: a handler that starts fibers opens a scope in each of them.
+class TenantScope {
+public:
+    explicit TenantScope(std::string tenant) : previous_(detail::tenant_slot().release()) {
+        detail::tenant_slot().reset(new std::string(std::move(tenant)));
+    }
+    ~TenantScope() { detail::tenant_slot().reset(previous_); }
+    TenantScope(const TenantScope&) = delete;
+    TenantScope& operator=(const TenantScope&) = delete;
+
+private:
+    std::string* previous_;
+};
+
+namespace detail {
+
+inline boost::fibers::fiber_specific_ptr<std::shared_ptr<RequestTiming>>& timing_slot() {
+    static boost::fibers::fiber_specific_ptr<std::shared_ptr<RequestTiming>> slot;
+    return slot;
+}
+
+}
+
+// Timing of the request the calling fiber is serving, or null
+inline std::shared_ptr<RequestTiming> current_request_timing() {
+    const auto* timing = detail::timing_slot().get();
+    return timing ? *timing : nullptr;
+}
+
+// Makes timing the calling fiber's request timing for the scope's lifetime;
+// like TenantScope, fibers started inside need their own scope
+class RequestTimingScope {
+public:
+    explicit RequestTimingScope(std::shared_ptr<RequestTiming> timing) : previous_(detail::timing_slot().release()) {
+        detail::timing_slot().reset(new std::shared_ptr<RequestTiming>(std::move(timing)));
+    }
+    ~RequestTimingScope() { detail::timing_slot().reset(previous_); }
+    RequestTimingScope(const RequestTimingScope&) = delete;
+    RequestTimingScope& operator=(const RequestTimingScope&) = delete;
+
+private:
+    std::shared_ptr<RequestTiming>* previous_;
+};
+
+// Fixed set of OS threads for CPU-bound image work. Handlers run as fibers on
+// the libasyik I/O thread; they hand the pipeline to the pool and wait on a
+// fiber future, so the I/O thread keeps serving other connections meanwhile.
+//
+// Jobs queue per tenant (current_tenant() of the submitting fiber) and free
+// workers go to the tenant that has used the least CPU time relative to its
+// weight, so a tenant with many queued jobs gets its share rather than every
+// worker. A tenant newly backlogged starts level with the busiest tenant's
+// position instead of cashing in time it spent idle.
+class WorkerPool {
+public:
+    // Runs on each worker thread before it takes any work (pinning, naming, ...)
+    using ThreadInit = std::function<void(size_t index)>;
+
+    struct TenantStats {
+        std::string name;
+        double weight = 1;
+        size_t max_running = 0;
+        size_t queued = 0;
+        size_t running = 0;
+        uint64_t completed = 0;
+        // Worker thread CPU time spent on the tenant's jobs
+        double cpu_seconds = 0;
+    };
+
+    explicit WorkerPool(size_t threads, ThreadInit init = nullptr) {
+        if (threads == 0) threads = 1;
+        threads_.reserve(threads);
+        for (size_t i = 0; i < threads; ++i) {
+            threads_.emplace_back([this, i, init] {
+                if (init) init(i);
+                run();
+            });
+        }
+    }
+
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        wake_.notify_all();
+        for (auto& thread : threads_) thread.join();
+    }
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    // Share of the workers a tenant gets while others are busy, and the most
+    // of its jobs that may run at once (0: no cap). Tenants not set here use
+    // the default policy.
+    void set_tenant(const std::string& name, double weight, size_t max_running) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto& tenant = tenant_locked(name);
+        tenant.weight = weight > 0 ? weight : 1;
+        tenant.max_running = max_running;
+    }
+
+    void set_default_tenant(double weight, size_t max_running) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        default_weight_ = weight > 0 ? weight : 1;
+        default_max_running_ = max_running;
+    }
+
+    // Queue fn for a worker thread under the calling fiber's tenant, charging
+    // its queue wait and CPU time to the fiber's request timing if it has one;
+    // exceptions it throws surface from future::get()
+    template <typename F>
+    auto submit(F&& fn) -> boost::fibers::future<std::invoke_result_t<std::decay_t<F>>> {
+        using Result = std::invoke_result_t<std::decay_t<F>>;
+        // Charged inside the task, so the request sees its costs as soon as the future is ready
+        auto task = std::make_shared<boost::fibers::packaged_task<Result()>>(
+            [fn = std::forward<F>(fn), timing = current_request_timing(),
+             queued = std::chrono::steady_clock::now()]() mutable -> Result {
+                if (!timing) return fn();
+                timing->add(Stage::queue, std::chrono::steady_clock::now() - queued);
+                WorkerTimingBinding binding(timing.get());
+                return fn();
+            });
+        auto future = task->get_future();
+        std::string name = current_tenant();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto& tenant = tenant_locked(name);
+            if (tenant.jobs.empty() && tenant.running == 0) {
+                tenant.virtual_time = std::max(tenant.virtual_time, virtual_time_);
+            }
+            tenant.jobs.emplace_back([task] { (*task)(); });
+            queued_++;
+        }
+        wake_.notify_one();
+        return future;
+    }
+
+    // Queue speculative work that only runs when no submitted job is waiting,
+    // on at most max_running workers at a time so client requests always find
+    // a free thread. Returns false, dropping fn, when max_pending jobs are
+    // already queued. Exceptions from fn are swallowed.
+    template <typename F>
+    bool submit_background(F&& fn, size_t max_running = 1, size_t max_pending = 256) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (background_.size() >= max_pending) return false;
+            background_max_running_ = std::max<size_t>(max_running, 1);
+            background_.emplace_back(std::forward<F>(fn));
+        }
+        wake_.notify_one();
+        return true;
+    }
+
+    size_t size() const { return threads_.size(); }
+
+    std::vector<TenantStats> tenant_stats() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::vector<TenantStats> stats;
+        stats.reserve(tenants_.size());
+        for (const auto& [name, tenant] : tenants_) {
+            stats.push_back({name, tenant.weight, tenant.max_running, tenant.jobs.size(), tenant.running,
+                             tenant.completed, tenant.cpu_seconds});
+        }
+        return stats;
+    }
+
+private:
+    struct Tenant {
+        double weight = 1;
+        size_t max_running = 0;
+        std::deque<std::function<void()>> jobs;
+        size_t running = 0;
+        // CPU seconds received divided by weight; the lowest goes next
+        double virtual_time = 0;
+        // Recent CPU seconds per job, charged up front so concurrent
+        // dispatches see each other before the real cost is known
+        double expected_cost = 0.001;
+        uint64_t completed = 0;
+        double cpu_seconds = 0;
+    };
+
+    Tenant& tenant_locked(const std::string& name) {
+        auto it = tenants_.find(name);
+        if (it == tenants_.end()) {
+            it = tenants_.emplace(name, Tenant{}).first;
+            it->second.weight = default_weight_;
+            it->second.max_running = default_max_running_;
+            it->second.virtual_time = virtual_time_;
+        }
+        return it->second;
+    }
+
+    // Backlogged tenant under its concurrency cap with the least weighted
+    // CPU time, or nullptr
+    Tenant* next_tenant_locked() {
+        Tenant* next = nullptr;
+        for (auto& [name, tenant] : tenants_) {
+            if (tenant.jobs.empty() || (tenant.max_running > 0 && tenant.running >= tenant.max_running)) continue;
+            if (!next || tenant.virtual_time < next->virtual_time) next = &tenant;
+        }
+        return next;
+    }
+
+    void run() {
+        for (;;) {
+            std::function<void()> job;
+            bool background = false;
+            Tenant* tenant = nullptr;
+            double charged = 0;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                auto background_ready = [this] {
+                    return !background_.empty() && background_running_ < background_max_running_;
+                };
+                wake_.wait(lock, [&] {
+                    tenant = next_tenant_locked();
+                    return tenant || (stopping_ && queued_ == 0) || (queued_ == 0 && background_ready());
+                });
+                if (tenant) {
+                    job = std::move(tenant->jobs.front());
+                    tenant->jobs.pop_front();
+                    queued_--;
+                    tenant->running++;
+                    virtual_time_ = std::max(virtual_time_, tenant->virtual_time);
+                    charged = tenant->expected_cost;
+                    tenant->virtual_time += charged / tenant->weight;
+                } else if (stopping_) {
+                    // Speculative work left over at shutdown is simply dropped
+                    return;
+                } else {
+                    job = std::move(background_.front());
+                    background_.pop_front();
+                    background_running_++;
+                    background = true;
+                }
+            }
+            if (!background) {
+                double started = detail::thread_cpu_seconds();
+                job();
+                double cost = detail::thread_cpu_seconds() - started;
+                bool capped;
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    tenant->running--;
+                    tenant->completed++;
+                    tenant->cpu_seconds += cost;
+                    tenant->virtual_time += (cost - charged) / tenant->weight;
+                    tenant->expected_cost = 0.8 * tenant->expected_cost + 0.2 * cost;
+                    capped = tenant->max_running > 0 && !tenant->jobs.empty();
+                }
+                // A capped tenant's next job may now run on another worker
+                if (capped) wake_.notify_one();
+                continue;
+            }
+            try {
+                job();
+            } catch (...) {
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                background_running_--;
+            }
+            wake_.notify_one();
+        }
+    }
+
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::unordered_map<std::string, Tenant> tenants_;
+    size_t queued_ = 0;
+    double virtual_time_ = 0;
+    double default_weight_ = 1;
+    size_t default_max_running_ = 0;
+    std::deque<std::function<void()>> background_;
+    size_t background_running_ = 0;
+    size_t background_max_running_ = 1;
+    bool stopping_ = false;
+    std::vector<std::thread> threads_;
+};
+
+}
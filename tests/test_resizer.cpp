@@ -7,9 +7,39 @@
 #include <boost/archive/iterators/binary_from_base64.hpp>
 #include <boost/archive/iterators/transform_width.hpp>
 #include <boost/algorithm/string.hpp>
+#include <boost/asio.hpp>
 #include <vector>
 #include <string>
 #include <cstdint>
+#include <atomic>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <unistd.h>
+
+#include "body_limits.hpp"
+#include "cache_snapshot.hpp"
+#include "cgroup.hpp"
+#include "heap_tracker.hpp"
+#include "jpeg_decoder.hpp"
+#include "jpeg_encoder.hpp"
+#include "jpeg_metadata.hpp"
+#include "jpeg_probe.hpp"
+#include "lifecycle.hpp"
+#include "memory_budget.hpp"
+#include "metrics.hpp"
+#include "perf_counters.hpp"
+#include "pipeline.hpp"
+#include "pixel_pool.hpp"
+#include "pregen.hpp"
+#include "resizer.hpp"
+#include "result_cache.hpp"
+#include "shm_cache.hpp"
+#include "socket_handover.hpp"
+#include "source_store.hpp"
+#include "tenants.hpp"
+#include "url_api.hpp"
+#include "worker_pool.hpp"
 
 // Utility functions from main.cpp (replicated for testing)
 namespace test_utils {
@@ -422,4 +452,1195 @@ TEST_CASE("Performance and Memory", "[performance]") {
         // If we got here without crashes, memory management is working
         REQUIRE(true);
     }
-}
\ No newline at end of file
+}
+
+TEST_CASE("JPEG Header Probe", "[probe]") {
+    SECTION("Reads dimensions without decoding") {
+        std::vector<uint8_t> jpeg = test_utils::base64_decode(test_utils::create_test_jpeg(320, 200));
+        
+        resizer::JpegHeader header;
+        REQUIRE(resizer::probe_jpeg(jpeg.data(), jpeg.size(), header));
+        REQUIRE(header.width == 320);
+        REQUIRE(header.height == 200);
+        REQUIRE(header.components == 3);
+        REQUIRE_FALSE(header.progressive);
+    }
+    
+    SECTION("Detects progressive encoding") {
+        cv::Mat image(64, 48, CV_8UC3, cv::Scalar(10, 20, 30));
+        std::vector<uint8_t> jpeg;
+        cv::imencode(".jpg", image, jpeg, {cv::IMWRITE_JPEG_PROGRESSIVE, 1});
+        
+        resizer::JpegHeader header;
+        REQUIRE(resizer::probe_jpeg(jpeg.data(), jpeg.size(), header));
+        REQUIRE(header.progressive);
+        REQUIRE(header.width == 48);
+    }
+    
+    SECTION("Reports subsampling, quality and ICC presence") {
+        std::vector<uint8_t> jpeg = test_utils::base64_decode(test_utils::create_test_jpeg(64, 64));
+        
+        resizer::JpegHeader header;
+        REQUIRE(resizer::probe_jpeg(jpeg.data(), jpeg.size(), header));
+        REQUIRE(resizer::subsampling_name(header) == "4:2:0");
+        REQUIRE(header.quality == 85);
+        REQUIRE_FALSE(header.icc_profile);
+        
+        std::vector<uint8_t> icc = {0xFF, 0xE2, 0x00, 0x10, 'I', 'C', 'C', '_', 'P', 'R', 'O', 'F', 'I', 'L', 'E', 0, 1, 1};
+        std::vector<uint8_t> tagged(jpeg.begin(), jpeg.begin() + 2);
+        tagged.insert(tagged.end(), icc.begin(), icc.end());
+        tagged.insert(tagged.end(), jpeg.begin() + 2, jpeg.end());
+        REQUIRE(resizer::probe_jpeg(tagged.data(), tagged.size(), header));
+        REQUIRE(header.icc_profile);
+    }
+    
+    SECTION("Exif orientation survives a following XMP segment") {
+        std::vector<uint8_t> jpeg = test_utils::base64_decode(test_utils::create_test_jpeg(64, 48));
+        // Big-endian TIFF header, IFD0 with one entry: Orientation (0x0112) SHORT = 6
+        std::vector<uint8_t> exif = {0xFF, 0xE1, 0x00, 0x22, 'E', 'x', 'i', 'f', 0, 0,
+                                     'M', 'M', 0x00, 0x2A, 0x00, 0x00, 0x00, 0x08,
+                                     0x00, 0x01, 0x01, 0x12, 0x00, 0x03, 0x00, 0x00, 0x00, 0x01,
+                                     0x00, 0x06, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+        std::string xmp_id = "http://ns.adobe.com/xap/1.0/";
+        std::vector<uint8_t> xmp = {0xFF, 0xE1, 0x00, static_cast<uint8_t>(2 + xmp_id.size() + 1 + 4)};
+        xmp.insert(xmp.end(), xmp_id.begin(), xmp_id.end());
+        xmp.insert(xmp.end(), {0, '<', 'x', '/', '>'});
+        
+        std::vector<uint8_t> tagged(jpeg.begin(), jpeg.begin() + 2);
+        tagged.insert(tagged.end(), exif.begin(), exif.end());
+        tagged.insert(tagged.end(), xmp.begin(), xmp.end());
+        tagged.insert(tagged.end(), jpeg.begin() + 2, jpeg.end());
+        
+        resizer::JpegHeader header;
+        REQUIRE(resizer::probe_jpeg(tagged.data(), tagged.size(), header));
+        REQUIRE(header.orientation == 6);
+        REQUIRE(header.width == 64);
+    }
+    
+    SECTION("Rejects non-JPEG and truncated data") {
+        std::vector<uint8_t> jpeg = test_utils::base64_decode(test_utils::create_test_jpeg(32, 32));
+        std::vector<uint8_t> not_jpeg = {0x89, 'P', 'N', 'G', 0x0D, 0x0A};
+        
+        resizer::JpegHeader header;
+        REQUIRE_FALSE(resizer::probe_jpeg(not_jpeg.data(), not_jpeg.size(), header));
+        REQUIRE_FALSE(resizer::probe_jpeg(jpeg.data(), 20, header));
+    }
+}
+
+TEST_CASE("Pixel Buffer Pool", "[pool]") {
+    resizer::PixelBufferPool::Options options;
+    options.min_buffer_bytes = 1024 * 1024;
+    resizer::PixelBufferPool pool(options);
+    
+    SECTION("Small buffers bypass the pool") {
+        REQUIRE_FALSE(pool.acquire(4096));
+    }
+    
+    SECTION("Buffers are huge-page aligned and reused") {
+        uint8_t* first = nullptr;
+        {
+            auto lease = pool.acquire(3 * 1024 * 1024);
+            REQUIRE(lease);
+            REQUIRE(lease.capacity() == 4 * 1024 * 1024);
+            REQUIRE(reinterpret_cast<uintptr_t>(lease.data()) % resizer::PixelBufferPool::huge_page_size == 0);
+            std::memset(lease.data(), 0xAB, lease.capacity());
+            first = lease.data();
+        }
+        
+        auto again = pool.acquire(3 * 1024 * 1024);
+        REQUIRE(again.data() == first);
+        REQUIRE(pool.stats().hits == 1);
+    }
+    
+    SECTION("Disabled pool never hands out buffers") {
+        options.mode = resizer::HugePageMode::off;
+        pool.configure(options);
+        REQUIRE_FALSE(pool.acquire(64 * 1024 * 1024));
+    }
+}
+
+TEST_CASE("Memory Budget", "[memory]") {
+    resizer::MemoryBudget budget;
+    budget.configure(1000, std::chrono::milliseconds(0));
+    
+    SECTION("Reservations are released on destruction") {
+        {
+            auto reservation = budget.reserve(600);
+            REQUIRE(budget.stats().in_use == 600);
+        }
+        REQUIRE(budget.stats().in_use == 0);
+        REQUIRE(budget.stats().peak == 600);
+    }
+    
+    SECTION("Requests larger than the budget are rejected with 413") {
+        try {
+            budget.reserve(1001);
+            FAIL("reservation should have been rejected");
+        } catch (const resizer::http_error& e) {
+            REQUIRE(e.status() == 413);
+        }
+    }
+    
+    SECTION("Exhausted budget rejects with 503 after the wait") {
+        auto held = budget.reserve(800);
+        try {
+            budget.reserve(300);
+            FAIL("reservation should have timed out");
+        } catch (const resizer::http_error& e) {
+            REQUIRE(e.status() == 503);
+        }
+        REQUIRE(budget.stats().rejections == 1);
+    }
+    
+    SECTION("Reconcile replaces the estimate with the actual usage") {
+        auto reservation = budget.reserve(900);
+        reservation.reconcile(400);
+        REQUIRE(budget.stats().in_use == 400);
+        
+        auto second = budget.reserve(500);
+        REQUIRE(budget.stats().in_use == 900);
+    }
+}
+
+TEST_CASE("Decode Limits", "[decode]") {
+    cv::Mat image(480, 640, CV_8UC3, cv::Scalar(40, 80, 120));
+    std::vector<uint8_t> progressive;
+    cv::imencode(".jpg", image, progressive, {cv::IMWRITE_JPEG_PROGRESSIVE, 1});
+    resizer::DecodeLimits limits;
+    cv::Mat decoded;
+    
+    SECTION("Decodes within limits into a preallocated frame") {
+        std::vector<uint8_t> pixels(640 * 480 * 3);
+        cv::Mat frame(480, 640, CV_8UC3, pixels.data());
+        resizer::decode_jpeg(progressive.data(), progressive.size(), limits, frame);
+        REQUIRE(frame.data == pixels.data());
+        REQUIRE(cv::mean(frame)[2] > 100);
+    }
+    
+    SECTION("Too many declared pixels is rejected with 413") {
+        limits.max_pixels = 640 * 480 - 1;
+        try {
+            resizer::decode_jpeg(progressive.data(), progressive.size(), limits, decoded);
+            FAIL("decode should have been rejected");
+        } catch (const resizer::http_error& e) {
+            REQUIRE(e.status() == 413);
+        }
+    }
+    
+    SECTION("Too many progressive scans is rejected with 422") {
+        limits.max_scans = 2;
+        try {
+            resizer::decode_jpeg(progressive.data(), progressive.size(), limits, decoded);
+            FAIL("decode should have been rejected");
+        } catch (const resizer::http_error& e) {
+            REQUIRE(e.status() == 422);
+        }
+    }
+    
+    SECTION("Corrupt data is a decode error") {
+        std::vector<uint8_t> corrupt(progressive.begin(), progressive.begin() + 40);
+        corrupt[20] = 0xFF;
+        corrupt[21] = 0x00;
+        REQUIRE_THROWS(resizer::decode_jpeg(corrupt.data(), corrupt.size(), limits, decoded));
+    }
+}
+
+TEST_CASE("Request Body Limits", "[limits]") {
+    resizer::BodyLimits limits;
+    limits.default_limit = 1000;
+    limits.parse_overrides("/resize_image=5000,/metrics=10", [](const std::string& v) { return std::stoull(v); });
+    
+    SECTION("Per-endpoint overrides fall back to the default") {
+        REQUIRE(limits.limit_for("/resize_image") == 5000);
+        REQUIRE(limits.limit_for("/metrics") == 10);
+        REQUIRE(limits.limit_for("/other") == 1000);
+        REQUIRE(limits.largest() == 5000);
+    }
+    
+    SECTION("Declared Content-Length over the limit is rejected") {
+        REQUIRE_THROWS_AS(resizer::enforce_body_limit("1001", 0, 1000), resizer::http_error);
+        REQUIRE_THROWS_AS(resizer::enforce_body_limit("99999999999999999999999", 0, 1000), resizer::http_error);
+        REQUIRE_NOTHROW(resizer::enforce_body_limit("1000", 1000, 1000));
+    }
+    
+    SECTION("Chunked bodies are checked by received size") {
+        REQUIRE_THROWS_AS(resizer::enforce_body_limit("", 1001, 1000), resizer::http_error);
+        REQUIRE_NOTHROW(resizer::enforce_body_limit("", 999, 1000));
+    }
+}
+
+TEST_CASE("Pass-through Fast Path", "[passthrough]") {
+    resizer::JpegHeader header;
+    header.width = 640;
+    header.height = 480;
+    header.components = 3;
+    
+    SECTION("Same dimensions pass through") {
+        REQUIRE(resizer::can_pass_through(header, 640, 480, false));
+        REQUIRE_FALSE(resizer::can_pass_through(header, 320, 240, false));
+    }
+    
+    SECTION("no_upscale passes through sources that already fit") {
+        REQUIRE(resizer::can_pass_through(header, 800, 600, true));
+        REQUIRE_FALSE(resizer::can_pass_through(header, 800, 600, false));
+        REQUIRE_FALSE(resizer::can_pass_through(header, 800, 400, true));
+    }
+    
+    SECTION("Rotated sources are always re-encoded") {
+        header.orientation = 6;
+        REQUIRE_FALSE(resizer::can_pass_through(header, 640, 480, false));
+    }
+    
+    SECTION("Grayscale and CMYK sources are re-encoded as colour") {
+        header.components = 1;
+        REQUIRE_FALSE(resizer::can_pass_through(header, 640, 480, false));
+        header.components = 4;
+        REQUIRE_FALSE(resizer::can_pass_through(header, 800, 600, true));
+    }
+    
+    SECTION("Metadata is stripped without touching image data") {
+        std::vector<uint8_t> jpeg = test_utils::base64_decode(test_utils::create_test_jpeg(64, 48));
+        std::vector<uint8_t> exif = {0xFF, 0xE1, 0x00, 0x08, 'E', 'x', 'i', 'f', 0, 0};
+        std::vector<uint8_t> tagged(jpeg.begin(), jpeg.begin() + 2);
+        tagged.insert(tagged.end(), exif.begin(), exif.end());
+        tagged.insert(tagged.end(), jpeg.begin() + 2, jpeg.end());
+        
+        std::vector<uint8_t> stripped = resizer::strip_jpeg_metadata(tagged.data(), tagged.size());
+        REQUIRE(stripped == jpeg);
+    }
+}
+
+TEST_CASE("Scaled Decode and Placeholders", "[lqip]") {
+    resizer::JpegHeader header;
+    header.width = 4000;
+    header.height = 3000;
+    
+    SECTION("Largest DCT scale that still covers the target") {
+        REQUIRE(resizer::choose_scale_denom(header, 32, 32) == 8);
+        REQUIRE(resizer::choose_scale_denom(header, 800, 600) == 4);
+        REQUIRE(resizer::choose_scale_denom(header, 4000, 3000) == 1);
+        header.orientation = 6;
+        REQUIRE(resizer::choose_scale_denom(header, 375, 500) == 8);
+    }
+    
+    SECTION("Progressive DC-only decode yields the 1/8 frame") {
+        cv::Mat image(480, 640, CV_8UC3, cv::Scalar(40, 80, 120));
+        std::vector<uint8_t> progressive;
+        cv::imencode(".jpg", image, progressive, {cv::IMWRITE_JPEG_PROGRESSIVE, 1});
+        cv::Mat decoded;
+        resizer::decode_jpeg(progressive.data(), progressive.size(), resizer::DecodeLimits{}, decoded, 8);
+        REQUIRE(decoded.cols == 80);
+        REQUIRE(decoded.rows == 60);
+        REQUIRE(std::abs(cv::mean(decoded)[2] - 120) < 4);
+    }
+    
+    SECTION("LQIP output fits the box and carries a BlurHash") {
+        resizer::ResizeStats stats;
+        auto placeholder = resizer::lqip_jpeg(test_utils::create_test_jpeg(640, 480), 32, &stats);
+        REQUIRE(placeholder.width == 32);
+        REQUIRE(placeholder.height == 24);
+        REQUIRE_FALSE(placeholder.jpeg_base64.empty());
+        // 4x3 components: 1 + 1 + 4 + 2 * 11 characters
+        REQUIRE(placeholder.blurhash.size() == 28);
+        // Decoded at 1/8 scale, and counted for the memory budget
+        REQUIRE(stats.decoded_bytes >= 80 * 60 * 3);
+        REQUIRE(stats.output_bytes == placeholder.jpeg_base64.size());
+    }
+}
+
+TEST_CASE("Multi-target Resize", "[batch]") {
+    std::string input = test_utils::create_test_jpeg(800, 600);
+    
+    SECTION("One decode produces every target in order") {
+        resizer::ResizeStats stats;
+        auto outputs = resizer::resize_jpeg_targets(input, {{400, 300}, {64, 48}, {200, 200}}, &stats);
+        REQUIRE(outputs.size() == 3);
+        
+        cv::Mat first = cv::imdecode(test_utils::base64_decode(outputs[0]), cv::IMREAD_COLOR);
+        cv::Mat second = cv::imdecode(test_utils::base64_decode(outputs[1]), cv::IMREAD_COLOR);
+        cv::Mat third = cv::imdecode(test_utils::base64_decode(outputs[2]), cv::IMREAD_COLOR);
+        REQUIRE(first.size() == cv::Size(400, 300));
+        REQUIRE(second.size() == cv::Size(64, 48));
+        REQUIRE(third.size() == cv::Size(200, 200));
+        REQUIRE(stats.output_bytes == outputs[0].size() + outputs[1].size() + outputs[2].size());
+    }
+    
+    SECTION("Estimate covers the shared decode once") {
+        resizer::JpegHeader header;
+        header.width = 800;
+        header.height = 600;
+        uint64_t both = resizer::estimate_peak_bytes(input.size(), &header, {{400, 300}, {64, 48}});
+        uint64_t largest = resizer::estimate_peak_bytes(input.size(), &header, 400, 300);
+        uint64_t smallest = resizer::estimate_peak_bytes(input.size(), &header, 64, 48);
+        REQUIRE(both > largest);
+        REQUIRE(both < largest + smallest);
+        
+        // A binary body is the JPEG itself: no base64 text, no decoded copy
+        size_t jpeg_size = input.size() / 4 * 3;
+        REQUIRE(resizer::estimate_binary_peak_bytes(jpeg_size, &header, {{400, 300}}) == largest - input.size());
+        
+        // Sideways sources are transposed into a second frame; 1/2 scale covers 300x400
+        header.orientation = 6;
+        REQUIRE(resizer::estimate_peak_bytes(input.size(), &header, 300, 400) == largest + 400 * 300 * 3);
+    }
+    
+    SECTION("Invalid targets are rejected before decoding") {
+        REQUIRE_THROWS_AS(resizer::resize_jpeg_targets(input, {}), std::invalid_argument);
+        REQUIRE_THROWS_AS(resizer::resize_jpeg_targets(input, {{100, 0}}), std::invalid_argument);
+    }
+}
+
+TEST_CASE("Operation Planner", "[pipeline]") {
+    using Op = resizer::Operation;
+    auto op = [](Op::Type type) { Op o; o.type = type; return o; };
+    
+    SECTION("Crop after resize becomes a source crop before one resize") {
+        Op resize = op(Op::Type::resize);
+        resize.width = 200;
+        resize.height = 150;
+        Op crop = op(Op::Type::crop);
+        crop.width = 100;
+        crop.height = 150;
+        
+        auto plan = resizer::plan_operations({resize, crop}, 400, 300);
+        REQUIRE(plan.region.x == 0);
+        REQUIRE(plan.region.width == 200);
+        REQUIRE(plan.region.height == 300);
+        REQUIRE(plan.resize.width == 100);
+        REQUIRE(plan.resize.height == 150);
+    }
+    
+    SECTION("Crops map back through rotation") {
+        Op rotate = op(Op::Type::rotate);
+        rotate.degrees = 90;
+        Op crop = op(Op::Type::crop);
+        crop.width = 150;
+        crop.height = 400;
+        
+        // The left half of the rotated image is the bottom half of the source
+        auto plan = resizer::plan_operations({rotate, crop}, 400, 300);
+        REQUIRE(plan.region.y == 150);
+        REQUIRE(plan.region.width == 400);
+        REQUIRE(plan.region.height == 150);
+        REQUIRE(plan.orientation == 6);
+        REQUIRE(plan.output.width == 150);
+        REQUIRE(plan.output.height == 400);
+    }
+    
+    SECTION("Rotations and flips fold into one orientation") {
+        Op rotate = op(Op::Type::rotate);
+        rotate.degrees = 180;
+        Op flip = op(Op::Type::flip);
+        flip.horizontal = true;
+        flip.vertical = true;
+        
+        REQUIRE(resizer::plan_operations({rotate, flip}, 10, 10).orientation == 1);
+        rotate.degrees = 270;
+        REQUIRE(resizer::plan_operations({rotate}, 10, 10).orientation == 8);
+    }
+    
+    SECTION("Decode target reflects the final scale") {
+        Op resize = op(Op::Type::resize);
+        resize.width = 100;
+        auto plan = resizer::plan_operations({resize}, 4000, 3000);
+        REQUIRE(plan.resize.height == 75);
+        auto target = plan.decode_target(4000, 3000);
+        REQUIRE(target.width == 100);
+        REQUIRE(target.height == 75);
+    }
+    
+    SECTION("Invalid operations are rejected") {
+        Op rotate = op(Op::Type::rotate);
+        rotate.degrees = 45;
+        REQUIRE_THROWS_AS(resizer::plan_operations({rotate}, 10, 10), std::invalid_argument);
+        Op crop = op(Op::Type::crop);
+        crop.width = 20;
+        crop.height = 5;
+        REQUIRE_THROWS_AS(resizer::plan_operations({crop}, 10, 10), std::invalid_argument);
+    }
+    
+    SECTION("Pipeline output has the planned size") {
+        Op crop = op(Op::Type::crop);
+        crop.width = 320;
+        crop.height = 240;
+        Op rotate = op(Op::Type::rotate);
+        rotate.degrees = 90;
+        Op resize = op(Op::Type::resize);
+        resize.width = 60;
+        
+        auto result = resizer::run_pipeline(test_utils::create_test_jpeg(640, 480), {crop, resize, rotate});
+        cv::Mat output = cv::imdecode(test_utils::base64_decode(result.image_base64), cv::IMREAD_COLOR);
+        REQUIRE(output.cols == 45);
+        REQUIRE(output.rows == 60);
+    }
+}
+
+TEST_CASE("Cacheable URL API", "[url]") {
+    SECTION("Thumbnail specs") {
+        resizer::ThumbnailSpec spec;
+        REQUIRE(resizer::parse_thumbnail_spec("256x0.webp", spec));
+        REQUIRE(spec.width == 256);
+        REQUIRE(spec.height == 0);
+        REQUIRE(spec.format == "webp");
+        REQUIRE(resizer::parse_thumbnail_spec("64x48.jpg", spec));
+        REQUIRE(spec.format == "jpeg");
+        REQUIRE_FALSE(resizer::parse_thumbnail_spec("0x0.jpg", spec));
+        REQUIRE_FALSE(resizer::parse_thumbnail_spec("64x48.gif", spec));
+        REQUIRE_FALSE(resizer::parse_thumbnail_spec("64x48", spec));
+    }
+    
+    SECTION("Signatures cover the path only") {
+        std::string path = "/img/abc/64x48.jpg";
+        std::string sig = resizer::hmac_sha256_hex("secret", path);
+        std::string target = path + "?sig=" + sig;
+        REQUIRE(resizer::verify_url_signature("secret", resizer::target_path(target), resizer::query_param(target, "sig")));
+        REQUIRE_FALSE(resizer::verify_url_signature("other", path, sig));
+        REQUIRE_FALSE(resizer::verify_url_signature("secret", "/img/abc/65x48.jpg", sig));
+        REQUIRE_FALSE(resizer::verify_url_signature("secret", path, ""));
+    }
+    
+    SECTION("If-None-Match lists and weak validators") {
+        REQUIRE(resizer::etag_matches("W/\"a\", \"b\"", "\"b\""));
+        REQUIRE(resizer::etag_matches("*", "\"b\""));
+        REQUIRE_FALSE(resizer::etag_matches("\"c\"", "\"b\""));
+        REQUIRE_FALSE(resizer::etag_matches("", "\"b\""));
+    }
+    
+    SECTION("Sources are stored under their SHA-256") {
+        std::string root = "/tmp/resizer_store_test_" + std::to_string(::getpid());
+        resizer::SourceStore store(root);
+        std::vector<uint8_t> bytes = {1, 2, 3};
+        std::string hash = store.put(bytes.data(), bytes.size());
+        REQUIRE(hash == "039058c6f2c0cb492c533b0a4d14ef77cc0f78abccced5287d84a1a2011cfb81");
+        REQUIRE(store.get(hash) == bytes);
+        REQUIRE_FALSE(store.get("../../etc/passwd"));
+        REQUIRE_FALSE(store.get(std::string(64, '0')));
+        std::system(("rm -rf " + root).c_str());
+    }
+}
+
+TEST_CASE("Streaming Encoder", "[encoder]") {
+    cv::Mat image(480, 640, CV_8UC3);
+    cv::randu(image, cv::Scalar::all(0), cv::Scalar::all(255));
+    resizer::EncodeOptions options;
+    options.flush_bytes = 4096;
+    
+    SECTION("Output arrives in several flushes and decodes") {
+        std::vector<uint8_t> jpeg;
+        int flushes = 0;
+        resizer::encode_jpeg(image, options, [&](const uint8_t* data, size_t size) {
+            flushes++;
+            jpeg.insert(jpeg.end(), data, data + size);
+        });
+        REQUIRE(flushes > 1);
+        cv::Mat decoded = cv::imdecode(jpeg, cv::IMREAD_COLOR);
+        REQUIRE(decoded.size() == image.size());
+    }
+    
+    SECTION("Sink errors propagate after the encoder is torn down") {
+        auto failing = [](const uint8_t*, size_t) { throw std::runtime_error("client went away"); };
+        REQUIRE_THROWS_WITH(resizer::encode_jpeg(image, options, failing), "client went away");
+    }
+    
+    SECTION("Incremental base64 matches one-shot encoding") {
+        std::vector<uint8_t> bytes = {'r', 'e', 's', 'i', 'z', 'e', 'r', '!'};
+        for (size_t cut = 0; cut <= bytes.size(); ++cut) {
+            std::string streamed;
+            resizer::Base64Writer writer(streamed);
+            writer.write(bytes.data(), cut);
+            writer.write(bytes.data() + cut, bytes.size() - cut);
+            writer.finish();
+            REQUIRE(streamed == resizer::base64_encode(bytes.data(), bytes.size()));
+        }
+    }
+}
+
+TEST_CASE("Result Cache and Pre-generation", "[cache]") {
+    auto result = [](size_t size) {
+        auto r = std::make_shared<resizer::CachedResult>();
+        r->content_type = "image/jpeg";
+        r->bytes.assign(size, 'x');
+        return r;
+    };
+    
+    SECTION("A scan of one-off results does not evict the hot set") {
+        resizer::ResultCache cache(20 * 1200, 10);
+        auto fetch = [&](const std::string& key) {
+            if (!cache.get(key)) cache.put(key, result(1000));
+        };
+        for (int round = 0; round < 5; ++round) {
+            for (int i = 0; i < 8; ++i) fetch("hot" + std::to_string(i));
+        }
+        for (int i = 0; i < 1000; ++i) fetch("scan" + std::to_string(i));
+        
+        for (int i = 0; i < 8; ++i) REQUIRE(cache.contains("hot" + std::to_string(i)));
+        auto stats = cache.stats();
+        REQUIRE(stats.size_bytes <= stats.capacity_bytes);
+        REQUIRE(stats.rejected > 900);
+        REQUIRE(stats.protected_bytes > 0);
+        
+        cache.put("huge", result(100000));
+        REQUIRE_FALSE(cache.contains("huge"));
+    }
+    
+    SECTION("Pre-generated results survive the window of a full cache") {
+        resizer::ResultCache cache(20 * 1200, 10);
+        auto fetch = [&](const std::string& key) {
+            if (!cache.get(key)) cache.put(key, result(1000));
+        };
+        for (int i = 0; i < 40; ++i) fetch("once" + std::to_string(i));
+        for (int round = 0; round < 3; ++round) fetch("hot");
+        
+        cache.put("pregen", result(1000), true);
+        for (int i = 40; i < 44; ++i) fetch("once" + std::to_string(i));
+        REQUIRE(cache.get("pregen") != nullptr);
+        REQUIRE(cache.contains("hot"));
+        
+        // A demand insert with the same single count is still turned away
+        cache.put("demand", result(1000));
+        for (int i = 44; i < 48; ++i) fetch("once" + std::to_string(i));
+        REQUIRE_FALSE(cache.contains("demand"));
+    }
+    
+    SECTION("Frequency sketch counts saturate and age") {
+        resizer::FrequencySketch sketch(64);
+        for (int i = 0; i < 20; ++i) sketch.increment(42);
+        REQUIRE(sketch.estimate(42) == 15);
+        REQUIRE(sketch.estimate(7) == 0);
+        for (uint64_t key = 1000; key < 1000 + 64 * 10; ++key) sketch.increment(key * 0x9E3779B97F4A7C15ULL);
+        REQUIRE(sketch.estimate(42) < 15);
+    }
+    
+    SECTION("Learned specs follow demand on top of the configured ones") {
+        resizer::PregenPlanner::Options options;
+        options.configured = resizer::parse_thumbnail_specs("256x0.jpg,1024x0.webp");
+        options.learned_top_k = 1;
+        options.learned_min_requests = 2;
+        resizer::PregenPlanner planner(options);
+        
+        resizer::ThumbnailSpec popular, rare, configured;
+        REQUIRE(resizer::parse_thumbnail_spec("64x64.jpg", popular));
+        REQUIRE(resizer::parse_thumbnail_spec("32x32.png", rare));
+        REQUIRE(resizer::parse_thumbnail_spec("256x0.jpeg", configured));
+        for (int i = 0; i < 3; ++i) planner.record(popular);
+        for (int i = 0; i < 5; ++i) planner.record(configured);
+        planner.record(rare);
+        
+        auto specs = planner.specs();
+        REQUIRE(specs.size() == 3);
+        REQUIRE(resizer::format_thumbnail_spec(specs[2]) == "64x64.jpeg");
+        
+        REQUIRE(planner.first_sight("abc"));
+        REQUIRE_FALSE(planner.first_sight("abc"));
+        REQUIRE_THROWS_AS(resizer::parse_thumbnail_specs("256x0.gif"), std::invalid_argument);
+    }
+    
+    SECTION("Background jobs are bounded and never take memory others wait for") {
+        resizer::WorkerPool pool(2);
+        std::atomic<int> ran{0};
+        for (int i = 0; i < 4; ++i) REQUIRE(pool.submit_background([&] { ran++; }, 1, 8));
+        REQUIRE(pool.submit([] { return 1; }).get() == 1);
+        while (ran < 4) std::this_thread::yield();
+        
+        resizer::MemoryBudget budget;
+        budget.configure(1000, std::chrono::milliseconds(0));
+        auto held = budget.try_reserve(800);
+        REQUIRE(held);
+        REQUIRE_FALSE(budget.try_reserve(300));
+        REQUIRE(budget.stats().rejections == 0);
+    }
+}
+
+TEST_CASE("Shared-memory Result Cache", "[shm]") {
+    resizer::SharedResultCache::Options options;
+    options.name = "/resizer_test_" + std::to_string(::getpid());
+    options.size_bytes = 8 << 20;
+    options.stripes = 4;
+    resizer::SharedResultCache::unlink(options.name);
+    
+    auto result = [](size_t size, char fill) {
+        auto r = std::make_shared<resizer::CachedResult>();
+        r->content_type = "image/webp";
+        r->bytes.assign(size, fill);
+        return r;
+    };
+    
+    {
+        resizer::SharedResultCache cache(options);
+        REQUIRE(cache.enabled());
+        cache.put("a/64x64.webp", result(5000, 'a'));
+        auto hit = cache.get("a/64x64.webp");
+        REQUIRE(hit);
+        REQUIRE(hit->content_type == "image/webp");
+        REQUIRE(hit->bytes == std::string(5000, 'a'));
+        REQUIRE_FALSE(cache.get("b/64x64.webp"));
+        
+        SECTION("Other attachments see the same entries") {
+            resizer::SharedResultCache other(options);
+            REQUIRE(other.contains("a/64x64.webp"));
+            other.put("a/64x64.webp", result(100, 'b'));
+            REQUIRE(cache.get("a/64x64.webp")->bytes == std::string(100, 'b'));
+            REQUIRE(cache.stats().entries == 1);
+        }
+        
+        SECTION("Full stripes evict and oversized results are skipped") {
+            for (int i = 0; i < 2000; ++i) cache.put("f" + std::to_string(i), result(20000, 'f'));
+            auto stats = cache.stats();
+            REQUIRE(stats.evictions > 0);
+            REQUIRE(stats.used_bytes <= stats.segment_bytes);
+            REQUIRE(cache.contains("f1999"));
+            
+            cache.put("huge", result(1 << 20, 'h'));
+            REQUIRE_FALSE(cache.contains("huge"));
+            REQUIRE(cache.stats().oversized == 1);
+        }
+        
+        SECTION("An existing segment with another layout is refused") {
+            auto different = options;
+            different.stripes = 8;
+            REQUIRE_THROWS_AS(resizer::SharedResultCache(different), std::invalid_argument);
+        }
+    }
+    resizer::SharedResultCache::unlink(options.name);
+}
+
+TEST_CASE("Warm Restart", "[snapshot]") {
+    auto result = [](size_t size, char fill) {
+        auto r = std::make_shared<resizer::CachedResult>();
+        r->content_type = "image/jpeg";
+        r->bytes.assign(size, fill);
+        return r;
+    };
+    std::string path = "/tmp/resizer_snapshot_test_" + std::to_string(::getpid());
+    
+    SECTION("The hot set survives a save and reload") {
+        resizer::ResultCache before(64 * 1200);
+        for (int round = 0; round < 4; ++round) {
+            for (int i = 0; i < 8; ++i) {
+                std::string key = "hot" + std::to_string(i);
+                if (!before.get(key)) before.put(key, result(1000, 'a' + i));
+            }
+        }
+        before.put("cold", result(1000, 'c'));
+        
+        auto saved = before.snapshot(8 * 1000);
+        REQUIRE(saved.size() == 8);
+        REQUIRE(saved.front().key.rfind("hot", 0) == 0);
+        resizer::write_cache_snapshot(path, saved);
+        
+        auto loaded = resizer::read_cache_snapshot(path);
+        REQUIRE(loaded.size() == saved.size());
+        resizer::ResultCache after(64 * 1200);
+        after.restore(loaded);
+        for (int i = 0; i < 8; ++i) {
+            auto hit = after.get("hot" + std::to_string(i));
+            REQUIRE(hit);
+            REQUIRE(hit->bytes == std::string(1000, 'a' + i));
+        }
+        REQUIRE_FALSE(after.contains("cold"));
+    }
+    
+    SECTION("Missing and truncated snapshots") {
+        std::remove(path.c_str());
+        REQUIRE(resizer::read_cache_snapshot(path).empty());
+        
+        resizer::write_cache_snapshot(path, {{"a", result(100, 'a'), 3}, {"b", result(100, 'b'), 1}});
+        REQUIRE(::truncate(path.c_str(), 8 + 13 + 1 + 10 + 100 + 20) == 0);
+        auto loaded = resizer::read_cache_snapshot(path);
+        REQUIRE(loaded.size() == 1);
+        REQUIRE(loaded[0].frequency == 3);
+    }
+    
+    SECTION("Draining waits for in-flight requests") {
+        auto& lifecycle = resizer::lifecycle();
+        REQUIRE(lifecycle.wait_idle(std::chrono::milliseconds(0)));
+        {
+            resizer::InFlightGuard request;
+            REQUIRE(lifecycle.in_flight() == 1);
+            REQUIRE_FALSE(lifecycle.wait_idle(std::chrono::milliseconds(20)));
+        }
+        REQUIRE(lifecycle.wait_idle(std::chrono::milliseconds(0)));
+    }
+    
+    SECTION("Draining leaves the last responses time to be written") {
+        auto& lifecycle = resizer::lifecycle();
+        {
+            resizer::InFlightGuard request;
+        }
+        REQUIRE_FALSE(lifecycle.wait_idle(std::chrono::milliseconds(20), std::chrono::milliseconds(200)));
+        REQUIRE(lifecycle.wait_idle(std::chrono::milliseconds(1000), std::chrono::milliseconds(50)));
+    }
+    std::remove(path.c_str());
+}
+
+TEST_CASE("Listening Socket Handover", "[handover]") {
+    auto listen_on = [](uint16_t port) {
+        int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int one = 1;
+        ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || ::listen(fd, 8) != 0) {
+            ::close(fd);
+            return -1;
+        }
+        return fd;
+    };
+    auto port_of = [](int fd) {
+        sockaddr_in addr{};
+        socklen_t length = sizeof(addr);
+        ::getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &length);
+        return ntohs(addr.sin_port);
+    };
+    std::string path = "/tmp/resizer_handover_test_" + std::to_string(::getpid());
+    
+    SECTION("No predecessor to take over from") {
+        ::unlink(path.c_str());
+        REQUIRE(resizer::HandoverClient::connect(path, std::chrono::milliseconds(1000)) == nullptr);
+    }
+    
+    auto connect_to = [](uint16_t port) {
+        int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        REQUIRE(::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0);
+        return fd;
+    };
+    
+    SECTION("The successor serves the shared socket, backlog included") {
+        int old_listener = listen_on(0);
+        REQUIRE(old_listener >= 0);
+        uint16_t port = port_of(old_listener);
+        REQUIRE(resizer::find_listening_socket(port) == old_listener);
+        REQUIRE(listen_on(port) < 0);
+        
+        auto saves = std::make_shared<std::atomic<int>>(0);
+        auto released = std::make_shared<std::atomic<bool>>(false);
+        resizer::HandoverServer::start(path, std::chrono::milliseconds(5000), {
+            [saves] { return ++*saves > 0; },
+            [port] { return resizer::find_listening_socket(port); },
+            [old_listener] { return resizer::release_listening_socket(old_listener); },
+            [released] { *released = true; },
+        });
+        
+        // Completed by the kernel during the handover; nobody has accepted it yet
+        int queued = connect_to(port);
+        
+        // The successor's server, bound to an ephemeral port and already
+        // waiting in its event loop, as the HTTP server is
+        boost::asio::io_context io;
+        boost::asio::ip::tcp::acceptor acceptor(io, {boost::asio::ip::address_v4::loopback(), 0});
+        int accepted = 0;
+        std::function<void()> accept_next = [&] {
+            acceptor.async_accept([&](const boost::system::error_code& error, boost::asio::ip::tcp::socket) {
+                if (!error) accepted++;
+                accept_next();
+            });
+        };
+        accept_next();
+        io.run_for(std::chrono::milliseconds(20));
+        
+        auto successor = resizer::HandoverClient::connect(path, std::chrono::milliseconds(5000));
+        REQUIRE(successor != nullptr);
+        REQUIRE(successor->save_state());
+        REQUIRE(saves->load() == 1);
+        REQUIRE(resizer::adopt_listening_socket(successor->take_listener(), acceptor.native_handle()));
+        for (int i = 0; i < 100 && accepted < 1; ++i) {
+            io.restart();
+            io.run_for(std::chrono::milliseconds(10));
+        }
+        REQUIRE(accepted == 1);
+        
+        // The predecessor stops accepting without closing the shared socket
+        successor->release_port();
+        for (int i = 0; i < 100 && !released->load(); ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        REQUIRE(released->load());
+        REQUIRE(::fcntl(old_listener, F_GETFD) >= 0);
+        REQUIRE(resizer::find_listening_socket(port) == acceptor.native_handle());
+        int late = connect_to(port);
+        for (int i = 0; i < 100 && accepted < 2; ++i) {
+            io.restart();
+            io.run_for(std::chrono::milliseconds(10));
+        }
+        REQUIRE(accepted == 2);
+        ::close(late);
+        ::close(queued);
+        ::close(old_listener);
+    }
+    
+    SECTION("A successor that fails before taking over leaves the predecessor serving") {
+        int old_listener = listen_on(0);
+        REQUIRE(old_listener >= 0);
+        uint16_t port = port_of(old_listener);
+        resizer::HandoverServer::start(path, std::chrono::milliseconds(5000), {
+            nullptr,
+            [port] { return resizer::find_listening_socket(port); },
+            [old_listener] { return resizer::release_listening_socket(old_listener); },
+            nullptr,
+        });
+        
+        auto failed = resizer::HandoverClient::connect(path, std::chrono::milliseconds(5000));
+        REQUIRE(failed != nullptr);
+        ::close(failed->take_listener());
+        failed.reset();
+        REQUIRE(resizer::find_listening_socket(port) == old_listener);
+        
+        // The next attempt is still answered
+        auto retry = resizer::HandoverClient::connect(path, std::chrono::milliseconds(5000));
+        REQUIRE(retry != nullptr);
+        REQUIRE(retry->save_state());
+        retry.reset();
+        ::close(old_listener);
+    }
+    ::unlink(path.c_str());
+}
+
+TEST_CASE("Container Limits", "[cgroup]") {
+    namespace fs = std::filesystem;
+    fs::path root = "/tmp/resizer_cgroup_test_" + std::to_string(::getpid());
+    auto write = [&](const std::string& relative, const std::string& content) {
+        fs::path path = root / relative;
+        fs::create_directories(path.parent_path());
+        std::ofstream(path) << content;
+    };
+    
+    SECTION("cgroup v2, with a tighter limit on an ancestor") {
+        write("proc/mountinfo", "30 24 0:26 / /sys/fs/cgroup rw,nosuid - cgroup2 cgroup2 rw\n");
+        write("proc/cgroup", "0::/kubepods/pod1/app\n");
+        write("sys/fs/cgroup/kubepods/pod1/cpu.max", "300000 100000\n");
+        write("sys/fs/cgroup/kubepods/pod1/memory.max", "1073741824\n");
+        write("sys/fs/cgroup/kubepods/pod1/app/cpu.max", "max 100000\n");
+        write("sys/fs/cgroup/kubepods/pod1/app/memory.max", "2147483648\n");
+        write("sys/fs/cgroup/kubepods/pod1/app/cpu.stat",
+              "usage_usec 5000\nnr_periods 40\nnr_throttled 7\nthrottled_usec 250000\n");
+        
+        auto limits = resizer::detect_cgroup_limits((root / "proc").string(), root.string());
+        REQUIRE(limits.version == 2);
+        REQUIRE(limits.cpus == 3.0);
+        REQUIRE(limits.memory_bytes == (1ULL << 30));
+        
+        auto throttling = resizer::cpu_throttling(limits);
+        REQUIRE(throttling.periods == 40);
+        REQUIRE(throttling.throttled_periods == 7);
+        REQUIRE(throttling.throttled_seconds == 0.25);
+    }
+    
+    SECTION("cgroup v1 inside a cgroup namespace, without a memory limit") {
+        write("proc/mountinfo",
+              "33 32 0:29 /docker/abc /sys/fs/cgroup/cpu,cpuacct rw - cgroup cgroup rw,cpu,cpuacct\n"
+              "36 32 0:32 /docker/abc /sys/fs/cgroup/memory rw - cgroup cgroup rw,memory\n");
+        write("proc/cgroup", "4:memory:/docker/abc\n2:cpu,cpuacct:/docker/abc\n");
+        write("sys/fs/cgroup/cpu,cpuacct/cpu.cfs_quota_us", "150000\n");
+        write("sys/fs/cgroup/cpu,cpuacct/cpu.cfs_period_us", "100000\n");
+        write("sys/fs/cgroup/memory/memory.limit_in_bytes", "9223372036854771712\n");
+        
+        auto limits = resizer::detect_cgroup_limits((root / "proc").string(), root.string());
+        REQUIRE(limits.version == 1);
+        REQUIRE(limits.cpus == 1.5);
+        REQUIRE(limits.memory_bytes == 0);
+    }
+    
+    SECTION("Empty or malformed limit files are no limit") {
+        write("proc/mountinfo",
+              "33 32 0:29 / /sys/fs/cgroup/cpu,cpuacct rw - cgroup cgroup rw,cpu,cpuacct\n"
+              "36 32 0:32 / /sys/fs/cgroup/memory rw - cgroup cgroup rw,memory\n");
+        write("proc/cgroup", "4:memory:/\n2:cpu,cpuacct:/\n");
+        write("sys/fs/cgroup/cpu,cpuacct/cpu.cfs_quota_us", "\n");
+        write("sys/fs/cgroup/cpu,cpuacct/cpu.cfs_period_us", "100000\n");
+        write("sys/fs/cgroup/memory/memory.limit_in_bytes", "12abc\n");
+        
+        auto limits = resizer::detect_cgroup_limits((root / "proc").string(), root.string());
+        REQUIRE(limits.version == 1);
+        REQUIRE(limits.cpus == 0);
+        REQUIRE(limits.memory_bytes == 0);
+    }
+    
+    SECTION("No cgroup hierarchy") {
+        write("proc/mountinfo", "");
+        write("proc/cgroup", "");
+        auto limits = resizer::detect_cgroup_limits((root / "proc").string(), root.string());
+        REQUIRE(limits.version == 0);
+        REQUIRE(resizer::cpu_throttling(limits).periods == 0);
+    }
+    
+    SECTION("Thread counts follow the quota, rounded down") {
+        resizer::CgroupLimits limits;
+        REQUIRE(resizer::container_cpus(limits, 16) == 16);
+        limits.cpus = 2.5;
+        REQUIRE(resizer::container_cpus(limits, 16) == 2);
+        limits.cpus = 0.5;
+        REQUIRE(resizer::container_cpus(limits, 16) == 1);
+        limits.cpus = 32;
+        REQUIRE(resizer::container_cpus(limits, 16) == 16);
+    }
+    fs::remove_all(root);
+}
+
+TEST_CASE("Tenant Fair Queuing", "[tenants]") {
+    auto spin = [](double seconds) {
+        double start = resizer::detail::thread_cpu_seconds();
+        while (resizer::detail::thread_cpu_seconds() - start < seconds) {
+        }
+    };
+    
+    SECTION("Policies and API keys parse") {
+        auto policies = resizer::parse_tenant_policies("web:weight=8;backfill:concurrency=2,rate=20,burst=40;plain",
+                                                       resizer::parse_tenant_policy("weight=2"));
+        REQUIRE(policies.size() == 3);
+        REQUIRE(policies["web"].weight == 8);
+        REQUIRE(policies["backfill"].weight == 2);
+        REQUIRE(policies["backfill"].max_concurrency == 2);
+        REQUIRE(policies["backfill"].rate == 20);
+        REQUIRE(policies["backfill"].burst == 40);
+        REQUIRE(policies["plain"].weight == 2);
+        REQUIRE_THROWS_AS(resizer::parse_tenant_policy("weight=0"), std::invalid_argument);
+        REQUIRE_THROWS_AS(resizer::parse_tenant_policy("speed=3"), std::invalid_argument);
+        
+        auto keys = resizer::parse_tenant_api_keys("k1=web,k2=backfill");
+        REQUIRE(keys["k2"] == "backfill");
+        REQUIRE_THROWS_AS(resizer::parse_tenant_api_keys("k1"), std::invalid_argument);
+    }
+    
+    SECTION("Token bucket allows the burst, then the rate") {
+        resizer::TokenBucket bucket(10, 2);
+        auto now = resizer::TokenBucket::Clock::now();
+        std::chrono::milliseconds wait{0};
+        REQUIRE(bucket.take(now, wait));
+        REQUIRE(bucket.take(now, wait));
+        REQUIRE_FALSE(bucket.take(now, wait));
+        REQUIRE(wait.count() > 90);
+        REQUIRE(wait.count() <= 101);
+        REQUIRE(bucket.take(now + std::chrono::milliseconds(101), wait));
+    }
+    
+    SECTION("Identity, rate limits and the tenant cap") {
+        resizer::TenantOptions options;
+        options.api_keys["secret"] = "web";
+        options.policies["web"] = resizer::parse_tenant_policy("rate=1,burst=1");
+        options.max_tenants = 2;
+        resizer::TenantRegistry registry;
+        registry.configure(options);
+        
+        REQUIRE(registry.identify("anything", "secret") == "web");
+        REQUIRE(registry.identify("", "unknown") == "default");
+        REQUIRE(registry.identify("bad name", "") == "default");
+        
+        registry.admit("web");
+        REQUIRE_THROWS_AS(registry.admit("web"), resizer::TenantRegistry::rate_limited_error);
+        
+        registry.admit(registry.identify("a", ""));
+        registry.admit(registry.identify("b", ""));
+        REQUIRE(registry.identify("a", "") == "a");
+        REQUIRE(registry.identify("c", "") == "other");
+        
+        // Reconfiguring forgets the unlisted tenants seen so far
+        registry.configure(options);
+        registry.admit(registry.identify("c", ""));
+        REQUIRE(registry.identify("c", "") == "c");
+    }
+    
+    SECTION("Concurrency caps hold") {
+        resizer::WorkerPool pool(4);
+        pool.set_tenant("capped", 1, 1);
+        std::atomic<int> running{0};
+        std::atomic<int> peak{0};
+        std::vector<boost::fibers::future<void>> jobs;
+        {
+            resizer::TenantScope scope("capped");
+            for (int i = 0; i < 12; ++i) {
+                jobs.push_back(pool.submit([&] {
+                    int now = ++running;
+                    int seen = peak.load();
+                    while (now > seen && !peak.compare_exchange_weak(seen, now)) {
+                    }
+                    spin(0.001);
+                    --running;
+                }));
+            }
+        }
+        for (auto& job : jobs) job.get();
+        REQUIRE(peak.load() == 1);
+    }
+    
+    SECTION("A light tenant is not stuck behind a heavy backlog") {
+        resizer::WorkerPool pool(2);
+        std::vector<boost::fibers::future<void>> heavy;
+        std::vector<boost::fibers::future<void>> light;
+        {
+            resizer::TenantScope scope("heavy");
+            for (int i = 0; i < 200; ++i) heavy.push_back(pool.submit([&] { spin(0.002); }));
+        }
+        {
+            resizer::TenantScope scope("light");
+            for (int i = 0; i < 10; ++i) light.push_back(pool.submit([&] { spin(0.002); }));
+        }
+        for (auto& job : light) job.get();
+        // Served alongside the backlog rather than after it
+        size_t heavy_done = 0;
+        for (auto& job : heavy) {
+            if (job.wait_for(std::chrono::seconds(0)) == boost::fibers::future_status::ready) heavy_done++;
+        }
+        REQUIRE(heavy_done < 100);
+        for (auto& job : heavy) job.get();
+        
+        for (const auto& tenant : pool.tenant_stats()) {
+            if (tenant.name == "light") REQUIRE(tenant.cpu_seconds > 0);
+        }
+    }
+}
+
+TEST_CASE("Metrics Rendering", "[metrics]") {
+    SECTION("Values keep every digit") {
+        resizer::MetricsRegistry registry;
+        registry.set("resizer_budget_bytes", 4294967296.0);
+        registry.increment("resizer_requests_total", "code=\"200\"", 1234567);
+        registry.describe("resizer_request_seconds", resizer::MetricsRegistry::Type::summary, "");
+        registry.observe("resizer_request_seconds", 0.1);
+        registry.observe("resizer_request_seconds", 0.2);
+        registry.set("resizer_ratio", 1.0 / 3);
+        
+        std::string text = registry.render();
+        REQUIRE(text.find("resizer_budget_bytes 4294967296\n") != std::string::npos);
+        REQUIRE(text.find("resizer_requests_total{code=\"200\"} 1234567\n") != std::string::npos);
+        REQUIRE(text.find("resizer_request_seconds_sum 0.30000000000000004\n") != std::string::npos);
+        REQUIRE(text.find("resizer_request_seconds_count 2\n") != std::string::npos);
+        REQUIRE(text.find("resizer_ratio 0.3333333333333333\n") != std::string::npos);
+    }
+}
+
+TEST_CASE("Request Timing", "[timing]") {
+    SECTION("Worker jobs charge stages, queue wait and CPU to their request") {
+        resizer::WorkerPool pool(2);
+        auto timing = std::make_shared<resizer::RequestTiming>();
+        std::string input = test_utils::create_test_jpeg(640, 480);
+        {
+            resizer::RequestTimingScope scope(timing);
+            auto output = pool.submit([&] { return resizer::resize_jpeg(input, 100, 75); }).get();
+            REQUIRE_FALSE(output.empty());
+        }
+        for (auto stage : {resizer::Stage::decode, resizer::Stage::resize, resizer::Stage::encode,
+                           resizer::Stage::serialize}) {
+            REQUIRE(timing->seconds(stage) > 0);
+        }
+        REQUIRE(timing->cpu_seconds() > 0);
+        
+        std::string header = timing->server_timing(std::chrono::milliseconds(12));
+        REQUIRE(header.find("decode;dur=") != std::string::npos);
+        REQUIRE(header.find("cpu;dur=") != std::string::npos);
+        REQUIRE(header.size() >= 15);
+        REQUIRE(header.substr(header.size() - 15) == "total;dur=12.00");
+    }
+    
+    SECTION("Work outside a timed request is not charged") {
+        resizer::WorkerPool pool(1);
+        auto timing = std::make_shared<resizer::RequestTiming>();
+        std::string input = test_utils::create_test_jpeg(64, 48);
+        {
+            resizer::RequestTimingScope scope(timing);
+            pool.submit([&] { return resizer::resize_jpeg(input, 32, 24); }).get();
+        }
+        std::string header = timing->server_timing(std::chrono::milliseconds(1));
+        REQUIRE(resizer::current_request_timing() == nullptr);
+        
+        pool.submit([&] { return resizer::resize_jpeg(input, 32, 24); }).get();
+        {
+            resizer::StageTimer timer(resizer::Stage::decode);
+        }
+        REQUIRE(timing->server_timing(std::chrono::milliseconds(1)) == header);
+    }
+}
+
+TEST_CASE("Hardware Counters", "[perf]") {
+    SECTION("Deltas are scaled up for the time the group was multiplexed off the PMU") {
+        resizer::PerfReading begin;
+        begin.counts = {1000, 2000, 10, 20};
+        begin.time_enabled = 100;
+        begin.time_running = 100;
+        resizer::PerfReading end;
+        end.counts = {1500, 3000, 30, 40};
+        end.time_enabled = 300;
+        end.time_running = 200;
+        
+        auto delta = resizer::perf_delta(begin, end);
+        REQUIRE(delta.cycles == 1000);
+        REQUIRE(delta.instructions == 2000);
+        REQUIRE(delta.llc_misses == 40);
+        REQUIRE(delta.branch_misses == 40);
+        
+        end.time_running = begin.time_running;
+        REQUIRE(resizer::perf_delta(begin, end).cycles == 0);
+    }
+    
+    SECTION("Stage totals accumulate until reset") {
+        resizer::StageCounters counters;
+        counters.add(resizer::Stage::decode, {100, 250, 5, 7});
+        counters.add(resizer::Stage::decode, {100, 150, 1, 1});
+        counters.add_source_pixels(2000000);
+        
+        auto totals = counters.totals();
+        const auto& decode = totals.stages[static_cast<size_t>(resizer::Stage::decode)];
+        REQUIRE(decode.cycles == 200);
+        REQUIRE(decode.instructions == 400);
+        REQUIRE(decode.llc_misses == 6);
+        REQUIRE(totals.stages[static_cast<size_t>(resizer::Stage::encode)].cycles == 0);
+        REQUIRE(totals.megapixels() == 2.0);
+        
+        counters.reset();
+        REQUIRE(counters.totals().stages[static_cast<size_t>(resizer::Stage::decode)].cycles == 0);
+        REQUIRE(counters.totals().source_pixels == 0);
+    }
+    
+    SECTION("Stages are counted when the host allows it and skipped otherwise") {
+        resizer::stage_counters().reset();
+        std::string input = test_utils::create_test_jpeg(640, 480);
+        std::string error = resizer::enable_perf_counters();
+        resizer::resize_jpeg(input, 100, 75);
+        auto totals = resizer::stage_counters().totals();
+        resizer::disable_perf_counters();
+        
+        const auto& decode = totals.stages[static_cast<size_t>(resizer::Stage::decode)];
+        if (error.empty()) {
+            REQUIRE(decode.cycles > 0);
+            REQUIRE(decode.instructions > 0);
+            REQUIRE(totals.source_pixels == 640 * 480);
+        } else {
+            // Virtual machines without a PMU, or perf_event_paranoid too high
+            REQUIRE(decode.cycles == 0);
+            REQUIRE(totals.source_pixels == 0);
+        }
+    }
+}
+
+TEST_CASE("Heap Tracking", "[heap]") {
+    SECTION("Peak covers allocations freed before the scope ends") {
+        resizer::HeapPeakScope scope;
+        {
+            std::vector<char> block(4 << 20, 1);
+        }
+        REQUIRE(scope.peak_bytes() >= (4 << 20));
+        REQUIRE(scope.allocations() >= 1);
+    }
+    
+    SECTION("A resize holds at least its decoded frame at peak, and releases it") {
+        std::string input = test_utils::create_test_jpeg(640, 480);
+        int64_t live_before = resizer::heap_usage().live_bytes;
+        resizer::HeapPeakScope scope;
+        std::string output = resizer::resize_jpeg(input, 100, 75);
+        REQUIRE_FALSE(output.empty());
+        REQUIRE(scope.peak_bytes() >= 640 * 480 * 3);
+        REQUIRE(resizer::heap_usage().live_bytes - live_before < 640 * 480);
+    }    
+    SECTION("Nothing is counted outside a scope") {
+        uint64_t before = resizer::heap_usage().allocations;
+        {
+            std::vector<char> block(1 << 20, 1);
+        }
+        REQUIRE(resizer::heap_usage().allocations == before);
+    }
+}